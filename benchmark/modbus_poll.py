@@ -34,12 +34,14 @@ def modbus_poller(id, stop_event, config):
 
         t0 = time()
 
-        address = 0
+        address = config["start_address"]
         for i in poll_range(config["num_controls"], config["chunk_size"]):
             result = client.read_input_registers(address=address, count=i, unit=1)
             address += i
             if result is not None:
-                if result.function_code >= 0x80 and result.function_code != 132:
+                if result.function_code >= 0x80 and config["expect_exceptions"]:
+                    pass
+                elif result.function_code >= 0x80 and result.function_code != 132:
                     log.warn("Server returned error!")
                     print result
                     stop_event.set()
@@ -98,6 +100,9 @@ def main():
     parser.add_argument("-f", "--fq", help="Polling frequency", type=float, required=True)
     parser.add_argument("-n", "--ncontrols", help="Number of registers", type=int, required=True)
     parser.add_argument("--chunk-size", help="Number of registers to read at once", type=int, default=50)
+    parser.add_argument("--start-address", help="First register address to poll", type=int, default=0)
+    parser.add_argument("--expect-exceptions", help="Don't stop on exception replies (invalid address traffic)",
+                        action="store_true")
 
     args = parser.parse_args()
 
@@ -109,6 +114,8 @@ def main():
     config["num_threads"] = args.nthreads
     config["num_controls"] = args.ncontrols
     config["chunk_size"] = args.chunk_size
+    config["start_address"] = args.start_address
+    config["expect_exceptions"] = args.expect_exceptions
 
     if abs(args.fq) < 0.00001:
         print >>sys.stderr, "Warning: limit frequency to 0.00001 Hz (10s interval)"
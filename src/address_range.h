@@ -153,13 +153,8 @@ public:
      */
     bool inRange(int start, unsigned count = 1) const
     {
-        try {
-            getParam(start, count);
-        } catch (const WrongSegmentException&) {
-            return false;
-        }
-
-        return true;
+        auto segment = findSegment(start);
+        return segment != m.end() && segment->second.first >= int(start + count);
     }
 
     /*!
@@ -214,18 +209,80 @@ public:
      */
     T getParam(int start, unsigned count = 1) const
     {
-        auto prev = m.lower_bound(start);
-        if (prev->first != start) {
-            if (prev != m.begin())
-                --prev;
-            else
-                throw WrongSegmentException("incorrect segment");
+        auto segment = findSegment(start);
+        if (segment != m.end() && segment->second.first >= int(start + count))
+            return segment->second.second;
+
+        throw WrongSegmentException("incorrect segment");
+    }
+
+    /*!
+     * Check if area is completely covered by bound segments
+     * (segments which follow one another without gaps).
+     * \param start First address in area
+     * \param count Number of units in area
+     * \return true if whole area is covered
+     */
+    bool covers(int start, int count) const
+    {
+        if (count <= 0)
+            return false;
+
+        auto segment = findSegment(start);
+        if (segment == m.end())
+            return false;
+
+        const int end = start + count;
+        while (segment->second.first < end) {
+            const int segment_end = segment->second.first;
+            ++segment;
+            if (segment == m.end() || segment->first != segment_end)
+                return false;
         }
 
-        if (prev != m.end() && prev->second.first >= int(start + count))
-            return prev->second.second;
+        return true;
+    }
 
-        throw WrongSegmentException("incorrect segment");
+    /*!
+     * Visit bound segments in given area without allocations and exceptions.
+     * \param start First address in area
+     * \param count Number of units in area
+     * \param fn Callable (int start, int count, const T& param), returns false to stop visiting
+     * \return false if area isn't completely covered by bound segments (fn isn't called then)
+     */
+    template<typename F> bool forEachSegment(int start, int count, F&& fn) const
+    {
+        if (!covers(start, count))
+            return false;
+
+        forEachIntersection(start, count, fn);
+        return true;
+    }
+
+    /*!
+     * Visit parts of segments which intersect with given area, gaps are skipped.
+     * \param start First address in area
+     * \param count Number of units in area
+     * \param fn Callable (int start, int count, const T& param), returns false to stop visiting
+     */
+    template<typename F> void forEachIntersection(int start, int count, F&& fn) const
+    {
+        const int end = start + count;
+
+        auto segment = m.upper_bound(start);
+        if (segment != m.begin())
+            --segment;
+
+        for (; segment != m.end() && segment->first < end; ++segment) {
+            const int s_start = std::max(segment->first, start);
+            const int s_end = std::min(segment->second.first, end);
+
+            if (s_start >= s_end)
+                continue;
+
+            if (!fn(s_start, s_end - s_start, segment->second.second))
+                break;
+        }
     }
 
     /*!
@@ -240,28 +297,12 @@ public:
     {
         std::vector<TAddressRange<T>> reply;
 
-        auto prev = m.lower_bound(start);
-        if (prev->first != start) {
-            if (prev != m.begin())
-                --prev;
-            else
-                throw WrongSegmentException("area out of bounds");
-        }
-
-        while (count > 0 && prev != m.end()) {
-            const int s_size = prev->second.first - start;
-
-            reply.push_back(TAddressRange<T>(start, std::min(s_size, count), prev->second.second));
-
-            start += s_size;
-            count -= s_size;
-            ++prev;
-
-            if (count > 0 && prev->first != start)
-                throw WrongSegmentException("sparce area");
-        }
+        bool covered = forEachSegment(start, count, [&](int s_start, int s_count, const T& param) {
+            reply.push_back(TAddressRange<T>(s_start, s_count, param));
+            return true;
+        });
 
-        if (count > 0)
+        if (!covered)
             throw WrongSegmentException("area out of bounds");
 
         return reply;
@@ -324,6 +365,27 @@ public:
         m.clear();
     }
 
+    /*!
+     * Remove all segments with given user param
+     * \param obs User param
+     * \return true if any segment was removed
+     */
+    bool erase(const T& obs)
+    {
+        bool removed = false;
+
+        for (auto segment = m.begin(); segment != m.end();) {
+            if (segment->second.second == obs) {
+                segment = m.erase(segment);
+                removed = true;
+            } else {
+                ++segment;
+            }
+        }
+
+        return removed;
+    }
+
     /*! Iterator */
     typename std::map<int, std::pair<int, T>>::const_iterator cbegin() const
     {
@@ -339,6 +401,19 @@ public:
     template<typename U> friend std::ostream& operator<<(std::ostream& str, const TAddressRange<U>& range);
 
 protected:
+    /*! Find segment which contains given address
+     * \return Segment iterator or end() if address is not in range
+     */
+    typename std::map<int, std::pair<int, T>>::const_iterator findSegment(int address) const
+    {
+        auto segment = m.upper_bound(address);
+        if (segment == m.begin())
+            return m.cend();
+
+        --segment;
+        return segment->second.first > address ? segment : m.cend();
+    }
+
     std::map<int, std::pair<int, T>> m;
 };
 
@@ -0,0 +1,228 @@
+#include "cache_snapshot.h"
+
+#include "log.h"
+#include "modbus_encoder.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG(logger) ::logger.Log() << "[snapshot] "
+
+using namespace std;
+
+namespace
+{
+    // "WBMC"
+    constexpr uint32_t SNAPSHOT_MAGIC = 0x434D4257;
+    constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+    struct THeader
+    {
+        uint32_t Magic;
+        uint32_t Version;
+        uint64_t Fingerprint;
+        uint32_t SegmentCount;
+        uint32_t Dirty; /*!< Non-zero while values are copied */
+    };
+
+    struct TSegmentInfo
+    {
+        uint8_t UnitId;
+        uint8_t Type;
+        uint16_t Start;
+        uint32_t Count;
+    };
+
+    bool IsBit(const TModbusCacheSegment& segment)
+    {
+        return segment.Type == COIL || segment.Type == DISCRETE_INPUT;
+    }
+
+    /*! Size of segment in file, bits take one byte each there, so file doesn't depend on cache layout */
+    size_t SegmentSize(const TModbusCacheSegment& segment)
+    {
+        return segment.Count * (IsBit(segment) ? sizeof(uint8_t) : sizeof(uint16_t));
+    }
+
+    size_t FileSize(const vector<TModbusCacheSegment>& segments)
+    {
+        size_t size = sizeof(THeader) + segments.size() * sizeof(TSegmentInfo);
+        for (const auto& segment: segments)
+            size += SegmentSize(segment);
+
+        return size;
+    }
+
+    TSegmentInfo MakeInfo(const TModbusCacheSegment& segment)
+    {
+        return TSegmentInfo{segment.UnitId, uint8_t(segment.Type), uint16_t(segment.Start), uint32_t(segment.Count)};
+    }
+}
+
+TModbusCacheSnapshot::TModbusCacheSnapshot(const string& path, uint64_t fingerprint, chrono::seconds interval)
+    : Path(path),
+      Fingerprint(fingerprint),
+      Interval(interval),
+      LastSave(chrono::steady_clock::now()),
+      Attached(false),
+      Memory(nullptr),
+      MemorySize(0)
+{}
+
+TModbusCacheSnapshot::~TModbusCacheSnapshot()
+{
+    // cache may be already freed, so nothing is saved here
+    Unmap();
+}
+
+void TModbusCacheSnapshot::SetFingerprint(uint64_t fingerprint)
+{
+    Fingerprint = fingerprint;
+}
+
+void TModbusCacheSnapshot::Unmap()
+{
+    if (Memory)
+        munmap(Memory, MemorySize);
+
+    Memory = nullptr;
+    MemorySize = 0;
+}
+
+void TModbusCacheSnapshot::Attach(const vector<TModbusCacheSegment>& segments)
+{
+    Unmap();
+    Segments = segments;
+
+    int fd = open(Path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOG(Error) << "Can't open cache snapshot " << Path << ": " << strerror(errno);
+        return;
+    }
+
+    // values are restored on start only, later calls come from config reload
+    if (!Attached) {
+        Attached = true;
+
+        if (Restore(fd)) {
+            LOG(Info) << "Cache restored from snapshot " << Path;
+        } else {
+            LOG(Info) << "Snapshot " << Path << " doesn't match config, cache starts empty";
+        }
+    }
+
+    const size_t size = FileSize(segments);
+
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (memory == MAP_FAILED) {
+        LOG(Error) << "Can't map cache snapshot " << Path << ": " << strerror(errno);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    Memory = memory;
+    MemorySize = size;
+
+    THeader* header = static_cast<THeader*>(Memory);
+    *header = THeader{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, Fingerprint, uint32_t(segments.size()), 1};
+
+    TSegmentInfo* info = reinterpret_cast<TSegmentInfo*>(header + 1);
+    for (const auto& segment: segments)
+        *info++ = MakeInfo(segment);
+
+    Save();
+}
+
+bool TModbusCacheSnapshot::Restore(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) != FileSize(Segments))
+        return false;
+
+    void* memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    const THeader* header = static_cast<const THeader*>(memory);
+    const TSegmentInfo* info = reinterpret_cast<const TSegmentInfo*>(header + 1);
+
+    // values are restored only if config is the same and last checkpoint was complete
+    bool match = header->Magic == SNAPSHOT_MAGIC && header->Version == SNAPSHOT_VERSION &&
+                 header->Fingerprint == Fingerprint && !header->Dirty && header->SegmentCount == Segments.size();
+
+    for (size_t i = 0; match && i < Segments.size(); ++i) {
+        const TSegmentInfo expected = MakeInfo(Segments[i]);
+        match = memcmp(&info[i], &expected, sizeof(expected)) == 0;
+    }
+
+    if (match) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(info + Segments.size());
+        for (const auto& segment: Segments) {
+            if (IsBit(segment)) {
+                ModbusEncoder::StoreBits(static_cast<uint8_t*>(segment.Cache), segment.Start % 8, data, segment.Count);
+            } else {
+                memcpy(segment.Cache, data, SegmentSize(segment));
+            }
+            data += SegmentSize(segment);
+        }
+    }
+
+    munmap(memory, st.st_size);
+    return match;
+}
+
+void TModbusCacheSnapshot::SaveIfDue()
+{
+    if (chrono::steady_clock::now() - LastSave >= Interval)
+        Save();
+}
+
+void TModbusCacheSnapshot::Save(bool sync)
+{
+    LastSave = chrono::steady_clock::now();
+
+    if (!Memory)
+        return;
+
+    THeader* header = static_cast<THeader*>(Memory);
+    uint8_t* data = reinterpret_cast<uint8_t*>(header + 1) + Segments.size() * sizeof(TSegmentInfo);
+
+    // crash in the middle of copying leaves dirty flag set, such snapshot is not restored,
+    // so the flag is on storage before values and is cleared only after values are there
+    header->Dirty = 1;
+    if (!Sync(sizeof(THeader), MS_SYNC))
+        return;
+
+    for (const auto& segment: Segments) {
+        if (IsBit(segment)) {
+            ModbusEncoder::LoadBits(data, static_cast<const uint8_t*>(segment.Cache), segment.Start % 8, segment.Count);
+        } else {
+            memcpy(data, segment.Cache, SegmentSize(segment));
+        }
+        data += SegmentSize(segment);
+    }
+
+    if (!Sync(MemorySize, MS_SYNC))
+        return;
+
+    header->Dirty = 0;
+    Sync(sizeof(THeader), sync ? MS_SYNC : MS_ASYNC);
+}
+
+bool TModbusCacheSnapshot::Sync(size_t size, int flags)
+{
+    if (msync(Memory, size, flags) < 0) {
+        LOG(Error) << "Can't write cache snapshot " << Path << ": " << strerror(errno);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/*!
+ * \file cache_snapshot.h
+ * \brief Snapshot of Modbus cache in file for warm start
+ */
+
+#include "modbus_wrapper.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*! Modbus cache checkpointed into mmap-backed file
+ * File keeps fingerprint of registers config and layout of cache segments. On start
+ * with the same config cache is restored from file, so clients get last known values
+ * instead of zeros until MQTT retained messages are received.
+ *
+ * File layout (host byte order):
+ *
+ *     THeader header;
+ *     TSegmentInfo segments[header.SegmentCount];
+ *     uint8_t data[];  // segment values one after another, 1 byte per bit, 2 bytes per register
+ */
+class TModbusCacheSnapshot
+{
+public:
+    /*! Create snapshot, file is opened on first Attach()
+     * \param path Snapshot file path
+     * \param fingerprint Fingerprint of registers config
+     * \param interval Checkpoint interval
+     */
+    TModbusCacheSnapshot(const std::string& path, uint64_t fingerprint, std::chrono::seconds interval);
+    ~TModbusCacheSnapshot();
+
+    /*! Set fingerprint of changed config, applied on next Attach() */
+    void SetFingerprint(uint64_t fingerprint);
+
+    /*! Bind snapshot to cache segments
+     * On first call cache is restored from file if its fingerprint and layout match.
+     * File is resized for new layout and filled with current values.
+     */
+    void Attach(const std::vector<TModbusCacheSegment>& segments);
+
+    /*! Checkpoint cache if interval has passed since last one */
+    void SaveIfDue();
+
+    /*! Checkpoint cache
+     * Values are always on storage before checkpoint is marked complete.
+     * \param sync Wait for complete mark to be written to storage
+     */
+    void Save(bool sync = false);
+
+private:
+    /*! Try to fill cache from file, returns false if file doesn't match */
+    bool Restore(int fd);
+
+    void Unmap();
+
+    /*! Write first size bytes of mapped file, flags are passed to msync() */
+    bool Sync(size_t size, int flags);
+
+    std::string Path;
+    uint64_t Fingerprint;
+    std::chrono::seconds Interval;
+    std::chrono::steady_clock::time_point LastSave;
+
+    bool Attached;
+    std::vector<TModbusCacheSegment> Segments;
+
+    void* Memory;
+    size_t MemorySize;
+};
+
+typedef std::shared_ptr<TModbusCacheSnapshot> PModbusCacheSnapshot;
@@ -1,21 +1,33 @@
 #include "config_parser.h"
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <time.h>
 #include <tuple>
 #include <unistd.h>
+#include <vector>
 
 #include <wblib/json_utils.h>
 #include <wblib/mqtt.h>
 
 #include "log.h"
 #include "mbgate_exception.h"
+#include "modbus_encoder.h"
 #include "modbus_lmb_backend.h"
 #include "mqtt_converters.h"
+#include "mqtt_dispatcher.h"
+#include "cache_snapshot.h"
 #include "observer.h"
+#include "publish_queue.h"
+#include "register_group.h"
+#include "shm_export.h"
+#include "stats_publisher.h"
+#include "update_queue.h"
 
 using namespace std;
 using namespace WBMQTT;
@@ -25,21 +37,49 @@ using namespace WBMQTT::JSON;
 
 namespace
 {
+    const int DEFAULT_SNAPSHOT_INTERVAL_S = 10;
+    const int DEFAULT_UPDATE_QUEUE_SIZE = 4096;
+    const int DEFAULT_PUBLISH_QUEUE_SIZE = 1024;
+    const int STATS_INTERVAL_S = 10;
+    const int DEFAULT_PULL_TIMEOUT_MS = 1000;
+
     string expandTopic(const string& t)
     {
         auto lst = StringSplit(t, '/');
         return string("/devices/") + lst[0] + "/controls/" + lst[1];
     }
+
+    /*! FNV-1a hash of registers config, snapshot of cache is valid for the same registers only */
+    uint64_t Fingerprint(const Json::Value& root)
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (unsigned char c: root["registers"].toStyledString()) {
+            hash ^= c;
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
 };
 
 IConfigParser::~IConfigParser()
 {}
 
-TJSONConfigParser::TJSONConfigParser(const string& config_file, const string& schema_file): Root(Parse(config_file))
+TJSONConfigParser::TJSONConfigParser(const string& config_file, const string& schema_file)
+    : ConfigFile(config_file),
+      SchemaFile(schema_file)
 {
+    Root = _ParseConfig();
+}
+
+Json::Value TJSONConfigParser::_ParseConfig()
+{
+    auto root(Parse(ConfigFile));
+
     try {
-        auto schema(Parse(schema_file));
-        Validate(Root, schema);
+        auto schema(Parse(SchemaFile));
+        Validate(root, schema);
+        return root;
     } catch (const std::runtime_error& e) {
         throw TConfigException(e.what());
     }
@@ -67,21 +107,46 @@ tuple<PModbusServer, PMqttClient> TJSONConfigParser::Build()
         args.DataBits = modbus_data.get("data_bits", args.DataBits).asInt();
         args.StopBits = modbus_data.get("stop_bits", args.StopBits).asInt();
         args.Parity = modbus_data.get("parity", std::string(1, args.Parity)).asString()[0];
+        args.QueueSize = modbus_data.get("queue_size", DEFAULT_QUERY_QUEUE_SIZE).asUInt();
 
         LOG(Debug) << "Modbus configuration: device " << args.Device << ", baud rate " << args.BaudRate << ", parity "
-                   << args.Parity << ", data bits " << args.DataBits << ", stop bits " << args.StopBits;
+                   << args.Parity << ", data bits " << args.DataBits << ", stop bits " << args.StopBits
+                   << ", queue size " << args.QueueSize;
 
         modbusBackend = make_shared<TModbusRTUBackend>(args);
     } else {
         string modbus_host = modbus_data["host"].asString();
         int modbus_port = modbus_data["port"].asInt();
+        size_t queue_size = modbus_data.get("queue_size", DEFAULT_QUERY_QUEUE_SIZE).asUInt();
 
-        LOG(Debug) << "Modbus configuration: host " << modbus_host << ", port " << modbus_port;
-        modbusBackend = make_shared<TModbusTCPBackend>(modbus_host.c_str(), modbus_port);
+        LOG(Debug) << "Modbus configuration: host " << modbus_host << ", port " << modbus_port << ", queue size "
+                   << queue_size;
+        modbusBackend = make_shared<TModbusTCPBackend>(modbus_host.c_str(), modbus_port, queue_size);
     }
 
     PModbusServer modbus = make_shared<TModbusServer>(modbusBackend);
 
+    // optional mirror of cache for local readers
+    string shm_export = Root.get("shm_export", "").asString();
+    if (!shm_export.empty()) {
+        ShmExport = make_shared<TModbusShmExport>(shm_export);
+        modbus->SetShmExport(ShmExport);
+
+        LOG(Debug) << "Shared memory export: " << shm_export;
+    }
+
+    // last known values are served after restart until MQTT brings new ones
+    string snapshot = Root.get("cache_snapshot", "").asString();
+    if (!snapshot.empty()) {
+        int interval = Root.get("cache_snapshot_interval", DEFAULT_SNAPSHOT_INTERVAL_S).asInt();
+        CacheSnapshot = make_shared<TModbusCacheSnapshot>(snapshot, Fingerprint(Root), chrono::seconds(interval));
+        modbus->SetCacheSnapshot(CacheSnapshot);
+
+        LOG(Debug) << "Cache snapshot: " << snapshot << ", interval " << interval << " s";
+    }
+
+    _ApplyServerOptions(Root, modbus);
+
     // create MQTT client
     string mqtt_host = Root["mqtt"]["host"].asString();
     int mqtt_port = Root["mqtt"]["port"].asInt();
@@ -97,92 +162,547 @@ tuple<PModbusServer, PMqttClient> TJSONConfigParser::Build()
     mqtt_config.Keepalive = mqtt_keepalive;
     mqtt_config.Id = string("mqtt-mbgate-") + to_string(time(NULL));
 
-    PMqttClient mqtt = NewMosquittoMqttClient(mqtt_config);
+    // one subscription per device instead of one per register
+    auto dispatcher = make_shared<TMqttTopicDispatcher>(NewMosquittoMqttClient(mqtt_config));
+    PMqttClient mqtt = dispatcher;
 
-    bool any_enabled = false;
+    // floods of MQTT messages are converted once per register by Modbus thread
+    int queue_size = Root["mqtt"].get("update_queue_size", DEFAULT_UPDATE_QUEUE_SIZE).asInt();
+    if (queue_size > 0) {
+        UpdateQueue = make_shared<TUpdateQueue>(queue_size);
+        modbus->SetUpdateQueue(UpdateQueue);
 
-    // create observers and link'em with MQTT and Modbus
-    any_enabled |= _BuildStore(COIL, Root["registers"]["coils"], modbus, mqtt);
-    any_enabled |= _BuildStore(DISCRETE_INPUT, Root["registers"]["discretes"], modbus, mqtt);
-    any_enabled |= _BuildStore(HOLDING_REGISTER, Root["registers"]["holdings"], modbus, mqtt);
-    any_enabled |= _BuildStore(INPUT_REGISTER, Root["registers"]["inputs"], modbus, mqtt);
+        LOG(Debug) << "MQTT update queue size: " << queue_size;
+    }
+
+    // Modbus writes are replied before their values reach broker
+    int publish_queue_size = Root["mqtt"].get("publish_queue_size", DEFAULT_PUBLISH_QUEUE_SIZE).asInt();
+    if (publish_queue_size > 0) {
+        string full = Root["mqtt"].get("publish_queue_full", "busy").asString();
+        auto policy = (full == "block") ? TPublishQueue::BLOCK : TPublishQueue::REJECT;
+        PublishQueue = make_shared<TPublishQueue>(mqtt, publish_queue_size, policy);
+
+        LOG(Debug) << "MQTT publish queue size: " << publish_queue_size << ", on full queue: " << full;
+    } else if (Root["mqtt"].get("min_publish_interval_ms", 0).asInt() > 0) {
+        LOG(Warn) << "min_publish_interval_ms is ignored, as MQTT publish queue is disabled";
+    }
 
-    if (!any_enabled) {
+    WriteAckStats = make_shared<TWriteAckStats>();
+
+    string stats_device = Root.get("stats_device", "").asString();
+    if (!stats_device.empty()) {
+        Stats = make_shared<TStatsPublisher>(mqtt, stats_device, chrono::seconds(STATS_INTERVAL_S));
+        modbus->SetStatsPublisher(Stats);
+
+        if (UpdateQueue) {
+            auto queue = UpdateQueue;
+            Stats->AddCounter("update_queue_depth", [queue] { return queue->GetStats().Depth; });
+            Stats->AddCounter("update_queue_max_batch", [queue] { return queue->GetStats().MaxBatch; });
+            Stats->AddCounter("updates_queued", [queue] { return queue->GetStats().Queued; });
+            Stats->AddCounter("updates_coalesced", [queue] { return queue->GetStats().Coalesced; });
+            Stats->AddCounter("updates_applied", [queue] { return queue->GetStats().Applied; });
+            Stats->AddCounter("update_queue_overflows", [queue] { return queue->GetStats().Overflows; });
+        }
+
+        if (PublishQueue) {
+            auto queue = PublishQueue;
+            Stats->AddCounter("publish_queue_depth", [queue] { return queue->GetStats().Depth; });
+            Stats->AddCounter("publish_queue_max_batch", [queue] { return queue->GetStats().MaxBatch; });
+            Stats->AddCounter("published", [queue] { return queue->GetStats().Published; });
+            Stats->AddCounter("publish_rejected", [queue] { return queue->GetStats().Rejected; });
+            Stats->AddCounter("publish_coalesced", [queue] { return queue->GetStats().Coalesced; });
+        }
+
+        Stats->AddCounter("mqtt_ready_time_ms", [dispatcher] { return dispatcher->GetReadyTime().count(); });
+        Stats->AddCounter("mqtt_sync_count", [dispatcher] { return dispatcher->GetSyncCount(); });
+        Stats->AddCounter("mqtt_subscriptions", [dispatcher] { return dispatcher->GetSubscriptionCount(); });
+
+        auto acks = WriteAckStats;
+        Stats->AddCounter("write_acks", [acks] { return acks->Acked.load(); });
+        Stats->AddCounter("write_ack_timeouts", [acks] { return acks->Timeouts.load(); });
+        Stats->AddCounter("write_ack_latency_ms", [acks] { return acks->LastLatencyMs.load(); });
+        Stats->AddCounter("write_ack_latency_max_ms", [acks] { return acks->MaxLatencyMs.load(); });
+        Stats->AddCounter("write_ack_latency_avg_ms", [acks] {
+            const uint64_t acked = acks->Acked.load();
+            return acked ? acks->TotalLatencyMs.load() / acked : 0;
+        });
+
+        LOG(Debug) << "Gateway counters are published to device " << stats_device;
+    }
+
+    auto bindings = _ParseBindings(Root);
+    if (bindings.empty()) {
         throw TEmptyConfigException();
     }
 
+    _CheckOverlaps(bindings);
+    _CheckGroups(Root, bindings);
+
+    Groups = _CreateGroups(Root, mqtt);
+    _SetServerGroups(modbus);
+
+    // create observers and link'em with MQTT and Modbus
+    for (const auto& binding: bindings) {
+        _Bind(Root, binding, modbus, mqtt);
+    }
+
     return make_tuple(modbus, mqtt);
 }
 
-bool TJSONConfigParser::_BuildStore(TStoreType type, const Json::Value& list, PModbusServer modbus, PMqttClient mqtt)
+void TJSONConfigParser::Reload(PModbusServer modbus, PMqttClient mqtt)
 {
-    LOG(Debug) << "Processing store " << type;
+    LOG(Info) << "Reloading configuration from " << ConfigFile;
 
-    bool enabled = false;
+    auto root = _ParseConfig();
+    auto bindings = _ParseBindings(root);
+    if (bindings.empty()) {
+        throw TConfigException("All channels are disabled in new configuration");
+    }
+
+    // reject whole config before touching running gateway
+    _CheckOverlaps(bindings);
+    _CheckGroups(root, bindings);
+
+    if (root["modbus"] != Root["modbus"] || root["mqtt"] != Root["mqtt"] ||
+        root["shm_export"] != Root["shm_export"] || root["cache_snapshot"] != Root["cache_snapshot"] ||
+        root["cache_snapshot_interval"] != Root["cache_snapshot_interval"] ||
+        root["stats_device"] != Root["stats_device"])
+    {
+        LOG(Warn) << "Modbus port, MQTT connection, shared memory export, cache snapshot and statistics settings "
+                     "changes require service restart";
+    }
+
+    // previous reload retirees got enough time to finish their handlers
+    RetiredObservers.clear();
 
-    for (const auto& reg_item: list) {
-        if (!reg_item["enabled"].asBool()) {
+    set<string> keep;
+    for (const auto& binding: bindings) {
+        keep.insert(binding.Key);
+    }
+
+    set<string> unsubscribed;
+    for (auto it = Bindings.begin(); it != Bindings.end();) {
+        if (keep.count(it->first)) {
+            ++it;
             continue;
         }
-        enabled = true;
 
-        int address = reg_item["address"].asInt();
-        int slave_id = reg_item["unitId"].asInt();
-        string topic = reg_item["topic"].asString();
-        int size;
+        LOG(Debug) << "Removing observer " << it->second.Topic;
+
+        modbus->Unobserve(it->second.Observer);
+        if (unsubscribed.insert(it->second.Topic).second) {
+            mqtt->Unsubscribe(it->second.Topic);
+        }
+        RetiredObservers.push_back(it->second.Observer);
+
+        for (const auto& companion: it->second.Companions) {
+            modbus->Unobserve(companion);
+        }
+
+        const string& error_topic = it->second.ErrorTopic;
+        if (!error_topic.empty() && unsubscribed.insert(error_topic).second) {
+            mqtt->Unsubscribe(error_topic);
+        }
+
+        it = Bindings.erase(it);
+    }
+
+    // groups are recreated, new ones subscribe to their triggers again
+    for (const auto& group: Groups) {
+        const string& trigger = group.second->GetTrigger();
+        if (!trigger.empty() && unsubscribed.insert(trigger).second) {
+            mqtt->Unsubscribe(trigger);
+        }
+    }
+
+    // unsubscription drops handlers of all observers on the topic
+    for (const auto& binding: Bindings) {
+        if (unsubscribed.count(binding.second.Topic)) {
+            binding.second.Subscribe();
+        }
+        if (!binding.second.ErrorTopic.empty() && unsubscribed.count(binding.second.ErrorTopic)) {
+            binding.second.SubscribeErrors();
+        }
+    }
+
+    auto old_groups = Groups;
+    Groups = _CreateGroups(root, mqtt);
+
+    // kept registers have the same group name, as it is part of their config
+    for (const auto& binding: Bindings) {
+        auto obs = dynamic_pointer_cast<TGatewayObserver>(binding.second.Observer);
+        if (obs) {
+            obs->SetGroup(binding.second.Group.empty() ? nullptr : Groups[binding.second.Group]);
+        }
+    }
+
+    // values staged before reload go to cache before it is reallocated
+    for (const auto& group: old_groups) {
+        group.second->Commit(true);
+    }
+    _SetServerGroups(modbus);
+
+    size_t added = 0;
+    for (const auto& binding: bindings) {
+        if (!Bindings.count(binding.Key)) {
+            _Bind(root, binding, modbus, mqtt);
+            ++added;
+        }
+    }
+
+    if (CacheSnapshot)
+        CacheSnapshot->SetFingerprint(Fingerprint(root));
 
-        LOG(Debug) << "Element " << topic << " : " << address;
+    // grows Modbus mappings keeping values of unchanged registers
+    modbus->AllocateCache();
+    _ApplyServerOptions(root, modbus);
 
-        PGatewayObserver obs;
-        PMQTTConverter conv;
+    Root = root;
 
-        if (type == COIL || type == DISCRETE_INPUT) {
-            conv = make_shared<TMQTTDiscrConverter>();
-            size = 1;
+    LOG(Info) << "Configuration reloaded: " << RetiredObservers.size() << " items removed, " << added << " added";
+}
+
+void TJSONConfigParser::FlushPublishQueue()
+{
+    if (PublishQueue)
+        PublishQueue->Stop();
+}
+
+void TJSONConfigParser::_ApplyServerOptions(const Json::Value& root, PModbusServer modbus)
+{
+    const auto& modbus_data = root["modbus"];
+
+    // RTU bus is shared with other devices, so only TCP gateway may answer for unknown units
+    if (!modbus_data.isMember("path")) {
+        string unknown_unit = modbus_data.get("unknown_unit_reply", "ignore").asString();
+
+        if (unknown_unit == "path_unavailable") {
+            modbus->SetUnknownUnitReply(REPLY_GATEWAY_PATH_UNAVAILABLE);
+        } else if (unknown_unit == "target_failed") {
+            modbus->SetUnknownUnitReply(REPLY_GATEWAY_TARGET_FAILED);
         } else {
-            string format = reg_item["format"].asString();
-            bool byteswap = reg_item["byteswap"].asBool();
-            bool wordswap = reg_item["wordswap"].asBool();
-            size = reg_item["size"].asInt();
-
-            if (format == "varchar") {
-                // old version config may contain varchar registers with negative size value (-1)
-                // set this registers size to 1
-                if (size < 0)
-                    size = 1;
-                conv = make_shared<TMQTTTextConverter>(size, byteswap, wordswap);
-            } else if (format == "float") {
-                double scale = reg_item["scale"].asFloat();
-                conv = make_shared<TMQTTFloatConverter>(size, byteswap, wordswap, scale);
-                size /= 2;
+            modbus->SetUnknownUnitReply(REPLY_OK);
+        }
+
+        LOG(Debug) << "Reply on unknown unit IDs: " << unknown_unit;
+    }
+}
+
+vector<TJSONConfigParser::TBindingConfig> TJSONConfigParser::_ParseBindings(const Json::Value& root)
+{
+    static const vector<pair<TStoreType, string>> stores = {{COIL, "coils"},
+                                                            {DISCRETE_INPUT, "discretes"},
+                                                            {HOLDING_REGISTER, "holdings"},
+                                                            {INPUT_REGISTER, "inputs"}};
+
+    vector<TBindingConfig> bindings;
+
+    for (const auto& store: stores) {
+        LOG(Debug) << "Processing store " << store.first;
+
+        for (const auto& reg_item: root["registers"][store.second]) {
+            if (!reg_item["enabled"].asBool()) {
+                continue;
+            }
+
+            TBindingConfig binding;
+            binding.Key = store.second + ":" + reg_item.toStyledString();
+            binding.Type = store.first;
+            binding.IsFile = false;
+            binding.SlaveId = reg_item["unitId"].asInt();
+            binding.Address = reg_item["address"].asInt();
+            binding.Topic = expandTopic(reg_item["topic"].asString());
+            binding.Group = reg_item.get("group", "").asString();
+            binding.Item = reg_item;
+
+            if (store.first == COIL || store.first == DISCRETE_INPUT) {
+                binding.Size = 1;
             } else {
-                double scale = reg_item["scale"].asFloat();
-
-                TMQTTIntConverter::IntegerType int_type;
-                if (format == "signed") {
-                    int_type = TMQTTIntConverter::SIGNED;
-                } else if (format == "unsigned") {
-                    int_type = TMQTTIntConverter::UNSIGNED;
-                } else if (format == "bcd") {
-                    int_type = TMQTTIntConverter::BCD;
+                string format = reg_item["format"].asString();
+                binding.Size = reg_item["size"].asInt();
+
+                if (format == "varchar") {
+                    // old version config may contain varchar registers with negative size value (-1)
+                    // set this registers size to 1
+                    if (binding.Size < 0)
+                        binding.Size = 1;
+                } else if (format == "float" || format == "signed" || format == "unsigned" || format == "bcd") {
+                    binding.Size /= 2;
                 } else {
                     throw TConfigException("Unknown integer format: " + format);
                 }
+            }
+
+            // without freshness window every read would request value
+            if (reg_item.isMember("pull_topic") && reg_item.get("max_age_ms", 0).asInt() <= 0) {
+                throw TConfigException("Pull mode needs max_age_ms: topic " + reg_item["topic"].asString());
+            }
 
-                conv = make_shared<TMQTTIntConverter>(int_type, scale, size, byteswap, wordswap);
-                size /= 2;
+            // Read FIFO Queue reply holds whole values only
+            if (store.first == HOLDING_REGISTER && reg_item.get("fifo_size", 0).asUInt() &&
+                size_t(binding.Size) > ModbusEncoder::MAX_FIFO_COUNT)
+            {
+                throw TConfigException("Register is too large for FIFO: topic " + reg_item["topic"].asString());
             }
+
+            LOG(Debug) << "Element " << reg_item["topic"].asString() << " : " << binding.Address;
+
+            bindings.push_back(binding);
+        }
+    }
+
+    LOG(Debug) << "Processing files";
+
+    for (const auto& file_item: root["registers"]["files"]) {
+        if (!file_item["enabled"].asBool()) {
+            continue;
+        }
+
+        TBindingConfig binding;
+        binding.Key = "files:" + file_item.toStyledString();
+        binding.Type = HOLDING_REGISTER;
+        binding.IsFile = true;
+        binding.SlaveId = file_item["unitId"].asInt();
+        binding.Address = file_item["file"].asInt();
+        binding.Size = file_item["size"].asInt();
+        binding.Topic = expandTopic(file_item["topic"].asString());
+        binding.Item = file_item;
+
+        bindings.push_back(binding);
+    }
+
+    return bindings;
+}
+
+void TJSONConfigParser::_CheckOverlaps(const vector<TBindingConfig>& bindings)
+{
+    map<pair<TStoreType, int>, TAddressRange<size_t>> ranges;
+    set<pair<int, int>> files;
+    size_t status_tag = bindings.size();
+
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        const auto& binding = bindings[i];
+
+        if (binding.IsFile) {
+            if (!files.emplace(binding.SlaveId, binding.Address).second) {
+                throw TConfigException(string("File number overlapping: topic ") + binding.Item["topic"].asString());
+            }
+            continue;
+        }
+
+        try {
+            // distinct params don't let neighbour items merge with overlapping ones
+            ranges[make_pair(binding.Type, binding.SlaveId)].insert(binding.Address, binding.Size, i + 1);
+        } catch (const WrongSegmentException& e) {
+            throw TConfigException(string("Address overlapping: ") + StoreTypeToString(binding.Type) + ": topic " +
+                                   binding.Item["topic"].asString());
+        }
+
+        // status registers of control are input registers of the same unit
+        for (const char* key: {"age_register", "error_register"}) {
+            if (!binding.Item.isMember(key))
+                continue;
+
+            try {
+                ranges[make_pair(INPUT_REGISTER, binding.SlaveId)].insert(binding.Item[key].asInt(), 1, ++status_tag);
+            } catch (const WrongSegmentException& e) {
+                throw TConfigException(string("Address overlapping: ") + StoreTypeToString(INPUT_REGISTER) + ": " +
+                                       key + " of topic " + binding.Item["topic"].asString());
+            }
+        }
+    }
+}
+
+void TJSONConfigParser::_CheckGroups(const Json::Value& root, const vector<TBindingConfig>& bindings)
+{
+    set<string> names;
+
+    for (const auto& group: root["groups"]) {
+        string name = group["name"].asString();
+        if (!names.insert(name).second) {
+            throw TConfigException("Duplicate register group name: " + name);
+        }
+
+        // group without commit condition would never update its registers
+        if (group.get("window_ms", 0).asInt() <= 0 && group.get("trigger", "").asString().empty()) {
+            throw TConfigException("Register group " + name + " needs window_ms or trigger");
+        }
+    }
+
+    for (const auto& binding: bindings) {
+        if (!binding.Group.empty() && !names.count(binding.Group)) {
+            throw TConfigException("Unknown register group " + binding.Group + ": topic " +
+                                   binding.Item["topic"].asString());
+        }
+
+        // group stages only the last payload, so FIFO would miss values between commits
+        if (!binding.Group.empty() && binding.Type == HOLDING_REGISTER && binding.Item.get("fifo_size", 0).asUInt()) {
+            throw TConfigException("FIFO register can't be in register group: topic " +
+                                   binding.Item["topic"].asString());
+        }
+    }
+}
+
+map<string, PRegisterGroup> TJSONConfigParser::_CreateGroups(const Json::Value& root, PMqttClient mqtt)
+{
+    map<string, PRegisterGroup> groups;
+
+    for (const auto& group: root["groups"]) {
+        string name = group["name"].asString();
+        chrono::milliseconds window(group.get("window_ms", 0).asInt());
+        string trigger = group.get("trigger", "").asString();
+
+        LOG(Debug) << "Register group " << name << ": window " << window.count() << " ms, trigger "
+                   << (trigger.empty() ? "none" : trigger);
+
+        groups[name] =
+            make_shared<TRegisterGroup>(name, window, trigger.empty() ? trigger : expandTopic(trigger), mqtt);
+    }
+
+    return groups;
+}
+
+void TJSONConfigParser::_SetServerGroups(PModbusServer modbus)
+{
+    vector<PRegisterGroup> groups;
+    for (const auto& group: Groups) {
+        groups.push_back(group.second);
+    }
+
+    modbus->SetRegisterGroups(groups);
+}
+
+void TJSONConfigParser::_Bind(const Json::Value& root,
+                              const TBindingConfig& binding,
+                              PModbusServer modbus,
+                              PMqttClient mqtt)
+{
+    const auto& item = binding.Item;
+    TBinding bound;
+    bound.Topic = binding.Topic;
+
+    if (binding.IsFile) {
+        LOG(Debug) << "Creating file observer " << binding.Topic << " : " << binding.Address << ", " << binding.Size
+                   << " bytes";
+
+        auto obs = make_shared<TGatewayFileObserver>(binding.Topic, binding.Size, mqtt);
+        obs->SetPublishQueue(PublishQueue);
+        obs->SetQos(item.get("qos", 1).asInt());
+
+        try {
+            modbus->ObserveFile(obs, binding.Address, binding.SlaveId);
+        } catch (const WrongSegmentException& e) {
+            throw TConfigException(string("File number overlapping: topic ") + item["topic"].asString());
+        }
+
+        bound.Observer = obs;
+        bound.Subscribe = [obs] { obs->Subscribe(); };
+        Bindings[binding.Key] = bound;
+        return;
+    }
+
+    PMQTTConverter conv;
+    size_t fifo_size = 0;
+
+    if (binding.Type == COIL || binding.Type == DISCRETE_INPUT) {
+        conv = make_shared<TMQTTDiscrConverter>();
+    } else {
+        string format = item["format"].asString();
+        bool byteswap = item["byteswap"].asBool();
+        bool wordswap = item["wordswap"].asBool();
+        double scale = item["scale"].asFloat();
+        int size = item["size"].asInt();
+
+        if (format == "varchar") {
+            conv = make_shared<TMQTTTextConverter>(binding.Size, byteswap, wordswap);
+        } else if (format == "float") {
+            conv = make_shared<TMQTTFloatConverter>(size, byteswap, wordswap, scale);
+        } else {
+            TMQTTIntConverter::IntegerType int_type = TMQTTIntConverter::SIGNED;
+            if (format == "unsigned") {
+                int_type = TMQTTIntConverter::UNSIGNED;
+            } else if (format == "bcd") {
+                int_type = TMQTTIntConverter::BCD;
+            }
+
+            conv = make_shared<TMQTTIntConverter>(int_type, scale, size, byteswap, wordswap);
         }
+    }
+
+    if (binding.Type == HOLDING_REGISTER)
+        fifo_size = item.get("fifo_size", 0).asUInt();
+
+    auto obs = make_shared<TGatewayObserver>(binding.Topic, conv, mqtt, fifo_size);
+    obs->SetShmExport(ShmExport);
+    obs->SetUpdateQueue(UpdateQueue);
+    obs->SetPublishQueue(PublishQueue);
+    obs->SetQos(item.get("qos", 1).asInt());
+
+    // sliders of HMI may write the same register many times a second
+    int min_interval = item.get("min_publish_interval_ms", root["mqtt"].get("min_publish_interval_ms", 0)).asInt();
+    obs->SetMinPublishInterval(chrono::milliseconds(min_interval));
+
+    // publications are throttled by publish queue only
+    if (!PublishQueue && item.get("min_publish_interval_ms", 0).asInt() > 0) {
+        LOG(Warn) << "min_publish_interval_ms of " << binding.Topic << " is ignored, as MQTT publish queue is disabled";
+    }
 
-        obs = make_shared<TGatewayObserver>(expandTopic(topic), conv, mqtt);
+    // safety registers answer writes only after device has applied value
+    obs->SetWriteAck(chrono::milliseconds(item.get("write_ack_timeout_ms", 0).asInt()), WriteAckStats);
 
-        LOG(Debug) << "Creating observer on " << address << ":" << size;
+    // stale values are refused on read, so server has to ask observer
+    int max_age = item.get("max_age_ms", 0).asInt();
+    obs->SetMaxAge(chrono::milliseconds(max_age),
+                   TReplyState(item.get("stale_exception", REPLY_GATEWAY_TARGET_FAILED).asInt()));
+
+    // producer publishes value only when stale value is read
+    if (item.isMember("pull_topic")) {
+        obs->SetPull(item["pull_topic"].asString(),
+                     item.get("pull_payload", "").asString(),
+                     chrono::milliseconds(item.get("pull_timeout_ms", DEFAULT_PULL_TIMEOUT_MS).asInt()));
+    }
+    if (!binding.Group.empty())
+        obs->SetGroup(Groups[binding.Group]);
+
+    LOG(Debug) << "Creating observer on " << binding.Address << ":" << binding.Size;
+
+    try {
+        // gateway observers keep values in Modbus cache, no need to ask them on reads
+        modbus->Observe(obs,
+                        binding.Type,
+                        TModbusAddressRange(binding.Address, binding.Size),
+                        binding.SlaveId,
+                        max_age == 0);
+    } catch (const WrongSegmentException& e) {
+        throw TConfigException(string("Address overlapping: ") + StoreTypeToString(binding.Type) + ": topic " +
+                               item["topic"].asString());
+    }
+
+    auto bind_status = [&](const char* key, TGatewayStatusObserver::TValue value) {
+        auto status = make_shared<TGatewayStatusObserver>(obs, value);
 
         try {
-            modbus->Observe(obs, type, TModbusAddressRange(address, size), slave_id);
+            modbus->Observe(status, INPUT_REGISTER, TModbusAddressRange(item[key].asInt(), 1), binding.SlaveId);
         } catch (const WrongSegmentException& e) {
-            throw TConfigException(string("Address overlapping: ") + StoreTypeToString(type) + ": topic " + topic);
+            throw TConfigException(string("Address overlapping: ") + StoreTypeToString(INPUT_REGISTER) + ": " + key +
+                                   " of topic " + item["topic"].asString());
         }
+
+        bound.Companions.push_back(status);
+    };
+
+    if (item.isMember("age_register"))
+        bind_status("age_register", TGatewayStatusObserver::AGE);
+
+    if (item.isMember("error_register")) {
+        bind_status("error_register", TGatewayStatusObserver::ERRORS);
+        obs->SubscribeErrors();
+        bound.ErrorTopic = binding.Topic + "/meta/error";
+        bound.SubscribeErrors = [obs] { obs->SubscribeErrors(); };
     }
-    return enabled;
+
+    bound.Observer = obs;
+    bound.Group = binding.Group;
+    bound.Subscribe = [obs] { obs->Subscribe(); };
+    Bindings[binding.Key] = bound;
 }
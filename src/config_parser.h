@@ -3,13 +3,23 @@
  * \author Nikita webconn Maslov <n.maslov@contactless.ru>
  */
 
+#include <functional>
+#include <map>
 #include <tuple>
+#include <vector>
 
 #include <wblib/json_utils.h>
 #include <wblib/mqtt.h>
 
 #include "modbus_wrapper.h"
+#include "cache_snapshot.h"
 #include "mqtt_converters.h"
+#include "observer.h"
+#include "publish_queue.h"
+#include "register_group.h"
+#include "shm_export.h"
+#include "stats_publisher.h"
+#include "update_queue.h"
 
 /*! Interface of config file parser
  * Takes configuration file, builds all observers
@@ -24,6 +34,9 @@ public:
     /*! Check if debug logging is required */
     virtual bool Debug() = 0;
 
+    /*! Re-read configuration and apply changed registers to running gateway */
+    virtual void Reload(PModbusServer modbus, WBMQTT::PMqttClient mqtt) = 0;
+
     /*! Virtual destructor */
     virtual ~IConfigParser();
 };
@@ -38,8 +51,83 @@ public:
     virtual std::tuple<PModbusServer, WBMQTT::PMqttClient> Build();
     virtual bool Debug();
 
+    /*! Re-read config file and apply difference to running gateway
+     * Unchanged registers keep their observers and values, removed ones
+     * are unobserved and new ones get cache. Modbus port and MQTT connection
+     * settings are applied on restart only. Throws TConfigException and keeps
+     * current configuration if new one is invalid.
+     */
+    virtual void Reload(PModbusServer modbus, WBMQTT::PMqttClient mqtt);
+
+    /*! Publish values written by Modbus clients which are still queued
+     * Called on shutdown before MQTT client is stopped
+     */
+    void FlushPublishQueue();
+
 private:
-    bool _BuildStore(TStoreType type, const Json::Value& list, PModbusServer modbus, WBMQTT::PMqttClient mqtt);
+    /*! Enabled register or file item from config */
+    struct TBindingConfig
+    {
+        std::string Key;   /*!< Store name and item JSON, identifies unchanged items on reload */
+        TStoreType Type;   /*!< Store type, unused for files */
+        bool IsFile;       /*!< Item is file record */
+        int SlaveId;       /*!< Modbus unit ID */
+        int Address;       /*!< First register address or file number */
+        int Size;          /*!< Number of registers or file size in bytes */
+        std::string Topic; /*!< Full MQTT control topic */
+        std::string Group; /*!< Register group name, empty if values are written immediately */
+        Json::Value Item;  /*!< Item config */
+    };
+
+    /*! Observer created for config item */
+    struct TBinding
+    {
+        PModbusServerObserver Observer;
+        std::string Topic;
+        std::string Group;
+        std::function<void()> Subscribe; /*!< Restore MQTT subscription after topic was unsubscribed */
+
+        std::vector<PModbusServerObserver> Companions; /*!< Age and error registers of control */
+        std::string ErrorTopic;                        /*!< Control's meta/error topic, empty if not tracked */
+        std::function<void()> SubscribeErrors;
+    };
+
+    std::vector<TBindingConfig> _ParseBindings(const Json::Value& root);
+    void _CheckOverlaps(const std::vector<TBindingConfig>& bindings);
+    void _CheckGroups(const Json::Value& root, const std::vector<TBindingConfig>& bindings);
+    std::map<std::string, PRegisterGroup> _CreateGroups(const Json::Value& root, WBMQTT::PMqttClient mqtt);
+    void _SetServerGroups(PModbusServer modbus);
+    void _Bind(const Json::Value& root, const TBindingConfig& binding, PModbusServer modbus, WBMQTT::PMqttClient mqtt);
+    void _ApplyServerOptions(const Json::Value& root, PModbusServer modbus);
+    Json::Value _ParseConfig();
+
+    std::string ConfigFile;
+    std::string SchemaFile;
+    std::map<std::string, TBinding> Bindings;
+
+    /*! Register groups by name */
+    std::map<std::string, PRegisterGroup> Groups;
+
+    /*! Shared memory export, null if disabled */
+    PModbusShmExport ShmExport;
+
+    /*! Cache checkpoint file, null if disabled */
+    PModbusCacheSnapshot CacheSnapshot;
+
+    /*! Queue of MQTT updates, null if disabled */
+    PUpdateQueue UpdateQueue;
+
+    /*! Queue of messages with values written by Modbus clients, null if they are published before reply */
+    PPublishQueue PublishQueue;
+
+    /*! Counters of writes acknowledged by echo, shared by observers */
+    PWriteAckStats WriteAckStats;
+
+    /*! Gateway counters publisher, null if disabled */
+    PStatsPublisher Stats;
+
+    /*! Observers removed on last reload, MQTT thread may still run their handlers */
+    std::vector<PModbusServerObserver> RetiredObservers;
 
 protected:
     Json::Value Root;
@@ -18,8 +18,103 @@ TReplyState IModbusServerObserver::OnSetValue(TStoreType type,
     return TReplyState::REPLY_OK;
 }
 
+TReplyState IModbusServerObserver::OnGetValues(TStoreType type,
+                                               uint8_t unit_id,
+                                               const std::vector<TModbusReadSegment>& segments)
+{
+    TReplyState reply = TReplyState::REPLY_CACHED;
+
+    for (const auto& s: segments) {
+        reply = OnGetValue(type, unit_id, s.start, s.count, s.data);
+        if (reply > 0)
+            break;
+    }
+
+    return reply;
+}
+
+TReplyState IModbusServerObserver::OnSetValues(TStoreType type,
+                                               uint8_t unit_id,
+                                               const std::vector<TModbusWriteSegment>& segments)
+{
+    TReplyState reply = TReplyState::REPLY_OK;
+
+    for (const auto& s: segments) {
+        reply = OnSetValue(type, unit_id, s.start, s.count, s.data);
+        if (reply > 0)
+            break;
+    }
+
+    return reply;
+}
+
+TReplyState IModbusServerObserver::OnMaskWriteValue(TStoreType type,
+                                                    uint8_t unit_id,
+                                                    uint16_t address,
+                                                    uint16_t and_mask,
+                                                    uint16_t or_mask,
+                                                    uint16_t* value)
+{
+    uint16_t result = (*value & and_mask) | (or_mask & ~and_mask);
+
+    TReplyState reply = OnSetValue(type, unit_id, address, 1, &result);
+    if (reply <= 0)
+        *value = result;
+
+    return reply;
+}
+
+TReplyState IModbusServerObserver::OnReadFifo(TStoreType type,
+                                              uint8_t unit_id,
+                                              uint16_t address,
+                                              uint16_t* values,
+                                              unsigned max_count,
+                                              unsigned& count)
+{
+    count = 0;
+    return TReplyState::REPLY_ILLEGAL_ADDRESS;
+}
+
+TReplyState IModbusServerObserver::OnReadFileRecord(uint8_t unit_id,
+                                                    uint16_t file,
+                                                    uint16_t record,
+                                                    unsigned count,
+                                                    uint16_t* data)
+{
+    return TReplyState::REPLY_ILLEGAL_ADDRESS;
+}
+
+TReplyState IModbusServerObserver::OnWriteFileRecord(uint8_t unit_id,
+                                                     uint16_t file,
+                                                     uint16_t record,
+                                                     unsigned count,
+                                                     const uint16_t* data)
+{
+    return TReplyState::REPLY_ILLEGAL_ADDRESS;
+}
+
 void IModbusServerObserver::OnCacheAllocate(TStoreType type, uint8_t unit_id, const TModbusCacheAddressRange& cache)
 {}
 
 IModbusServerObserver::~IModbusServerObserver()
 {}
+
+uint64_t IModbusServerObserver::GetDeferredId(bool read)
+{
+    return 0;
+}
+
+TReplyState IModbusServerObserver::OnPollDeferred(bool read, uint64_t id)
+{
+    return TReplyState::REPLY_OK;
+}
+
+void IModbusServerObserver::OnReadCache(void* dst, const void* cache, size_t size)
+{
+    memcpy(dst, cache, size);
+}
+
+bool IModbusServerObserver::GuardsCache() const
+{
+    return false;
+}
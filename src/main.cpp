@@ -1,3 +1,4 @@
+#include <atomic>
 #include <cstring>
 #include <getopt.h>
 #include <string>
@@ -138,7 +139,7 @@ int main(int argc, char* argv[])
 {
     string configFile("/etc/wb-mqtt-mbgate.conf");
 
-    WBMQTT::SignalHandling::Handle({SIGINT, SIGTERM});
+    WBMQTT::SignalHandling::Handle({SIGINT, SIGTERM, SIGHUP});
     WBMQTT::SignalHandling::OnSignals({SIGINT, SIGTERM}, [&] { WBMQTT::SignalHandling::Stop(); });
     WBMQTT::SetThreadName(WBMQTT_NAME);
 
@@ -150,8 +151,10 @@ int main(int argc, char* argv[])
     });
 
     bool running = true;
+    std::atomic<bool> reload(false);
 
     WBMQTT::SignalHandling::OnSignals({SIGINT, SIGTERM}, [&] { running = false; });
+    WBMQTT::SignalHandling::OnSignals({SIGHUP}, [&] { reload = true; });
 
     try {
         PModbusServer s;
@@ -171,11 +174,23 @@ int main(int argc, char* argv[])
         while (running) {
             if (s->Loop(1000) == -1)
                 throw runtime_error("IO Error occured in server work cycle");
+
+            // apply new config between queries, so address maps are never changed under request processing
+            if (reload.exchange(false)) {
+                try {
+                    configParser.Reload(s, t);
+                } catch (const exception& e) {
+                    LOG(Error) << "Configuration is not reloaded, keeping current one: " << e.what();
+                }
+            }
         }
 
         LOG(Info) << "Shutting down";
 
+        // written values are still queued, client must be running to publish them
+        configParser.FlushPublishQueue();
         t->Stop();
+        s->SaveCacheSnapshot();
         WBMQTT::SignalHandling::Wait();
     } catch (const TEmptyConfigException&) {
         LOG(Error) << "All channels are disabled, stopping service gracefully";
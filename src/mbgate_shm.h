@@ -0,0 +1,253 @@
+#pragma once
+
+/*!
+ * \file mbgate_shm.h
+ * \brief Shared memory export of gateway register cache: layout and reader
+ *
+ * If "shm_export" is set in config, gateway mirrors its Modbus cache into POSIX
+ * shared memory object with that name. Object is read-only for other processes:
+ *
+ *     THeader header;
+ *     TEntry  entries[header.EntryCount];
+ *
+ * There is one entry per mapped coil, discrete input or register, entries are sorted
+ * by unit ID, store type and address. Each entry has own sequence counter: it is odd
+ * while gateway updates value and grows by 2 on each value change, so readers can
+ * find out if it changed since last read. Load() of single entry never returns torn
+ * register, but 32 and 64 bit values span several entries which are written one by one:
+ * read them with TReader::Load() of entry range, it retries while header sequence shows
+ * that gateway was updating entries.
+ *
+ * When register map changes (config reload) or gateway restarts, old object is unlinked
+ * and new one is created under the same name, readers keep old mapping and have to reopen
+ * it. Running gateway marks header of replaced object as stale.
+ *
+ * The header doesn't depend on gateway sources, readers can use it as is.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace MbgateShm
+{
+    /*! "MBGS" */
+    constexpr uint32_t MAGIC = 0x5347424D;
+
+    /*! Layout version */
+    constexpr uint32_t VERSION = 2;
+
+    /*! Store types, same values as in gateway */
+    enum TStore : uint8_t
+    {
+        DISCRETE_INPUT = 1,
+        COIL = 2,
+        INPUT_REGISTER = 4,
+        HOLDING_REGISTER = 8
+    };
+
+    /*! Object header */
+    struct THeader
+    {
+        uint32_t Magic;
+        uint32_t Version;
+        uint32_t EntryCount;
+        std::atomic<uint32_t> Stale;    /*!< Non-zero if object was replaced and must be reopened */
+        std::atomic<uint32_t> Sequence; /*!< Odd while gateway updates any entries */
+        uint32_t Reserved;
+    };
+
+    /*! Single coil, discrete input or register */
+    struct TEntry
+    {
+        std::atomic<uint32_t> Sequence; /*!< Odd while value is updated */
+        uint8_t UnitId;
+        uint8_t Store; /*!< TStore */
+        uint16_t Address;
+        std::atomic<uint16_t> Value; /*!< Register value, 0 or 1 for bits */
+        uint16_t Reserved;
+    };
+
+    static_assert(sizeof(THeader) == 24, "header layout is fixed");
+    static_assert(sizeof(TEntry) == 12, "entry layout is fixed");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint16_t>::is_always_lock_free,
+                  "atomics in shared memory must be lock-free");
+
+    /*! Entry sort key */
+    inline std::tuple<uint8_t, uint8_t, uint16_t> Key(const TEntry& entry)
+    {
+        return std::make_tuple(entry.UnitId, entry.Store, entry.Address);
+    }
+
+    /*! Update entry value (gateway side) */
+    inline void Store(TEntry& entry, uint16_t value)
+    {
+        const uint32_t sequence = entry.Sequence.load(std::memory_order_relaxed);
+
+        entry.Sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        entry.Value.store(value, std::memory_order_relaxed);
+        entry.Sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /*! Read entry value
+     * \param entry Entry
+     * \param sequence If not null, receives sequence number of returned value
+     * \return Value
+     */
+    inline uint16_t Load(const TEntry& entry, uint32_t* sequence = nullptr)
+    {
+        for (;;) {
+            const uint32_t before = entry.Sequence.load(std::memory_order_acquire);
+            const uint16_t value = entry.Value.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint32_t after = entry.Sequence.load(std::memory_order_relaxed);
+
+            if (before == after && !(before & 1)) {
+                if (sequence)
+                    *sequence = before;
+                return value;
+            }
+        }
+    }
+
+    /*! Start update of entries (gateway side), value of several entries changes as a whole */
+    inline void BeginUpdate(THeader& header)
+    {
+        header.Sequence.store(header.Sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    /*! Finish update of entries started by BeginUpdate() */
+    inline void EndUpdate(THeader& header)
+    {
+        header.Sequence.store(header.Sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*! Read-only view of export object */
+    class TReader
+    {
+    public:
+        TReader() = default;
+        TReader(const TReader&) = delete;
+        TReader& operator=(const TReader&) = delete;
+
+        ~TReader()
+        {
+            Close();
+        }
+
+        /*! Open export object, previously opened one is closed
+         * \param name Object name from gateway config
+         * \return false if object doesn't exist or has unknown layout
+         */
+        bool Open(const std::string& name)
+        {
+            Close();
+
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(THeader)) {
+                close(fd);
+                return false;
+            }
+
+            void* memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (memory == MAP_FAILED)
+                return false;
+
+            Memory = memory;
+            MemorySize = st.st_size;
+            Header = static_cast<const THeader*>(memory);
+
+            if (Header->Magic != MAGIC || Header->Version != VERSION ||
+                MemorySize < sizeof(THeader) + Header->EntryCount * sizeof(TEntry))
+            {
+                Close();
+                return false;
+            }
+
+            Entries = reinterpret_cast<const TEntry*>(Header + 1);
+            return true;
+        }
+
+        /*! Unmap object */
+        void Close()
+        {
+            if (Memory)
+                munmap(Memory, MemorySize);
+
+            Memory = nullptr;
+            MemorySize = 0;
+            Header = nullptr;
+            Entries = nullptr;
+        }
+
+        /*! Check if object was replaced by gateway and must be reopened */
+        bool IsStale() const
+        {
+            return !Header || Header->Stale.load(std::memory_order_acquire);
+        }
+
+        /*! Find entry
+         * \return Entry or nullptr if item is not exported
+         */
+        const TEntry* Find(uint8_t unit_id, TStore store, uint16_t address) const
+        {
+            const auto key = std::make_tuple(unit_id, uint8_t(store), address);
+            const TEntry* entry =
+                std::lower_bound(begin(), end(), key, [](const TEntry& e, const auto& k) { return Key(e) < k; });
+
+            return (entry != end() && Key(*entry) == key) ? entry : nullptr;
+        }
+
+        /*! Read values of consecutive entries at once, e.g. registers of 32 bit value
+         * \param first First entry
+         * \param count Number of entries
+         * \param values Receives values
+         */
+        void Load(const TEntry* first, size_t count, uint16_t* values) const
+        {
+            for (;;) {
+                const uint32_t before = Header->Sequence.load(std::memory_order_acquire);
+                if (before & 1)
+                    continue;
+
+                for (size_t i = 0; i < count; ++i)
+                    values[i] = first[i].Value.load(std::memory_order_relaxed);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (Header->Sequence.load(std::memory_order_relaxed) == before)
+                    return;
+            }
+        }
+
+        const TEntry* begin() const
+        {
+            return Entries;
+        }
+
+        const TEntry* end() const
+        {
+            return Entries ? Entries + Header->EntryCount : nullptr;
+        }
+
+    private:
+        void* Memory = nullptr;
+        size_t MemorySize = 0;
+        const THeader* Header = nullptr;
+        const TEntry* Entries = nullptr;
+    };
+}
@@ -0,0 +1,88 @@
+#include "modbus_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    // Modbus addresses are 16-bit
+    constexpr int MAX_PAGES = 0x10000 / TModbusPagedCache::PAGE_SIZE;
+}
+
+TModbusPagedCache::TModbusPagedCache(size_t item_bits): ItemBits(item_bits)
+{}
+
+void TModbusPagedCache::Allocate(const TModbusAddressSet& addresses)
+{
+    // observers were moved to new blocks after previous call
+    RetiredBlocks.clear();
+
+    std::vector<bool> used(MAX_PAGES);
+
+    for (const auto& block: Blocks)
+        std::fill_n(used.begin() + block.first, block.second.PageCount, true);
+
+    for (auto segment = addresses.cbegin(); segment != addresses.cend(); ++segment) {
+        const int first = std::max(segment->first, 0) / PAGE_SIZE;
+        const int last = std::min((segment->second.first - 1) / PAGE_SIZE, MAX_PAGES - 1);
+        for (int page = first; page <= last; ++page)
+            used[page] = true;
+    }
+
+    // each run of used pages gets single block, blocks inside of grown run are merged into it
+    for (int page = 0; page < MAX_PAGES;) {
+        if (!used[page]) {
+            ++page;
+            continue;
+        }
+
+        const int first = page;
+        while (page < MAX_PAGES && used[page])
+            ++page;
+        const int count = page - first;
+
+        auto block = Blocks.find(first);
+        if (block != Blocks.end() && block->second.PageCount == count)
+            continue;
+
+        const size_t page_bytes = PAGE_SIZE * ItemBits / 8;
+        std::unique_ptr<uint8_t[]> data(new uint8_t[count * page_bytes]());
+
+        for (block = Blocks.lower_bound(first); block != Blocks.end() && block->first < page;) {
+            memcpy(data.get() + (block->first - first) * page_bytes,
+                   block->second.Data.get(),
+                   block->second.PageCount * page_bytes);
+            RetiredBlocks.push_back(std::move(block->second.Data));
+            block = Blocks.erase(block);
+        }
+
+        Blocks[first] = TBlock{count, std::move(data)};
+    }
+}
+
+void* TModbusPagedCache::Get(int address) const
+{
+    if (address < 0)
+        return nullptr;
+
+    const int page = address / PAGE_SIZE;
+
+    auto block = Blocks.upper_bound(page);
+    if (block == Blocks.begin())
+        return nullptr;
+    --block;
+
+    if (page >= block->first + block->second.PageCount)
+        return nullptr;
+
+    return block->second.Data.get() + (address - block->first * PAGE_SIZE) * ItemBits / 8;
+}
+
+size_t TModbusPagedCache::Size() const
+{
+    size_t pages = 0;
+    for (const auto& block: Blocks)
+        pages += block.second.PageCount;
+
+    return pages * PAGE_SIZE;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/*!
+ * \file modbus_cache.h
+ * \brief Sparse paged storage of Modbus table values
+ */
+
+#include "address_range.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+/*! Set of addresses, adjacent segments are merged */
+typedef TAddressRange<bool> TModbusAddressSet;
+
+/*! Sparse storage of one Modbus table (coils, discrete inputs or registers of one unit)
+ * Memory is allocated by pages for observed addresses only, so it depends on number
+ * of mapped items, not on highest address. Consecutive used pages share one memory
+ * block, so values and requests spanning page bounds see contiguous memory.
+ *
+ * Single-bit items are packed eight per byte, LSB first. Pages start at multiples
+ * of PAGE_SIZE, so item is always bit (address % 8) of its byte.
+ */
+class TModbusPagedCache
+{
+public:
+    /*! Number of items in page */
+    static constexpr int PAGE_SIZE = 64;
+
+    /*! Create empty cache
+     * \param item_bits Size of single item in bits, 1 or multiple of 8
+     */
+    explicit TModbusPagedCache(size_t item_bits);
+
+    /*! Map pages covering given addresses
+     * Already mapped pages keep their values. Blocks which are replaced by larger ones
+     * stay valid until next Allocate() call, so observers can move their values.
+     * \param addresses Addresses to map
+     */
+    void Allocate(const TModbusAddressSet& addresses);
+
+    /*! Get pointer to item
+     * Called on every request, so it doesn't throw
+     * \param address Item address
+     * \return Pointer to item (to byte holding it for single-bit items) or nullptr if address is not mapped
+     */
+    void* Get(int address) const;
+
+    /*! Get number of allocated items */
+    size_t Size() const;
+
+private:
+    struct TBlock
+    {
+        int PageCount;
+        std::unique_ptr<uint8_t[]> Data;
+    };
+
+    size_t ItemBits;
+
+    /*! Memory blocks by first page number */
+    std::map<int, TBlock> Blocks;
+
+    /*! Blocks replaced on last Allocate() call */
+    std::vector<std::unique_ptr<uint8_t[]>> RetiredBlocks;
+};
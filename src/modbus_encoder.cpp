@@ -0,0 +1,297 @@
+#include "modbus_encoder.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+
+namespace
+{
+    constexpr std::array<uint16_t, 256> MakeCrcTable()
+    {
+        std::array<uint16_t, 256> table{};
+        for (unsigned i = 0; i < 256; ++i) {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    constexpr auto CRC_TABLE = MakeCrcTable();
+
+    constexpr bool LITTLE_ENDIAN_HOST = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+    /*! Swap bytes in each 16-bit lane of 64-bit word */
+    inline uint64_t SwapLanes16(uint64_t v)
+    {
+        return ((v & 0x00FF00FF00FF00FFull) << 8) | ((v >> 8) & 0x00FF00FF00FF00FFull);
+    }
+
+    /*! Set masked bits of byte to value, other bits may be changed by other threads meanwhile */
+    inline void MergeByte(uint8_t& dst, uint8_t value, uint8_t mask)
+    {
+        std::atomic_ref<uint8_t> byte(dst);
+
+        if (mask == 0xFF) {
+            byte.store(value, std::memory_order_relaxed);
+        } else {
+            // each bit changes once, so readers see either old or new value of it
+            byte.fetch_or(value & mask, std::memory_order_relaxed);
+            byte.fetch_and(value | ~mask, std::memory_order_relaxed);
+        }
+    }
+}
+
+void ModbusEncoder::PackRegisters(uint8_t* out, const uint16_t* regs, size_t count)
+{
+    size_t i = 0;
+
+    // convert four registers per step
+    if (LITTLE_ENDIAN_HOST) {
+        for (; i + 4 <= count; i += 4) {
+            uint64_t v;
+            std::memcpy(&v, regs + i, sizeof(v));
+            v = SwapLanes16(v);
+            std::memcpy(out + 2 * i, &v, sizeof(v));
+        }
+    }
+
+    for (; i < count; ++i) {
+        out[2 * i] = regs[i] >> 8;
+        out[2 * i + 1] = regs[i] & 0xFF;
+    }
+}
+
+void ModbusEncoder::UnpackRegisters(uint16_t* regs, const uint8_t* in, size_t count)
+{
+    size_t i = 0;
+
+    if (LITTLE_ENDIAN_HOST) {
+        for (; i + 4 <= count; i += 4) {
+            uint64_t v;
+            std::memcpy(&v, in + 2 * i, sizeof(v));
+            v = SwapLanes16(v);
+            std::memcpy(regs + i, &v, sizeof(v));
+        }
+    }
+
+    for (; i < count; ++i)
+        regs[i] = (in[2 * i] << 8) | in[2 * i + 1];
+}
+
+void ModbusEncoder::PackBits(uint8_t* out, const uint8_t* bits, size_t count)
+{
+    size_t i = 0;
+
+    // gather eight one-byte items into one byte per step
+    if (LITTLE_ENDIAN_HOST) {
+        for (; i + 8 <= count; i += 8) {
+            uint64_t v;
+            std::memcpy(&v, bits + i, sizeof(v));
+
+            // collapse each byte into its lowest bit
+            v |= v >> 4;
+            v |= v >> 2;
+            v |= v >> 1;
+            v &= 0x0101010101010101ull;
+
+            // move bit of byte N into bit N of the top byte
+            out[i / 8] = (v * 0x0102040810204080ull) >> 56;
+        }
+    }
+
+    for (; i < count; ++i) {
+        if (i % 8 == 0)
+            out[i / 8] = 0;
+        if (bits[i])
+            out[i / 8] |= 1 << (i % 8);
+    }
+}
+
+void ModbusEncoder::UnpackBits(uint8_t* bits, const uint8_t* in, size_t count, uint8_t set_value)
+{
+    size_t i = 0;
+
+    // spread one input byte into eight items per step
+    if (LITTLE_ENDIAN_HOST) {
+        for (; i + 8 <= count; i += 8) {
+            // bit N of input lands in byte N, then each non-zero byte is turned into 0x01
+            uint64_t v = (in[i / 8] * 0x0101010101010101ull) & 0x8040201008040201ull;
+            v = ((v + 0x7F7F7F7F7F7F7F7Full) & 0x8080808080808080ull) >> 7;
+            v *= set_value;
+            std::memcpy(bits + i, &v, sizeof(v));
+        }
+    }
+
+    for (; i < count; ++i)
+        bits[i] = (in[i / 8] & (1 << (i % 8))) ? set_value : 0;
+}
+
+void ModbusEncoder::CopyBits(uint8_t* out, const uint8_t* packed, unsigned first_bit, size_t count)
+{
+    const size_t out_bytes = (count + 7) / 8;
+    const size_t in_bytes = (first_bit + count + 7) / 8;
+
+    if (first_bit == 0) {
+        std::memcpy(out, packed, out_bytes);
+    } else {
+        size_t i = 0;
+
+        // shift eight bytes per step, the ninth one gives high bits of the last byte
+        if (LITTLE_ENDIAN_HOST) {
+            for (; i + 8 <= out_bytes && i + 9 <= in_bytes; i += 8) {
+                uint64_t v;
+                std::memcpy(&v, packed + i, sizeof(v));
+                v = (v >> first_bit) | (uint64_t(packed[i + 8]) << (64 - first_bit));
+                std::memcpy(out + i, &v, sizeof(v));
+            }
+        }
+
+        for (; i < out_bytes; ++i) {
+            const uint8_t high = (i + 1 < in_bytes) ? packed[i + 1] << (8 - first_bit) : 0;
+            out[i] = (packed[i] >> first_bit) | high;
+        }
+    }
+
+    if (count % 8)
+        out[out_bytes - 1] &= (1 << (count % 8)) - 1;
+}
+
+void ModbusEncoder::LoadBits(uint8_t* bits, const uint8_t* packed, unsigned first_bit, size_t count)
+{
+    if (first_bit == 0) {
+        UnpackBits(bits, packed, count);
+        return;
+    }
+
+    // realign eight bits per step, then spread them as usual
+    uint8_t aligned[8];
+    for (size_t i = 0; i < count; i += sizeof(aligned) * 8) {
+        const size_t n = std::min(count - i, sizeof(aligned) * 8);
+        CopyBits(aligned, packed + i / 8, first_bit, n);
+        UnpackBits(bits + i, aligned, n);
+    }
+}
+
+void ModbusEncoder::StoreBits(uint8_t* packed, unsigned first_bit, const uint8_t* bits, size_t count)
+{
+    // gather eight items, then merge them into two bytes shifted by first_bit
+    for (size_t i = 0; i < count; i += 8) {
+        const size_t n = std::min<size_t>(count - i, 8);
+
+        uint8_t value;
+        PackBits(&value, bits + i, n);
+        const uint16_t mask = ((1u << n) - 1) << first_bit;
+        const uint16_t shifted = uint16_t(value) << first_bit;
+
+        MergeByte(packed[i / 8], shifted & 0xFF, mask & 0xFF);
+        if (mask >> 8)
+            MergeByte(packed[i / 8 + 1], shifted >> 8, mask >> 8);
+    }
+}
+
+size_t ModbusEncoder::EncodeReadBits(uint8_t* pdu,
+                                     uint8_t function,
+                                     const uint8_t* packed,
+                                     unsigned first_bit,
+                                     size_t count)
+{
+    const size_t byte_count = (count + 7) / 8;
+
+    pdu[0] = function;
+    pdu[1] = byte_count;
+    CopyBits(pdu + 2, packed, first_bit, count);
+
+    return 2 + byte_count;
+}
+
+size_t ModbusEncoder::EncodeReadRegisters(uint8_t* pdu, uint8_t function, const uint16_t* regs, size_t count)
+{
+    pdu[0] = function;
+    pdu[1] = count * 2;
+    PackRegisters(pdu + 2, regs, count);
+
+    return 2 + count * 2;
+}
+
+size_t ModbusEncoder::EncodeReadFifo(uint8_t* pdu, const uint16_t* regs, size_t count)
+{
+    // byte count covers FIFO count field and values
+    const size_t byte_count = 2 + count * 2;
+
+    pdu[0] = 0x18;
+    pdu[1] = byte_count >> 8;
+    pdu[2] = byte_count & 0xFF;
+    pdu[3] = count >> 8;
+    pdu[4] = count & 0xFF;
+    PackRegisters(pdu + 5, regs, count);
+
+    return 3 + byte_count;
+}
+
+size_t ModbusEncoder::RequestMetaLength(uint8_t function)
+{
+    switch (function) {
+        case 0x01: // read coils
+        case 0x02: // read discrete inputs
+        case 0x03: // read holding registers
+        case 0x04: // read input registers
+        case 0x05: // write single coil
+        case 0x06: // write single register
+        case 0x08: // diagnostics: sub-function and data
+            return 4;
+        case 0x0F: // write multiple coils
+        case 0x10: // write multiple registers
+            return 5;
+        case 0x14: // read file record
+        case 0x15: // write file record
+            return 1;
+        case 0x16: // mask write register
+            return 6;
+        case 0x17: // write and read registers
+            return 9;
+        case 0x18: // read FIFO queue
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+size_t ModbusEncoder::RequestDataLength(const uint8_t* pdu)
+{
+    switch (pdu[0]) {
+        case 0x0F:
+        case 0x10:
+            return pdu[5];
+        case 0x14:
+        case 0x15:
+            return pdu[1];
+        case 0x17:
+            return pdu[9];
+        default:
+            return 0;
+    }
+}
+
+size_t ModbusEncoder::EncodeException(uint8_t* pdu, uint8_t function, uint8_t code)
+{
+    pdu[0] = function | 0x80;
+    pdu[1] = code;
+
+    return 2;
+}
+
+uint16_t ModbusEncoder::Crc16(const uint8_t* data, size_t size)
+{
+    return Crc16Update(0xFFFF, data, size);
+}
+
+uint16_t ModbusEncoder::Crc16Update(uint16_t crc, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+        crc = (crc >> 8) ^ CRC_TABLE[(crc ^ data[i]) & 0xFF];
+
+    return crc;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+/*!
+ * \file modbus_encoder.h
+ * \brief Native Modbus reply PDU encoder
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ModbusEncoder
+{
+    /*! Maximum Modbus PDU length */
+    constexpr size_t MAX_PDU_LENGTH = 253;
+
+    /*! Maximum number of registers in READ_FIFO_QUEUE reply */
+    constexpr size_t MAX_FIFO_COUNT = 31;
+
+    /*! Pack registers into big-endian byte stream
+     * \param out Output buffer (2 * count bytes)
+     * \param regs Registers in host byte order
+     * \param count Number of registers
+     */
+    void PackRegisters(uint8_t* out, const uint16_t* regs, size_t count);
+
+    /*! Unpack big-endian byte stream into registers
+     * \param regs Output registers in host byte order
+     * \param in Input buffer (2 * count bytes)
+     * \param count Number of registers
+     */
+    void UnpackRegisters(uint16_t* regs, const uint8_t* in, size_t count);
+
+    /*! Pack one-byte-per-item bits into Modbus bit stream (LSB first)
+     * \param out Output buffer ((count + 7) / 8 bytes)
+     * \param bits Bits, one byte per item, any non-zero value is 1
+     * \param count Number of bits
+     */
+    void PackBits(uint8_t* out, const uint8_t* bits, size_t count);
+
+    /*! Unpack Modbus bit stream (LSB first) into one-byte-per-item bits
+     * \param bits Output bits, one byte per item
+     * \param in Input buffer ((count + 7) / 8 bytes)
+     * \param count Number of bits
+     * \param set_value Value of item for set bit, 0 for cleared one
+     */
+    void UnpackBits(uint8_t* bits, const uint8_t* in, size_t count, uint8_t set_value = 1);
+
+    /*! Copy bits starting in the middle of byte into Modbus bit stream (LSB first)
+     * \param out Output buffer ((count + 7) / 8 bytes), unused bits of last byte are cleared
+     * \param packed Packed bits, LSB first
+     * \param first_bit Position of the first bit in packed[0], 0..7
+     * \param count Number of bits
+     */
+    void CopyBits(uint8_t* out, const uint8_t* packed, unsigned first_bit, size_t count);
+
+    /*! Unpack bits starting in the middle of byte into one-byte-per-item bits (0 or 1)
+     * \param bits Output bits, one byte per item
+     * \param packed Packed bits, LSB first
+     * \param first_bit Position of the first bit in packed[0], 0..7
+     * \param count Number of bits
+     */
+    void LoadBits(uint8_t* bits, const uint8_t* packed, unsigned first_bit, size_t count);
+
+    /*! Store one-byte-per-item bits into packed bits starting in the middle of byte
+     * Other bits of touched bytes are kept, bytes are changed atomically, so other
+     * threads may store their own bits of the same bytes at the same time.
+     * \param packed Packed bits, LSB first
+     * \param first_bit Position of the first bit in packed[0], 0..7
+     * \param bits Bits, one byte per item, any non-zero value is 1
+     * \param count Number of bits
+     */
+    void StoreBits(uint8_t* packed, unsigned first_bit, const uint8_t* bits, size_t count);
+
+    /*! Build reply PDU for READ_COILS / READ_DISCRETE_INPUTS
+     * \param packed Packed bits, LSB first
+     * \param first_bit Position of the first bit in packed[0], 0..7
+     * \return PDU size
+     */
+    size_t EncodeReadBits(uint8_t* pdu, uint8_t function, const uint8_t* packed, unsigned first_bit, size_t count);
+
+    /*! Build reply PDU for READ_HOLDING_REGISTERS / READ_INPUT_REGISTERS
+     * \return PDU size
+     */
+    size_t EncodeReadRegisters(uint8_t* pdu, uint8_t function, const uint16_t* regs, size_t count);
+
+    /*! Build reply PDU for READ_FIFO_QUEUE
+     * \return PDU size
+     */
+    size_t EncodeReadFifo(uint8_t* pdu, const uint16_t* regs, size_t count);
+
+    /*! Build exception reply PDU
+     * \return PDU size
+     */
+    size_t EncodeException(uint8_t* pdu, uint8_t function, uint8_t code);
+
+    /*! Number of request PDU bytes after function code needed to calculate request length
+     * \param function Function code
+     * \return Number of bytes, 0 for unknown functions
+     */
+    size_t RequestMetaLength(uint8_t function);
+
+    /*! Number of request PDU bytes after meta part
+     * \param pdu Request PDU with function code and meta part
+     * \return Number of bytes
+     */
+    size_t RequestDataLength(const uint8_t* pdu);
+
+    /*! Modbus RTU CRC16
+     * \return CRC in host byte order, low byte is sent first
+     */
+    uint16_t Crc16(const uint8_t* data, size_t size);
+
+    /*! Continue CRC16 calculation over next data chunk */
+    uint16_t Crc16Update(uint16_t crc, const uint8_t* data, size_t size);
+}
@@ -1,7 +1,9 @@
 #include "log.h"
 
+#include "modbus_encoder.h"
 #include "modbus_lmb_backend.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdlib>
 #include <error.h>
@@ -10,24 +12,37 @@
 
 #include <arpa/inet.h>
 #include <cstring>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <termios.h>
 #include <unistd.h>
 
 #define LOG(logger) ::logger.Log() << "[modbus] "
 
-TModbusBaseBackend::TModbusBaseBackend(): _context(nullptr), _error(0), slaveId(0), queryBuffer(nullptr)
-{}
+#define MODBUS_TCP_HEADER_LENGTH 7
+#define MODBUS_RTU_HEADER_LENGTH 1
+
+TModbusBaseBackend::TModbusBaseBackend(size_t queue_size, size_t max_adu_length)
+    : _context(nullptr),
+      _error(0),
+      slaveId(0),
+      QueuedQueries(queue_size, max_adu_length),
+      OverflowBuffer(max_adu_length),
+      ByteTimeout{0, 500000},
+      WakeupFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (WakeupFd < 0)
+        throw TModbusException(std::string("Unable to create wakeup event: ") + strerror(errno));
+}
 
 TModbusBaseBackend::~TModbusBaseBackend()
 {
-    for (auto& p: _mappings)
-        modbus_mapping_free(p.second);
-
     if (_context)
         modbus_free(_context);
 
-    delete[] queryBuffer;
+    close(WakeupFd);
 }
 
 void TModbusBaseBackend::SetSlave(uint8_t slave_id)
@@ -37,35 +52,29 @@ void TModbusBaseBackend::SetSlave(uint8_t slave_id)
         _error = errno;
 }
 
-void TModbusBaseBackend::AllocateCache(uint8_t slave_id, size_t di, size_t co, size_t ir, size_t hr)
+void TModbusBaseBackend::AllocateCache(uint8_t slave_id, TStoreType type, const TModbusAddressSet& addresses)
 {
-    if (_mappings[slave_id])
-        return; // TODO: reallocations?
+    // coils and discrete inputs are packed eight per byte
+    const size_t item_bits = (type == COIL || type == DISCRETE_INPUT) ? 1 : 16;
+    auto& cache = _caches.try_emplace(std::make_pair(slave_id, type), item_bits).first->second;
 
-    _mappings[slave_id] = modbus_mapping_new(co, di, hr, ir);
+    const size_t size = cache.Size();
+    cache.Allocate(addresses);
 
-    if (!_mappings[slave_id])
-        _error = errno;
+    if (cache.Size() != size) {
+        LOG(Debug) << "Cache of unit " << int(slave_id) << " " << StoreTypeToString(type) << " grown to "
+                   << cache.Size() << " items";
+    }
 }
 
-void* TModbusBaseBackend::GetCache(TStoreType type, uint8_t slave_id)
+void* TModbusBaseBackend::GetCache(TStoreType type, uint8_t slave_id, int address)
 {
-    if (!_mappings[slave_id]) {
-        throw TModbusException(std::string("Cache for slave ID ") + std::to_string(slave_id) + " is not allocated");
+    auto cache = _caches.find(std::make_pair(slave_id, type));
+    if (cache == _caches.end()) {
+        return nullptr;
     }
 
-    switch (type) {
-        case DISCRETE_INPUT:
-            return _mappings[slave_id]->tab_input_bits;
-        case COIL:
-            return _mappings[slave_id]->tab_bits;
-        case INPUT_REGISTER:
-            return _mappings[slave_id]->tab_input_registers;
-        case HOLDING_REGISTER:
-            return _mappings[slave_id]->tab_registers;
-        default:
-            throw TModbusException("Unknown store type: " + std::to_string(type));
-    }
+    return cache->second.Get(address);
 }
 
 uint8_t TModbusBaseBackend::GetSlave()
@@ -80,28 +89,36 @@ void TModbusBaseBackend::SetDebug(bool debug)
 
 bool TModbusBaseBackend::Available()
 {
-    return !QueuedQueries.empty();
+    return QueuedQueries.Available();
 }
 
-void TModbusBaseBackend::Reply(const TModbusQuery& q)
+void TModbusBaseBackend::Reply(const TModbusQuery& q, const uint8_t* pdu, size_t size)
 {
-    if (q.size <= 0)
-        return;
+    Send(q, pdu, size);
+}
 
-    uint8_t slave_id = 0;
-    if (q.header_length > 0)
-        slave_id = q.data[q.header_length - 1];
+bool TModbusBaseBackend::IsBroadcast(const TModbusQuery& q) const
+{
+    return false;
+}
 
-    if (_mappings.find(slave_id) == _mappings.end())
-        throw TModbusException(std::string("Trying to reply on query with unknown slave ID ") +
-                               std::to_string(slave_id));
+bool TModbusBaseBackend::Send(const TModbusQuery& q, const uint8_t* pdu, size_t size)
+{
+    if (q.size <= 0)
+        return false;
 
-    PreReply(q);
+    if (IsBroadcast(q)) {
+        ++BusCounters.NoResponses;
+        return false;
+    }
 
-    if (modbus_reply(_context, q.data, q.size, _mappings[slave_id]) < 0)
+    if (!SendReply(q, pdu, size)) {
         _error = errno;
+        ++BusCounters.NoResponses;
+        return false;
+    }
 
-    PostReply(q);
+    return true;
 }
 
 void TModbusBaseBackend::ReplyException(TReplyState e, const TModbusQuery& q)
@@ -121,16 +138,38 @@ void TModbusBaseBackend::ReplyException(TReplyState e, const TModbusQuery& q)
         case REPLY_SERVER_FAILURE:
             code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
             break;
+        case REPLY_SERVER_BUSY:
+            code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+            break;
+        case REPLY_GATEWAY_PATH_UNAVAILABLE:
+            code = MODBUS_EXCEPTION_GATEWAY_PATH;
+            break;
+        case REPLY_GATEWAY_TARGET_FAILED:
+            code = MODBUS_EXCEPTION_GATEWAY_TARGET;
+            break;
         default:
             return; // wtf
     }
 
-    PreReply(q);
+    if (q.size <= q.header_length)
+        return;
 
-    if (modbus_reply_exception(_context, q.data, code) == -1)
-        _error = errno;
+    uint8_t pdu[2];
+    size_t size = ModbusEncoder::EncodeException(pdu, q.data[q.header_length], code);
+
+    // exception answered to broadcast is never sent, so it isn't counted
+    if (Send(q, pdu, size))
+        ++BusCounters.Exceptions;
+}
+
+const TModbusBusCounters& TModbusBaseBackend::GetBusCounters()
+{
+    return BusCounters;
+}
 
-    PostReply(q);
+void TModbusBaseBackend::ClearBusCounters()
+{
+    BusCounters = TModbusBusCounters();
 }
 
 int TModbusBaseBackend::GetError()
@@ -148,16 +187,121 @@ TModbusQuery TModbusBaseBackend::ReceiveQuery(bool block)
     if (block && !Available())
         WaitForMessages(-1);
 
-    if (Available()) {
-        TModbusQuery q = QueuedQueries.front();
-        QueuedQueries.pop();
-        return q;
-    } else {
-        return TModbusQuery::emptyQuery();
+    return QueuedQueries.Pop();
+}
+
+void TModbusBaseBackend::ReleaseQuery(const TModbusQuery& q)
+{
+    QueuedQueries.Release(q);
+}
+
+void TModbusBaseBackend::Wakeup()
+{
+    // counter only grows until select() returns, so write never blocks in practice
+    uint64_t one = 1;
+    if (write(WakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG(Warn) << "Unable to wake up Modbus thread: " << strerror(errno);
+}
+
+int TModbusBaseBackend::AddWakeupFd(fd_set& rdset, int fd_max)
+{
+    FD_SET(WakeupFd, &rdset);
+    return std::max(fd_max, WakeupFd);
+}
+
+void TModbusBaseBackend::ClearWakeupFd(fd_set& rdset)
+{
+    if (!FD_ISSET(WakeupFd, &rdset))
+        return;
+
+    uint64_t count;
+    if (read(WakeupFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG(Warn) << "Unable to reset wakeup event: " << strerror(errno);
+
+    FD_CLR(WakeupFd, &rdset);
+}
+
+int TModbusBaseBackend::ReceiveIntoRing(int socket_fd)
+{
+    uint8_t* buffer = QueuedQueries.Acquire();
+    const bool overflow = (buffer == nullptr);
+
+    if (overflow)
+        buffer = OverflowBuffer.data();
+
+    int rc = ReceiveFrame(socket_fd, buffer);
+
+    // damaged frames are bus messages too
+    if (rc < 0 && (errno == EMBBADCRC || errno == EMBBADDATA)) {
+        ++BusCounters.Messages;
+        ++BusCounters.Errors;
+    }
+
+    if (rc <= 0)
+        return rc;
+
+    ++BusCounters.Messages;
+
+    if (overflow) {
+        LOG(Warn) << "Query queue is full (" << QueuedQueries.Size() << " slots), replying busy";
+        ReplyException(REPLY_SERVER_BUSY, TModbusQuery(buffer, rc, modbus_get_header_length(_context), socket_fd));
+        return rc;
+    }
+
+    const size_t high_water = QueuedQueries.HighWater();
+    QueuedQueries.Commit(rc, modbus_get_header_length(_context), socket_fd);
+
+    if (QueuedQueries.HighWater() > high_water)
+        LOG(Debug) << "Query queue high-water mark: " << QueuedQueries.HighWater() << " of "
+                   << QueuedQueries.Size() << " slots";
+
+    return rc;
+}
+
+bool TModbusBaseBackend::ReadExactly(int fd, uint8_t* buffer, size_t size)
+{
+    while (size > 0) {
+        fd_set rdset;
+        FD_ZERO(&rdset);
+        FD_SET(fd, &rdset);
+
+        struct timeval tv = ByteTimeout;
+        int res = select(fd + 1, &rdset, NULL, NULL, &tv);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res == 0)
+            errno = ETIMEDOUT;
+        if (res <= 0)
+            return false;
+
+        ssize_t rc = read(fd, buffer, size);
+        if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (rc == 0)
+            errno = ECONNRESET;
+        if (rc <= 0)
+            return false;
+
+        buffer += rc;
+        size -= rc;
+    }
+
+    return true;
+}
+
+void TModbusBaseBackend::UpdateByteTimeout()
+{
+    uint32_t sec, usec;
+    if (modbus_get_byte_timeout(_context, &sec, &usec) == 0 && (sec > 0 || usec > 0)) {
+        ByteTimeout.tv_sec = sec;
+        ByteTimeout.tv_usec = usec;
     }
 }
 
-TModbusTCPBackend::TModbusTCPBackend(const char* hostname, int port): server_socket(-1), fd_max(-1)
+TModbusTCPBackend::TModbusTCPBackend(const char* hostname, int port, size_t queue_size)
+    : Base(queue_size, MODBUS_TCP_MAX_ADU_LENGTH),
+      server_socket(-1),
+      fd_max(-1)
 {
     char port_buffer[6]; // 5 dec symbols + \0
     std::snprintf(port_buffer, 6, "%u", port);
@@ -165,8 +309,6 @@ TModbusTCPBackend::TModbusTCPBackend(const char* hostname, int port): server_soc
 
     if (!_context)
         throw TModbusException("can't allocate libmodbus context");
-
-    queryBuffer = new uint8_t[MODBUS_TCP_MAX_ADU_LENGTH];
 }
 
 void TModbusTCPBackend::Listen()
@@ -179,6 +321,7 @@ void TModbusTCPBackend::Listen()
         _error = errno;
 
     fd_max = server_socket;
+    UpdateByteTimeout();
 
     // configure select() stuff
     FD_ZERO(&refset);
@@ -192,12 +335,13 @@ int TModbusTCPBackend::WaitForMessages(int timeoutMilliS)
     int num_msgs = 0;
 
     fd_set rdset = refset;
+    const int nfds = AddWakeupFd(rdset, fd_max) + 1;
 
     struct timeval tv;
     tv.tv_usec = (timeoutMilliS % 1000) * 1000;
     tv.tv_sec = timeoutMilliS / 1000;
 
-    int res = select(fd_max + 1, &rdset, NULL, NULL, timeoutMilliS == -1 ? NULL : &tv);
+    int res = select(nfds, &rdset, NULL, NULL, timeoutMilliS == -1 ? NULL : &tv);
     if (res == 0) {
         return 0; // just tell that no messages are available
     }
@@ -208,6 +352,9 @@ int TModbusTCPBackend::WaitForMessages(int timeoutMilliS)
         throw TModbusException(std::string("Error while select(): ") + strerror(errno));
     }
 
+    // woken up by MQTT update, server handles it after receiving queries
+    ClearWakeupFd(rdset);
+
     // retrieve all available data into queue
     for (int s = 0; s <= fd_max; s++) {
         if (!FD_ISSET(s, &rdset))
@@ -231,9 +378,8 @@ int TModbusTCPBackend::WaitForMessages(int timeoutMilliS)
         } else { // receiving new query
             modbus_set_socket(_context, s);
 
-            int rc = modbus_receive(_context, queryBuffer);
+            int rc = ReceiveIntoRing(s);
             if (rc > 0) {
-                QueuedQueries.push(TModbusQuery(queryBuffer, rc, modbus_get_header_length(_context), s));
                 num_msgs++;
             } else {
                 // TODO: error handling
@@ -255,22 +401,68 @@ void TModbusTCPBackend::Close()
     fd_max = -1;
 }
 
-void TModbusTCPBackend::PreReply(const TModbusQuery& q)
+bool TModbusTCPBackend::SendReply(const TModbusQuery& q, const uint8_t* pdu, size_t size)
 {
-    modbus_set_socket(_context, q.socket_fd);
+    if (q.header_length != MODBUS_TCP_HEADER_LENGTH)
+        return false;
+
+    // MBAP header: transaction and protocol IDs are copied from query, unit ID follows length
+    uint8_t header[MODBUS_TCP_HEADER_LENGTH];
+    memcpy(header, q.data, 4);
+    header[4] = (size + 1) >> 8;
+    header[5] = (size + 1) & 0xFF;
+    header[6] = q.data[6];
+
+    struct iovec iov[2] = {{header, sizeof(header)}, {const_cast<uint8_t*>(pdu), size}};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    return sendmsg(q.socket_fd, &msg, MSG_NOSIGNAL) == ssize_t(sizeof(header) + size);
 }
 
-void TModbusTCPBackend::PostReply(const TModbusQuery& q)
-{}
+int TModbusTCPBackend::ReceiveFrame(int socket_fd, uint8_t* buffer)
+{
+    // libmodbus frames query by function code and loses sync on functions it doesn't know,
+    // MBAP header carries length of the rest of frame instead
+    // client which stalls in the middle of frame is disconnected, so it doesn't block others
+    auto fail = [socket_fd]() {
+        if (errno != ETIMEDOUT)
+            return 0;
+
+        LOG(Warn) << "Incomplete frame from socket " << socket_fd << ", closing connection";
+        return -1;
+    };
+
+    if (!ReadExactly(socket_fd, buffer, MODBUS_TCP_HEADER_LENGTH))
+        return fail();
+
+    const size_t length = (buffer[4] << 8) | buffer[5];
+    const bool is_modbus = (buffer[2] == 0 && buffer[3] == 0);
+
+    // length covers unit ID and PDU
+    if (!is_modbus || length < 2 || length - 1 > MODBUS_TCP_MAX_ADU_LENGTH - MODBUS_TCP_HEADER_LENGTH) {
+        LOG(Debug) << "Malformed MBAP header, protocol " << ((buffer[2] << 8) | buffer[3]) << ", length " << length;
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    if (!ReadExactly(socket_fd, buffer + MODBUS_TCP_HEADER_LENGTH, length - 1))
+        return fail();
+
+    return MODBUS_TCP_HEADER_LENGTH + length - 1;
+}
 
-TModbusRTUBackend::TModbusRTUBackend(const TModbusRTUBackendArgs& args): fd(-1)
+TModbusRTUBackend::TModbusRTUBackend(const TModbusRTUBackendArgs& args)
+    : Base(args.QueueSize, MODBUS_RTU_MAX_ADU_LENGTH),
+      fd(-1)
 {
     _context = modbus_new_rtu(args.Device.c_str(), args.BaudRate, args.Parity, args.DataBits, args.StopBits);
 
     if (!_context)
         throw TModbusException("can't allocate libmodbus context");
-
-    queryBuffer = new uint8_t[MODBUS_RTU_MAX_ADU_LENGTH];
 }
 
 void TModbusRTUBackend::Listen()
@@ -285,6 +477,7 @@ void TModbusRTUBackend::Listen()
     }
 
     fd = modbus_get_socket(_context);
+    UpdateByteTimeout();
 
     // configure select() stuff
     FD_ZERO(&refset);
@@ -298,12 +491,13 @@ int TModbusRTUBackend::WaitForMessages(int timeout)
     int num_msgs = 0;
 
     fd_set rdset = refset;
+    const int nfds = AddWakeupFd(rdset, fd) + 1;
 
     struct timeval tv;
     tv.tv_usec = (timeout % 1000) * 1000;
     tv.tv_sec = timeout / 1000;
 
-    int res = select(fd + 1, &rdset, NULL, NULL, timeout == -1 ? NULL : &tv);
+    int res = select(nfds, &rdset, NULL, NULL, timeout == -1 ? NULL : &tv);
     if (res == 0) {
         return 0; // just tell that no messages are available
     }
@@ -314,13 +508,17 @@ int TModbusRTUBackend::WaitForMessages(int timeout)
         throw TModbusException(std::string("Error while select(): ") + strerror(errno));
     }
 
-    int rc = modbus_receive(_context, queryBuffer);
+    // woken up by MQTT update, server handles it when no query came
+    ClearWakeupFd(rdset);
+    if (!FD_ISSET(fd, &rdset))
+        return 0;
+
+    int rc = ReceiveIntoRing(fd);
     if (rc > 0) {
-        QueuedQueries.push(TModbusQuery(queryBuffer, rc, modbus_get_header_length(_context), fd));
         ++num_msgs;
     } else {
         // TODO: error handling
-        LOG(Debug) << "modbus_receive returned " << rc << " errno " << errno;
+        LOG(Debug) << "Query receive returned " << rc << " errno " << errno;
         if (rc < 0) {
             _error = errno;
             return rc;
@@ -337,16 +535,54 @@ void TModbusRTUBackend::Close()
     fd = -1;
 }
 
-void TModbusRTUBackend::PreReply(const TModbusQuery& q)
+bool TModbusRTUBackend::SendReply(const TModbusQuery& q, const uint8_t* pdu, size_t size)
 {
-    uint8_t slave_id = 0;
-    if (q.header_length > 0)
-        slave_id = q.data[q.header_length - 1];
+    if (q.header_length != MODBUS_RTU_HEADER_LENGTH)
+        return false;
+
+    uint8_t address = q.data[0];
 
-    modbus_set_slave(_context, slave_id);
+    uint16_t crc = ModbusEncoder::Crc16(&address, 1);
+    crc = ModbusEncoder::Crc16Update(crc, pdu, size);
+    uint8_t crc_bytes[2] = {uint8_t(crc & 0xFF), uint8_t(crc >> 8)};
+
+    struct iovec iov[3] = {{&address, 1}, {const_cast<uint8_t*>(pdu), size}, {crc_bytes, sizeof(crc_bytes)}};
+
+    return writev(q.socket_fd, iov, 3) == ssize_t(1 + size + sizeof(crc_bytes));
+}
+
+bool TModbusRTUBackend::IsBroadcast(const TModbusQuery& q) const
+{
+    return q.header_length == MODBUS_RTU_HEADER_LENGTH && q.data[0] == 0;
 }
 
-void TModbusRTUBackend::PostReply(const TModbusQuery& q)
+int TModbusRTUBackend::ReceiveFrame(int socket_fd, uint8_t* buffer)
 {
-    modbus_set_slave(_context, slaveId);
+    // libmodbus frames query by function code and drops functions it doesn't know,
+    // so frame length is calculated here: address and function, meta part, data part and CRC
+    auto fail = [this](int error) {
+        tcflush(fd, TCIFLUSH);
+        errno = error;
+        return -1;
+    };
+
+    size_t length = MODBUS_RTU_HEADER_LENGTH + 1;
+    if (!ReadExactly(fd, buffer, length))
+        return fail(EMBBADDATA);
+
+    const size_t meta_length = ModbusEncoder::RequestMetaLength(buffer[MODBUS_RTU_HEADER_LENGTH]);
+    if (!ReadExactly(fd, buffer + length, meta_length))
+        return fail(EMBBADDATA);
+    length += meta_length;
+
+    const size_t data_length = ModbusEncoder::RequestDataLength(buffer + MODBUS_RTU_HEADER_LENGTH) + 2;
+    if (length + data_length > MODBUS_RTU_MAX_ADU_LENGTH || !ReadExactly(fd, buffer + length, data_length))
+        return fail(EMBBADDATA);
+    length += data_length;
+
+    const uint16_t crc = ModbusEncoder::Crc16(buffer, length - 2);
+    if (buffer[length - 2] != (crc & 0xFF) || buffer[length - 1] != (crc >> 8))
+        return fail(EMBBADCRC);
+
+    return length;
 }
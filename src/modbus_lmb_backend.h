@@ -5,47 +5,113 @@
  * \brief Libmodbus backend for gateway
  */
 
+#include "modbus_query_ring.h"
 #include "modbus_wrapper.h"
 
-#include <queue>
+#include <map>
+#include <utility>
+#include <vector>
 
 #include <modbus/modbus.h>
 
 // Maximum number of connections
 #define NB_CONNECTIONS 2
 
+// Default number of query slots in receive ring
+#define DEFAULT_QUERY_QUEUE_SIZE 16
+
 /*! Modbus base backend */
 class TModbusBaseBackend: public IModbusBackend
 {
 public:
-    TModbusBaseBackend();
+    TModbusBaseBackend(size_t queue_size, size_t max_adu_length);
     ~TModbusBaseBackend();
 
     void SetSlave(uint8_t slave_id) override;
-    void AllocateCache(uint8_t slave_id, size_t di, size_t co, size_t ir, size_t hr) override;
-    void* GetCache(TStoreType type, uint8_t slave_id = 0) override;
+    void AllocateCache(uint8_t slave_id, TStoreType type, const TModbusAddressSet& addresses) override;
+    void* GetCache(TStoreType type, uint8_t slave_id = 0, int address = 0) override;
     uint8_t GetSlave() override;
     void SetDebug(bool debug) override;
     bool Available() override;
-    void Reply(const TModbusQuery& q) override;
+    void Reply(const TModbusQuery& q, const uint8_t* pdu, size_t size) override;
     void ReplyException(TReplyState e, const TModbusQuery& q) override;
+    const TModbusBusCounters& GetBusCounters() override;
+    void ClearBusCounters() override;
     int GetError() override;
     std::string GetStrError() override;
     TModbusQuery ReceiveQuery(bool block = false) override;
+    void ReleaseQuery(const TModbusQuery& q) override;
+    void Wakeup() override;
 
 protected:
-    virtual void PreReply(const TModbusQuery& q) = 0;
-    virtual void PostReply(const TModbusQuery& q) = 0;
+    /*! Frame reply PDU for transport and send it with single system call
+     * \param q Query to reply on
+     * \param pdu Reply PDU
+     * \param size Reply PDU size
+     * \return true on success
+     */
+    virtual bool SendReply(const TModbusQuery& q, const uint8_t* pdu, size_t size) = 0;
+
+    /*! Check if query is broadcast, such queries are never replied */
+    virtual bool IsBroadcast(const TModbusQuery& q) const;
+
+    /*! Send reply counting queries left without it
+     * \return true if reply was transmitted
+     */
+    bool Send(const TModbusQuery& q, const uint8_t* pdu, size_t size);
+
+    /*! Receive query from current context socket into query ring
+     * If ring is full, query is answered with busy exception
+     * \param socket_fd Socket or serial port descriptor
+     * \return Result of ReceiveFrame()
+     */
+    int ReceiveIntoRing(int socket_fd);
+
+    /*! Receive single query frame
+     * \param socket_fd Socket or serial port descriptor
+     * \param buffer Buffer for frame, maximum ADU length
+     * \return Frame size, 0 if connection is closed, -1 on error (errno is EMBBADCRC or EMBBADDATA for damaged frame)
+     */
+    virtual int ReceiveFrame(int socket_fd, uint8_t* buffer) = 0;
+
+    /*! Read exactly given number of bytes, waiting for each chunk no longer than byte timeout,
+     * so stalled peer doesn't block server
+     * \return true on success, otherwise errno is ETIMEDOUT on timeout or ECONNRESET if peer is gone
+     */
+    bool ReadExactly(int fd, uint8_t* buffer, size_t size);
+
+    /*! Take byte timeout from libmodbus context if it is set */
+    void UpdateByteTimeout();
+
+    /*! Add wakeup descriptor to select() set
+     * \return Maximum descriptor in set
+     */
+    int AddWakeupFd(fd_set& rdset, int fd_max);
+
+    /*! Consume wakeup if it came and remove its descriptor from select() result */
+    void ClearWakeupFd(fd_set& rdset);
 
     modbus_t* _context;
-    std::map<uint8_t, modbus_mapping_t*> _mappings;
+
+    /*! Cache of each store by unit ID */
+    std::map<std::pair<uint8_t, TStoreType>, TModbusPagedCache> _caches;
     int _error;
     uint8_t slaveId;
-    uint8_t* queryBuffer;
 
-    std::queue<TModbusQuery> QueuedQueries;
+    TModbusQueryRing QueuedQueries;
+
+    /*! Buffer to receive queries when ring is full */
+    std::vector<uint8_t> OverflowBuffer;
+
+    TModbusBusCounters BusCounters;
 
     fd_set refset;
+
+    /*! Maximum interval between bytes of frame */
+    struct timeval ByteTimeout;
+
+    /*! Event descriptor interrupting select() from other threads */
+    int WakeupFd;
 };
 
 /*! Modbus TCP backend */
@@ -54,15 +120,19 @@ class TModbusTCPBackend: public TModbusBaseBackend
     using Base = TModbusBaseBackend;
 
 public:
-    TModbusTCPBackend(const char* hostname = "127.0.0.1", int port = 502);
+    TModbusTCPBackend(const char* hostname = "127.0.0.1",
+                      int port = 502,
+                      size_t queue_size = DEFAULT_QUERY_QUEUE_SIZE);
 
     void Listen() override;
     int WaitForMessages(int timeout = -1) override;
     void Close() override;
 
 private:
-    void PreReply(const TModbusQuery& q) override;
-    void PostReply(const TModbusQuery& q) override;
+    bool SendReply(const TModbusQuery& q, const uint8_t* pdu, size_t size) override;
+
+    /*! Receive frame using MBAP header length, so any function code is framed correctly */
+    int ReceiveFrame(int socket_fd, uint8_t* buffer) override;
 
     int server_socket;
     int fd_max;
@@ -75,6 +145,7 @@ struct TModbusRTUBackendArgs
     char Parity = 'N';
     int DataBits = 8;
     int StopBits = 1;
+    size_t QueueSize = DEFAULT_QUERY_QUEUE_SIZE;
 };
 
 /*! Modbus RTU backend */
@@ -90,8 +161,11 @@ public:
     void Close() override;
 
 private:
-    void PreReply(const TModbusQuery& q) override;
-    void PostReply(const TModbusQuery& q) override;
+    bool SendReply(const TModbusQuery& q, const uint8_t* pdu, size_t size) override;
+    bool IsBroadcast(const TModbusQuery& q) const override;
+
+    /*! Receive frame calculating its length by function code, so any supported function is framed correctly */
+    int ReceiveFrame(int socket_fd, uint8_t* buffer) override;
 
     int fd;
 };
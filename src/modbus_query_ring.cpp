@@ -0,0 +1,83 @@
+#include "modbus_query_ring.h"
+
+#include <algorithm>
+
+TModbusQueryRing::TModbusQueryRing(size_t slots, size_t slot_size)
+    : Buffer(std::max<size_t>(slots, 1) * slot_size),
+      Slots(std::max<size_t>(slots, 1)),
+      SlotSize(slot_size),
+      Head(0),
+      Tail(0),
+      Read(0),
+      Count(0),
+      MaxCount(0)
+{}
+
+uint8_t* TModbusQueryRing::Acquire()
+{
+    if (Count == Slots.size())
+        return nullptr;
+
+    return &Buffer[Tail * SlotSize];
+}
+
+void TModbusQueryRing::Commit(int size, int header_length, int socket_fd)
+{
+    if (Count == Slots.size())
+        return;
+
+    TSlot& slot = Slots[Tail];
+    slot.State = SLOT_READY;
+    slot.Size = size;
+    slot.HeaderLength = header_length;
+    slot.SocketFd = socket_fd;
+
+    Tail = (Tail + 1) % Slots.size();
+    ++Count;
+
+    if (Count > MaxCount)
+        MaxCount = Count;
+}
+
+bool TModbusQueryRing::Available() const
+{
+    return Slots[Read].State == SLOT_READY;
+}
+
+TModbusQuery TModbusQueryRing::Pop()
+{
+    if (!Available())
+        return TModbusQuery::emptyQuery();
+
+    const int index = Read;
+    TSlot& slot = Slots[index];
+    slot.State = SLOT_BUSY;
+
+    Read = (Read + 1) % Slots.size();
+
+    return TModbusQuery(&Buffer[index * SlotSize], slot.Size, slot.HeaderLength, slot.SocketFd, index);
+}
+
+void TModbusQueryRing::Release(const TModbusQuery& query)
+{
+    if (query.slot < 0 || size_t(query.slot) >= Slots.size() || Slots[query.slot].State != SLOT_BUSY)
+        return;
+
+    Slots[query.slot].State = SLOT_FREE;
+
+    // slots may be released out of order, so move head over all released slots
+    while (Count > 0 && Slots[Head].State == SLOT_FREE) {
+        Head = (Head + 1) % Slots.size();
+        --Count;
+    }
+}
+
+size_t TModbusQueryRing::Size() const
+{
+    return Slots.size();
+}
+
+size_t TModbusQueryRing::HighWater() const
+{
+    return MaxCount;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+/*!
+ * \file modbus_query_ring.h
+ * \brief Preallocated ring of query buffers
+ */
+
+#include "modbus_wrapper.h"
+
+#include <vector>
+
+/*! Ring of fixed-size query slots
+ * Backend receives queries directly into free slots, server reads them in place
+ * through TModbusQuery views and releases slots after reply.
+ * Slots are allocated once, so receiving queries doesn't allocate memory.
+ */
+class TModbusQueryRing
+{
+public:
+    /*! Create ring
+     * \param slots Number of query slots
+     * \param slot_size Size of each slot in bytes (maximum ADU length)
+     */
+    TModbusQueryRing(size_t slots, size_t slot_size);
+
+    /*! Get buffer of next free slot to receive query into
+     * \return Slot buffer, or nullptr if ring is full
+     */
+    uint8_t* Acquire();
+
+    /*! Put query received into buffer returned by Acquire() into ring
+     * \param size Query size
+     * \param header_length Query header length
+     * \param socket_fd Reply socket descriptor
+     */
+    void Commit(int size, int header_length, int socket_fd);
+
+    /*! Check if there are committed queries to read */
+    bool Available() const;
+
+    /*! Get oldest committed query
+     * \return Query view, or empty query if there are no queries
+     */
+    TModbusQuery Pop();
+
+    /*! Release query slot, so it can be reused for next queries
+     * \param query Query returned by Pop()
+     */
+    void Release(const TModbusQuery& query);
+
+    /*! Number of slots */
+    size_t Size() const;
+
+    /*! Maximum number of slots occupied at the same time */
+    size_t HighWater() const;
+
+private:
+    enum TSlotState
+    {
+        SLOT_FREE,
+        SLOT_READY, /*!< query received, waiting to be read */
+        SLOT_BUSY   /*!< query is being processed */
+    };
+
+    struct TSlot
+    {
+        TSlotState State = SLOT_FREE;
+        int Size = 0;
+        int HeaderLength = 0;
+        int SocketFd = -1;
+    };
+
+    std::vector<uint8_t> Buffer;
+    std::vector<TSlot> Slots;
+    size_t SlotSize;
+
+    size_t Head;  /*!< oldest occupied slot */
+    size_t Tail;  /*!< next slot to receive into */
+    size_t Read;  /*!< next slot to pop */
+    size_t Count; /*!< number of slots between Head and Tail */
+    size_t MaxCount;
+};
@@ -1,13 +1,63 @@
 #include "modbus_wrapper.h"
+#include "cache_snapshot.h"
 #include "log.h"
+#include "register_group.h"
+#include "shm_export.h"
+#include "stats_publisher.h"
+#include "update_queue.h"
 #include <modbus/modbus.h>
 
+#include <algorithm>
+#include <cstring>
 #include <map>
 
 #define LOG(logger) ::logger.Log() << "[modbus] "
 
 using namespace std;
 
+namespace
+{
+    /*! Maximum interval between polls of deferred replies, ms */
+    const int DEFERRED_POLL_MS = 10;
+
+    /*! Call batched observer callback once per observer with all its segments of request
+     * \param segments Request segments with their observers, in address order
+     * \param batch Scratch buffer for segments of single observer
+     * \param reply Reply state to return if there are no segments
+     * \param call Callable (IModbusServerObserver*, const std::vector<TSegment>&) returning TReplyState
+     * \return First error state or state returned by last call
+     */
+    template<typename TSegment, typename F>
+    TReplyState CallObserversBatched(const vector<pair<IModbusServerObserver*, TSegment>>& segments,
+                                     vector<TSegment>& batch,
+                                     TReplyState reply,
+                                     F&& call)
+    {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            IModbusServerObserver* obs = segments[i].first;
+
+            // observer is already called with its segments
+            bool called = false;
+            for (size_t j = 0; j < i && !called; ++j)
+                called = (segments[j].first == obs);
+            if (called)
+                continue;
+
+            batch.clear();
+            for (size_t j = i; j < segments.size(); ++j) {
+                if (segments[j].first == obs)
+                    batch.push_back(segments[j].second);
+            }
+
+            reply = call(obs, batch);
+            if (reply > 0)
+                break;
+        }
+
+        return reply;
+    }
+}
+
 TModbusServer::TModbusServer(PModbusBackend backend): mb(backend)
 {
     // fill _CmdRangeMap for quick and pretty access in parser
@@ -45,15 +95,21 @@ PModbusBackend TModbusServer::Backend()
 void TModbusServer::Observe(PModbusServerObserver o,
                             TStoreType store,
                             const TModbusAddressRange& range,
-                            uint8_t slave_id)
+                            uint8_t slave_id,
+                            bool cache_backed)
 {
     int offset = slave_id << 16;
     TRSet& max_addr = _maxSlaveAddresses[slave_id];
+    const bool guards_cache = o->GuardsCache();
 
 #define PROCESS(a, b)                                                                                                  \
     do {                                                                                                               \
         if (store & (a)) {                                                                                             \
             _##b.insert(range + offset, o);                                                                            \
+            if (!cache_backed)                                                                                         \
+                _ReadCallbackRanges[a].insert(range + offset, o);                                                      \
+            if (guards_cache)                                                                                          \
+                _ReadCacheRanges[a].insert(range + offset, o);                                                         \
             if (range.getEnd() > max_addr.b)                                                                           \
                 max_addr.b = range.getEnd();                                                                           \
         }                                                                                                              \
@@ -67,30 +123,157 @@ void TModbusServer::Observe(PModbusServerObserver o,
 #undef PROCESS
 }
 
+void TModbusServer::ObserveFile(PModbusServerObserver o, uint16_t file, uint8_t slave_id)
+{
+    if (!_FileObservers.emplace((slave_id << 16) + file, o).second)
+        throw WrongSegmentException("File " + to_string(file) + " is already observed");
+
+    // slave with files only has no registers, but it still has to answer
+    _maxSlaveAddresses.emplace(slave_id, TRSet());
+}
+
+void TModbusServer::Unobserve(PModbusServerObserver o)
+{
+    _di.erase(o);
+    _co.erase(o);
+    _ir.erase(o);
+    _hr.erase(o);
+
+    for (auto& r: _ReadCallbackRanges)
+        r.second.erase(o);
+
+    for (auto& r: _ReadCacheRanges)
+        r.second.erase(o);
+
+    for (auto file = _FileObservers.begin(); file != _FileObservers.end();) {
+        if (file->second == o)
+            file = _FileObservers.erase(file);
+        else
+            ++file;
+    }
+
+    // removed observer won't be polled anymore, client waiting for it gets exception
+    for (auto& deferred: _DeferredReplies) {
+        for (auto* observers: {&deferred.Writers, &deferred.Readers}) {
+            auto it = std::remove_if(observers->begin(), observers->end(), [&](const TDeferringObserver& d) {
+                return d.Observer == o.get();
+            });
+            if (it != observers->end()) {
+                observers->erase(it, observers->end());
+                deferred.Reply = REPLY_GATEWAY_PATH_UNAVAILABLE;
+            }
+        }
+    }
+
+    _UpdateSlaveAddresses();
+}
+
+void TModbusServer::_UpdateSlaveAddresses()
+{
+    _maxSlaveAddresses.clear();
+
+    auto collect = [this](const TModbusAddressRange& range, int TRSet::*max_addr) {
+        for (auto segment = range.cbegin(); segment != range.cend(); ++segment) {
+            const int slave_id = segment->first >> 16;
+            TRSet& r = _maxSlaveAddresses[slave_id];
+            r.*max_addr = std::max(r.*max_addr, segment->second.first - (slave_id << 16));
+        }
+    };
+
+    collect(_di, &TRSet::di);
+    collect(_co, &TRSet::co);
+    collect(_ir, &TRSet::ir);
+    collect(_hr, &TRSet::hr);
+
+    for (const auto& file: _FileObservers)
+        _maxSlaveAddresses.emplace(file.first >> 16, TRSet());
+}
+
 bool TModbusServer::IsObserved(uint8_t slave_id) const
 {
     return _maxSlaveAddresses.find(slave_id) != _maxSlaveAddresses.end();
 }
 
-static void _callCacheAllocate(const TModbusAddressRange& range, uint8_t slave_id, TStoreType store, void* cache_start)
+void TModbusServer::SetUnknownUnitReply(TReplyState reply)
+{
+    _UnknownUnitReply = reply;
+}
+
+void TModbusServer::SetShmExport(shared_ptr<TModbusShmExport> shm_export)
+{
+    _ShmExport = shm_export;
+}
+
+void TModbusServer::SetCacheSnapshot(shared_ptr<TModbusCacheSnapshot> snapshot)
+{
+    _CacheSnapshot = snapshot;
+}
+
+void TModbusServer::SaveCacheSnapshot()
+{
+    if (_CacheSnapshot)
+        _CacheSnapshot->Save(true);
+}
+
+void TModbusServer::SetRegisterGroups(const vector<shared_ptr<TRegisterGroup>>& groups)
+{
+    _RegisterGroups = groups;
+
+    for (const auto& group: _RegisterGroups)
+        group->SetWakeup([this] { mb->Wakeup(); });
+}
+
+void TModbusServer::SetUpdateQueue(shared_ptr<TUpdateQueue> queue)
+{
+    _UpdateQueue = queue;
+
+    if (_UpdateQueue)
+        _UpdateQueue->SetWakeup([this] { mb->Wakeup(); });
+}
+
+void TModbusServer::SetStatsPublisher(shared_ptr<TStatsPublisher> stats)
+{
+    _StatsPublisher = stats;
+}
+
+void TModbusServer::_ApplyUpdates()
+{
+    if (_UpdateQueue)
+        _UpdateQueue->Drain();
+
+    for (const auto& group: _RegisterGroups)
+        group->Commit();
+}
+
+static TModbusAddressSet _collectAddresses(const TModbusAddressRange& range, uint8_t slave_id)
+{
+    TModbusAddressSet addresses;
+
+    for (auto item = range.cbegin(); item != range.cend(); ++item) {
+        if (((item->first >> 16) & 0xFF) == slave_id)
+            addresses.insert(item->first & 0xFFFF, item->second.first - item->first);
+    }
+
+    return addresses;
+}
+
+static void _callCacheAllocate(const TModbusAddressRange& range,
+                               uint8_t slave_id,
+                               TStoreType store,
+                               IModbusBackend& backend)
 {
     map<PModbusServerObserver, TModbusCacheAddressRange> observers;
 
     // collect ranges for observers
     for (auto item = range.cbegin(); item != range.cend(); ++item) {
         int cache_offset = item->first;
-        void* cache_ptr = cache_start;
 
         if (((cache_offset >> 16) & 0xFF) != slave_id)
             continue;
         else
             cache_offset &= 0xFFFF;
 
-        // shift data offset for 16-bit values
-        if (store == INPUT_REGISTER || store == HOLDING_REGISTER)
-            cache_ptr = static_cast<uint16_t*>(cache_ptr) + cache_offset;
-        else
-            cache_ptr = static_cast<uint8_t*>(cache_ptr) + cache_offset;
+        void* cache_ptr = backend.GetCache(store, slave_id, cache_offset);
 
         observers[item->second.second].insert(cache_offset, item->second.first - item->first, cache_ptr);
     }
@@ -103,25 +286,74 @@ static void _callCacheAllocate(const TModbusAddressRange& range, uint8_t slave_i
 
 void TModbusServer::AllocateCache()
 {
+    static const vector<pair<TStoreType, TModbusAddressRange TModbusServer::*>> stores = {
+        {DISCRETE_INPUT, &TModbusServer::_di},
+        {COIL, &TModbusServer::_co},
+        {INPUT_REGISTER, &TModbusServer::_ir},
+        {HOLDING_REGISTER, &TModbusServer::_hr}};
+
     for (auto& s: _maxSlaveAddresses) {
         const int slave_id = s.first;
-        const TRSet& r = s.second;
 
-        // allocate modbus mapping
-        mb->AllocateCache(slave_id, r.di, r.co, r.ir, r.hr);
+        for (const auto& store: stores) {
+            const TModbusAddressRange& range = this->*store.second;
+
+            // allocate cache pages for observed addresses only
+            mb->AllocateCache(slave_id, store.first, _collectAddresses(range, slave_id));
 
-        // call OnCacheAllocate with correct ranges for each observer
-        _callCacheAllocate(_di, slave_id, DISCRETE_INPUT, mb->GetCache(DISCRETE_INPUT, slave_id));
-        _callCacheAllocate(_co, slave_id, COIL, mb->GetCache(COIL, slave_id));
-        _callCacheAllocate(_ir, slave_id, INPUT_REGISTER, mb->GetCache(INPUT_REGISTER, slave_id));
-        _callCacheAllocate(_hr, slave_id, HOLDING_REGISTER, mb->GetCache(HOLDING_REGISTER, slave_id));
+            // call OnCacheAllocate with correct ranges for each observer
+            _callCacheAllocate(range, slave_id, store.first, *mb);
+        }
     }
 
+    const auto segments = _GetCacheSegments();
+
+    // restored values go to shared memory export too
+    if (_CacheSnapshot)
+        _CacheSnapshot->Attach(segments);
+
+    if (_ShmExport)
+        _ShmExport->Create(segments);
+
     LOG(Debug) << "Modbus cache allocated";
 }
 
+vector<TModbusCacheSegment> TModbusServer::_GetCacheSegments()
+{
+    vector<TModbusCacheSegment> segments;
+
+    auto collect = [&](const TModbusAddressRange& range, TStoreType type) {
+        for (auto item = range.cbegin(); item != range.cend(); ++item) {
+            const uint8_t slave_id = (item->first >> 16) & 0xFF;
+            const int start = item->first & 0xFFFF;
+            void* cache = mb->GetCache(type, slave_id, start);
+
+            if (cache)
+                segments.push_back({slave_id, type, start, item->second.first - item->first, cache});
+        }
+    };
+
+    collect(_di, DISCRETE_INPUT);
+    collect(_co, COIL);
+    collect(_ir, INPUT_REGISTER);
+    collect(_hr, HOLDING_REGISTER);
+
+    return segments;
+}
+
 int TModbusServer::Loop(int timeoutMilliS)
 {
+    // nothing wakes server up when deferred write is done, so poll it
+    if (!_DeferredReplies.empty() && (timeoutMilliS < 0 || timeoutMilliS > DEFERRED_POLL_MS))
+        timeoutMilliS = DEFERRED_POLL_MS;
+
+    // staged group values are committed as soon as group window elapses
+    for (const auto& group: _RegisterGroups) {
+        const int group_timeout = group->GetCommitTimeout();
+        if (group_timeout >= 0 && (timeoutMilliS < 0 || timeoutMilliS > group_timeout))
+            timeoutMilliS = group_timeout;
+    }
+
     int rc = mb->WaitForMessages(timeoutMilliS);
     if (rc == -1) {
         LOG(Error) << mb->GetStrError();
@@ -141,10 +373,32 @@ int TModbusServer::Loop(int timeoutMilliS)
         TModbusQuery q = mb->ReceiveQuery();
         auto slave_id = q.header_length > 0 ? q.data[q.header_length - 1] : 0;
         if (q.size > 0 && IsObserved(slave_id)) {
+            ++_ServerMessageCount;
+            // groups change cache only between queries, so reply never mixes generations
+            _ApplyUpdates();
+
+            _Deferring.clear();
+            _DeferringReads.clear();
             _ProcessQuery(q);
+        } else if (q.size > q.header_length && _UnknownUnitReply > 0) {
+            // don't let client wait for response timeout
+            mb->ReplyException(_UnknownUnitReply, q);
         }
+        mb->ReleaseQuery(q);
     }
 
+    // updates came while bus is idle
+    _ApplyUpdates();
+
+    if (!_DeferredReplies.empty())
+        _PollDeferred();
+
+    if (_CacheSnapshot)
+        _CacheSnapshot->SaveIfDue();
+
+    if (_StatsPublisher)
+        _StatsPublisher->PublishIfDue();
+
     return 0;
 }
 
@@ -153,8 +407,6 @@ void TModbusServer::_ProcessQuery(const TModbusQuery& query)
     // get command code
     Command command = static_cast<Command>(query.data[query.header_length]);
 
-    // get register address
-    uint16_t start_address = _ReadU16(&(query.data[query.header_length + 1]));
     uint8_t slave_id = 0;
 
     // get slave ID and append it to address
@@ -162,62 +414,118 @@ void TModbusServer::_ProcessQuery(const TModbusQuery& query)
         slave_id = query.data[query.header_length - 1];
     }
 
+    // functions with their own request layout
+    switch (command) {
+        case DIAGNOSTICS:
+            _ProcessDiagnosticsQuery(query);
+            return;
+        case READ_FILE_RECORD:
+            _ProcessReadFileQuery(slave_id, query);
+            return;
+        case WRITE_FILE_RECORD:
+            _ProcessWriteFileQuery(slave_id, query);
+            return;
+        case MASK_WRITE_REGISTER:
+            _ProcessMaskWriteQuery(slave_id, query);
+            return;
+        case WRITE_READ_REGISTERS:
+            _ProcessWriteReadQuery(slave_id, query);
+            return;
+        case READ_FIFO_QUEUE:
+            _ProcessReadFifoQuery(slave_id, query);
+            return;
+        default:
+            break;
+    }
+
+    auto cmd_range = _CmdRangeMap.find(command);
+    if (cmd_range == _CmdRangeMap.end()) {
+        mb->ReplyException(REPLY_ILLEGAL_FUNCTION, query);
+        return;
+    }
+
+    TModbusAddressRange& range = *cmd_range->second;
+    TStoreType store_type = _CmdStoreTypeMap[command];
+
+    // all other supported commands have at least address and count/value fields
+    const int pdu_size = query.size - query.header_length;
+    if (pdu_size < 5) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    // get register address
+    uint16_t start_address = _ReadU16(&(query.data[query.header_length + 1]));
+
     uint16_t count;
 
     // get command data - address range and access mode
     if (_IsReadCmd(command)) {
         count = _ReadU16(&(query.data[query.header_length + 3]));
-        _ProcessReadQuery(_CmdStoreTypeMap[command], *_CmdRangeMap[command], slave_id, start_address, count, query);
-    } else {
-        if (_IsSingleWriteCmd(command)) {
-            count = 1;
-        } else {
-            count = _ReadU16(&(query.data[query.header_length + 3]));
+
+        const int max_count = (store_type == COIL || store_type == DISCRETE_INPUT) ? MODBUS_MAX_READ_BITS
+                                                                                   : MODBUS_MAX_READ_REGISTERS;
+        if (count == 0 || count > max_count) {
+            mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+            return;
         }
 
-        // get values from write request to run pre-write action
-        void* values;
+        _ProcessReadQuery(store_type, range, slave_id, start_address, count, query);
+        return;
+    }
 
-        if (_IsCoilWriteCmd(command)) {
-            uint8_t* raw_data = &(query.data[query.header_length + (_IsSingleWriteCmd(command) ? 3 : 6)]);
-            uint8_t* int_values = new uint8_t[count];
+    const uint8_t* raw_data;
+    int raw_size;
 
-            uint8_t bits = 1;
-            int q = 0;
+    if (_IsSingleWriteCmd(command)) {
+        count = 1;
+        raw_data = &(query.data[query.header_length + 3]);
+        raw_size = 2;
+    } else {
+        count = _ReadU16(&(query.data[query.header_length + 3]));
+        raw_data = &(query.data[query.header_length + 6]);
+        raw_size = (pdu_size >= 6) ? query.data[query.header_length + 5] : 0;
 
-            for (int i = 0; i < count; i++) {
-                int_values[i] = raw_data[q] & bits ? 0xFF : 0;
-                bits <<= 1;
-                if (bits == 0) {
-                    q++;
-                    bits = 1;
-                }
+        if (raw_size > pdu_size - 6) {
+            mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+            return;
+        }
+    }
+
+    // get values from write request to run pre-write action,
+    // request temporaries live on stack, so no allocations are made here
+    if (_IsCoilWriteCmd(command)) {
+        uint8_t values[MODBUS_MAX_WRITE_BITS];
+
+        if (_IsSingleWriteCmd(command)) {
+            const uint16_t value = _ReadU16(raw_data);
+            if (value != 0xFF00 && value != 0x0000) {
+                mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+                return;
             }
 
-            values = int_values;
+            values[0] = value ? 0xFF : 0;
         } else {
-            uint8_t* raw_data = &(query.data[query.header_length + (_IsSingleWriteCmd(command) ? 3 : 6)]);
-            uint16_t* int_values = new uint16_t[count];
-
-            for (int i = 0; i < count; i++)
-                int_values[i] = (raw_data[2 * i] << 8) | (raw_data[2 * i + 1]);
+            if (count == 0 || count > MODBUS_MAX_WRITE_BITS || raw_size < (count + 7) / 8) {
+                mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+                return;
+            }
 
-            values = int_values;
+            ModbusEncoder::UnpackBits(values, raw_data, count, 0xFF);
         }
 
-        _ProcessWriteQuery(_CmdStoreTypeMap[command],
-                           *_CmdRangeMap[command],
-                           slave_id,
-                           start_address,
-                           count,
-                           query,
-                           values);
+        _ProcessWriteQuery(store_type, range, slave_id, start_address, count, query, values);
+    } else {
+        uint16_t values[MODBUS_MAX_WRITE_REGISTERS];
 
-        if (_IsCoilWriteCmd(command)) {
-            delete[] static_cast<uint8_t*>(values);
-        } else {
-            delete[] static_cast<uint16_t*>(values);
+        if (count == 0 || count > MODBUS_MAX_WRITE_REGISTERS || raw_size < count * 2) {
+            mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+            return;
         }
+
+        ModbusEncoder::UnpackRegisters(values, raw_data, count);
+
+        _ProcessWriteQuery(store_type, range, slave_id, start_address, count, query, values);
     }
 }
 
@@ -229,49 +537,225 @@ void TModbusServer::_ProcessReadQuery(TStoreType type,
                                       const TModbusQuery& query)
 {
     // ask callback, then reply
-    try {
-        void* cache_ptr;
-        int item_size;
-
-        try {
-            if (type == COIL || type == DISCRETE_INPUT) {
-                cache_ptr = static_cast<uint8_t*>(mb->GetCache(type, slave_id)) + start;
-                item_size = sizeof(uint8_t);
+    const void* cache_ptr = nullptr;
+    TReplyState reply = _ReadValues(type, range, slave_id, start, count, cache_ptr);
+
+    if (reply > 0)
+        mb->ReplyException(reply, query);
+    else
+        _ReplyRead(type, query, cache_ptr, start, count);
+}
+
+TReplyState TModbusServer::_ReadValues(TStoreType type,
+                                       TModbusAddressRange& range,
+                                       uint8_t slave_id,
+                                       int start,
+                                       unsigned count,
+                                       const void*& values)
+{
+    // covered range is contiguous in cache
+    void* cache_ptr = mb->GetCache(type, slave_id, start);
+    if (!cache_ptr)
+        return REPLY_ILLEGAL_ADDRESS;
+
+    const bool is_bit = (type == COIL || type == DISCRETE_INPUT);
+    const int slave_offset = slave_id << 16;
+
+    if (!range.covers(start + slave_offset, count))
+        return REPLY_ILLEGAL_ADDRESS;
+
+    TReplyState reply = REPLY_CACHED;
+
+    // observers without cached values are asked first
+    auto callbacks = _ReadCallbackRanges.find(type);
+    if (callbacks != _ReadCallbackRanges.end()) {
+        _ReadSegments.clear();
+
+        // observers get one byte per bit, values they return are packed to cache then
+        if (is_bit)
+            ModbusEncoder::LoadBits(_ReadBuffer, static_cast<const uint8_t*>(cache_ptr), start % 8, count);
+
+        auto collect_segment = [&](int s_start, int s_count, const PModbusServerObserver& obs) {
+            const int offset = s_start - slave_offset - start;
+            void* data;
+
+            if (is_bit) {
+                data = _ReadBuffer + offset;
             } else {
-                cache_ptr = static_cast<uint16_t*>(mb->GetCache(type, slave_id)) + start;
-                item_size = sizeof(uint16_t);
+                data = static_cast<uint16_t*>(cache_ptr) + offset;
             }
-        } catch (const TModbusException& e) {
-            mb->ReplyException(TReplyState::REPLY_ILLEGAL_ADDRESS, query);
-            return;
+
+            _ReadSegments.emplace_back(
+                obs.get(),
+                TModbusReadSegment{static_cast<uint16_t>(s_start - slave_offset), unsigned(s_count), data});
+            return true;
+        };
+
+        callbacks->second.forEachIntersection(start + slave_offset, count, collect_segment);
+
+        reply = CallObserversBatched(_ReadSegments,
+                                     _ReadBatch,
+                                     REPLY_CACHED,
+                                     [&](IModbusServerObserver* obs, const vector<TModbusReadSegment>& batch) {
+                                         TReplyState r = obs->OnGetValues(type, slave_id, batch);
+                                         if (r == REPLY_DEFERRED) {
+                                             _DeferringReads.push_back({obs, obs->GetDeferredId(true)});
+                                             _DeferredRead = {type, &range, slave_id, start, count};
+                                         }
+                                         if (r == REPLY_OK && is_bit)
+                                             _StoreBits(cache_ptr, start, batch);
+                                         return r;
+                                     });
+
+        if (reply > 0)
+            return reply;
+
+        // callbacks have refreshed cached values
+        if (_ShmExport)
+            _ShmExport->Update(type, slave_id, start, cache_ptr, count);
+    }
+
+    values = cache_ptr;
+
+    // bit is changed atomically and is never torn, so bits are always sent from cache
+    if (is_bit)
+        return reply;
+
+    // observers updating cache from MQTT thread copy their own values, so they are never torn;
+    // reply is copied only if area has such observers, otherwise it is sent from cache
+    auto guarded = _ReadCacheRanges.find(type);
+    if (guarded == _ReadCacheRanges.end())
+        return reply;
+
+    bool copied = false;
+
+    auto copy_segment = [&](int s_start, int s_count, const PModbusServerObserver& obs) {
+        if (!copied) {
+            memcpy(_ReadBuffer, cache_ptr, count * sizeof(uint16_t));
+            copied = true;
         }
 
-        int slave_offset = slave_id << 16;
+        const size_t offset = (s_start - slave_offset - start) * sizeof(uint16_t);
+        obs->OnReadCache(_ReadBuffer + offset,
+                         static_cast<const uint8_t*>(cache_ptr) + offset,
+                         s_count * sizeof(uint16_t));
+        return true;
+    };
 
-        auto segments = range.getSegments(start + slave_offset,
-                                          count); //->OnGetValue(type, mb->GetSlave(), start, count, cache_ptr);
-        TReplyState reply = REPLY_ILLEGAL_ADDRESS;
+    guarded->second.forEachIntersection(start + slave_offset, count, copy_segment);
 
-        for (auto& s: segments) {
-            const int count = s.getCount();
-            reply = s.getParam()->OnGetValue(type, slave_id, s.getStart() - slave_offset, count, cache_ptr);
+    if (copied)
+        values = _ReadBuffer;
 
-            if (item_size == sizeof(uint16_t)) {
-                cache_ptr = static_cast<uint16_t*>(cache_ptr) + count;
-            } else {
-                cache_ptr = static_cast<uint8_t*>(cache_ptr) + count;
+    return reply;
+}
+
+void TModbusServer::_StoreBits(void* cache_ptr, int start, const vector<TModbusReadSegment>& segments)
+{
+    // cache_ptr holds bit start % 8, segment data points into _ReadBuffer
+    uint8_t* cache = static_cast<uint8_t*>(cache_ptr);
+
+    for (const auto& segment: segments) {
+        ModbusEncoder::StoreBits(cache + (segment.start / 8 - start / 8),
+                                 segment.start % 8,
+                                 static_cast<const uint8_t*>(segment.data),
+                                 segment.count);
+    }
+}
+
+void TModbusServer::_ReplyRead(TStoreType type,
+                               const TModbusQuery& query,
+                               const void* values,
+                               int start,
+                               unsigned count)
+{
+    const uint8_t function = query.data[query.header_length];
+    size_t size;
+
+    if (type == COIL || type == DISCRETE_INPUT) {
+        const uint8_t* bits = static_cast<const uint8_t*>(values);
+        size = ModbusEncoder::EncodeReadBits(_ReplyPdu, function, bits, start % 8, count);
+    } else {
+        size = ModbusEncoder::EncodeReadRegisters(_ReplyPdu, function, static_cast<const uint16_t*>(values), count);
+    }
+
+    _Reply(query, _ReplyPdu, size);
+}
+
+void TModbusServer::_Reply(const TModbusQuery& query, const uint8_t* pdu, size_t size)
+{
+    if (_Deferring.empty() && _DeferringReads.empty()) {
+        mb->Reply(query, pdu, size);
+        return;
+    }
+
+    // PDU may point to query or reply buffer, both are reused by next queries
+    TDeferredReply deferred{query, {}, _Deferring, _DeferringReads, vector<uint8_t>(pdu, pdu + size), {}, REPLY_OK};
+    if (!_DeferringReads.empty())
+        deferred.Read = _DeferredRead;
+
+    // query slot is released as usual, so waiting reply doesn't hold receive ring
+    deferred.QueryData.assign(query.data, query.data + query.size);
+    deferred.Query.data = deferred.QueryData.data();
+    deferred.Query.slot = -1;
+
+    _DeferredReplies.push_back(std::move(deferred));
+    _Deferring.clear();
+    _DeferringReads.clear();
+}
+
+void TModbusServer::_PollDeferred()
+{
+    for (auto deferred = _DeferredReplies.begin(); deferred != _DeferredReplies.end();) {
+        auto poll = [&](vector<TDeferringObserver>& observers, bool read) {
+            for (auto obs = observers.begin(); obs != observers.end();) {
+                TReplyState reply = obs->Observer->OnPollDeferred(read, obs->Id);
+                if (reply == REPLY_DEFERRED) {
+                    ++obs;
+                    continue;
+                }
+
+                if (reply > 0 && deferred->Reply <= 0)
+                    deferred->Reply = reply;
+
+                obs = observers.erase(obs);
             }
+        };
 
-            if (reply > 0)
-                break;
+        poll(deferred->Writers, false);
+        poll(deferred->Readers, true);
+
+        if (!deferred->Writers.empty() || !deferred->Readers.empty()) {
+            ++deferred;
+            continue;
         }
 
-        if (reply <= 0)
-            mb->Reply(query);
-        else
-            mb->ReplyException(reply, query);
-    } catch (const WrongSegmentException& e) {
-        mb->ReplyException(TReplyState::REPLY_ILLEGAL_ADDRESS, query);
+        if (deferred->Reply > 0) {
+            mb->ReplyException(deferred->Reply, deferred->Query);
+        } else if (deferred->Read.Range) {
+            // values came while client was waiting, read them again
+            const TDeferredRead& read = deferred->Read;
+            const void* values = nullptr;
+
+            _Deferring.clear();
+            _DeferringReads.clear();
+            TReplyState reply = _ReadValues(read.Type, *read.Range, read.SlaveId, read.Start, read.Count, values);
+
+            if (reply > 0) {
+                mb->ReplyException(reply, deferred->Query);
+            } else if (!_DeferringReads.empty()) {
+                // observer has to wait again, its value went stale before reply
+                deferred->Readers.swap(_DeferringReads);
+                ++deferred;
+                continue;
+            } else {
+                _ReplyRead(read.Type, deferred->Query, values, read.Start, read.Count);
+            }
+        } else {
+            mb->Reply(deferred->Query, deferred->Pdu.data(), deferred->Pdu.size());
+        }
+
+        deferred = _DeferredReplies.erase(deferred);
     }
 }
 
@@ -283,47 +767,377 @@ void TModbusServer::_ProcessWriteQuery(TStoreType type,
                                        const TModbusQuery& query,
                                        const void* data_ptr)
 {
-    // reply then ask callback (modbus cache will contain required value)
-    PModbusServerObserver obs;
+    // ask callback, then store values in cache and reply
+    TReplyState reply = _WriteValues(type, range, slave_id, start, count, data_ptr);
 
-    try {
-        int item_size;
+    if (reply > 0) {
+        mb->ReplyException(reply, query);
+        return;
+    }
 
-        if (type == COIL || type == DISCRETE_INPUT) {
-            item_size = sizeof(uint8_t);
+    // reply on write is an echo of function code, address and value (or count)
+    _Reply(query, &query.data[query.header_length], 5);
+}
+
+TReplyState TModbusServer::_WriteValues(TStoreType type,
+                                        TModbusAddressRange& range,
+                                        uint8_t slave_id,
+                                        int start,
+                                        unsigned count,
+                                        const void* data_ptr)
+{
+    void* cache_ptr = mb->GetCache(type, slave_id, start);
+    if (!cache_ptr)
+        return REPLY_ILLEGAL_ADDRESS;
+
+    const bool is_bit = (type == COIL || type == DISCRETE_INPUT);
+    const int slave_offset = slave_id << 16;
+    const void* values = data_ptr;
+
+    _WriteSegments.clear();
+
+    auto collect_segment = [&](int s_start, int s_count, const PModbusServerObserver& obs) {
+        _WriteSegments.emplace_back(
+            obs.get(),
+            TModbusWriteSegment{static_cast<uint16_t>(s_start - slave_offset), unsigned(s_count), data_ptr});
+
+        if (is_bit) {
+            data_ptr = static_cast<const uint8_t*>(data_ptr) + s_count;
         } else {
-            item_size = sizeof(uint16_t);
+            data_ptr = static_cast<const uint16_t*>(data_ptr) + s_count;
         }
 
-        int slave_offset = slave_id << 16;
+        return true;
+    };
 
-        auto segments = range.getSegments(start + slave_offset, count);
+    if (!range.forEachSegment(start + slave_offset, count, collect_segment))
+        return REPLY_ILLEGAL_ADDRESS;
 
-        TReplyState reply = REPLY_ILLEGAL_ADDRESS;
+    TReplyState reply = CallObserversBatched(_WriteSegments,
+                                             _WriteBatch,
+                                             REPLY_OK,
+                                             [&](IModbusServerObserver* obs, const vector<TModbusWriteSegment>& batch) {
+                                                 TReplyState r = obs->OnSetValues(type, slave_id, batch);
+                                                 if (r == REPLY_DEFERRED)
+                                                     _Deferring.push_back({obs, obs->GetDeferredId(false)});
+                                                 return r;
+                                             });
 
-        for (auto& s: segments) {
-            const int count = s.getCount();
-            reply = s.getParam()->OnSetValue(type, slave_id, s.getStart() - slave_offset, count, data_ptr);
+    if (reply > 0)
+        return reply;
 
-            if (item_size == sizeof(uint16_t)) {
-                data_ptr = static_cast<const uint16_t*>(data_ptr) + count;
-            } else {
-                data_ptr = static_cast<const uint8_t*>(data_ptr) + count;
-            }
+    if (is_bit) {
+        const uint8_t* bits = static_cast<const uint8_t*>(values);
+        ModbusEncoder::StoreBits(static_cast<uint8_t*>(cache_ptr), start % 8, bits, count);
+    } else {
+        memcpy(cache_ptr, values, count * sizeof(uint16_t));
+    }
 
-            if (reply > 0)
-                break;
+    if (_ShmExport)
+        _ShmExport->Update(type, slave_id, start, cache_ptr, count);
+
+    return REPLY_OK;
+}
+
+void TModbusServer::_ProcessWriteReadQuery(uint8_t slave_id, const TModbusQuery& query)
+{
+    // function code, read address and count, write address and count, byte count
+    const uint8_t* pdu = &query.data[query.header_length];
+    const int pdu_size = query.size - query.header_length;
+
+    if (pdu_size < 10) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    const uint16_t read_start = _ReadU16(pdu + 1);
+    const uint16_t read_count = _ReadU16(pdu + 3);
+    const uint16_t write_start = _ReadU16(pdu + 5);
+    const uint16_t write_count = _ReadU16(pdu + 7);
+    const int byte_count = pdu[9];
+
+    if (read_count == 0 || read_count > MODBUS_MAX_WR_READ_REGISTERS || write_count == 0 ||
+        write_count > MODBUS_MAX_WR_WRITE_REGISTERS || byte_count != write_count * 2 || byte_count > pdu_size - 10)
+    {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    // query with invalid read area must not change anything
+    const bool read_valid =
+        mb->GetCache(HOLDING_REGISTER, slave_id, read_start) && _hr.covers(read_start + (slave_id << 16), read_count);
+    if (!read_valid) {
+        mb->ReplyException(REPLY_ILLEGAL_ADDRESS, query);
+        return;
+    }
+
+    uint16_t values[MODBUS_MAX_WR_WRITE_REGISTERS];
+    ModbusEncoder::UnpackRegisters(values, pdu + 10, write_count);
+
+    // write goes first, so read returns values which were just written
+    TReplyState reply = _WriteValues(HOLDING_REGISTER, _hr, slave_id, write_start, write_count, values);
+
+    const void* cache_ptr = nullptr;
+    if (reply <= 0)
+        reply = _ReadValues(HOLDING_REGISTER, _hr, slave_id, read_start, read_count, cache_ptr);
+
+    if (reply > 0)
+        mb->ReplyException(reply, query);
+    else
+        _ReplyRead(HOLDING_REGISTER, query, cache_ptr, read_start, read_count);
+}
+
+void TModbusServer::_ProcessMaskWriteQuery(uint8_t slave_id, const TModbusQuery& query)
+{
+    // function code, address, AND mask, OR mask
+    const uint8_t* pdu = &query.data[query.header_length];
+    const int pdu_size = query.size - query.header_length;
+
+    if (pdu_size < 7) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    const uint16_t address = _ReadU16(pdu + 1);
+    const uint16_t and_mask = _ReadU16(pdu + 3);
+    const uint16_t or_mask = _ReadU16(pdu + 5);
+
+    uint16_t* cache_ptr = static_cast<uint16_t*>(mb->GetCache(HOLDING_REGISTER, slave_id, address));
+    IModbusServerObserver* owner = _FindRegisterOwner(slave_id, address);
+
+    if (!cache_ptr || !owner) {
+        mb->ReplyException(REPLY_ILLEGAL_ADDRESS, query);
+        return;
+    }
+
+    // owner applies masks to cached value and publishes result only
+    TReplyState reply = owner->OnMaskWriteValue(HOLDING_REGISTER, slave_id, address, and_mask, or_mask, cache_ptr);
+    if (reply == REPLY_DEFERRED)
+        _Deferring.push_back({owner, owner->GetDeferredId(false)});
+
+    if (reply > 0) {
+        mb->ReplyException(reply, query);
+        return;
+    }
+
+    if (_ShmExport)
+        _ShmExport->Update(HOLDING_REGISTER, slave_id, address, cache_ptr, 1);
+
+    // reply is an echo of request
+    _Reply(query, pdu, 7);
+}
+
+void TModbusServer::_ProcessReadFifoQuery(uint8_t slave_id, const TModbusQuery& query)
+{
+    // function code, FIFO pointer address
+    const uint8_t* pdu = &query.data[query.header_length];
+    const int pdu_size = query.size - query.header_length;
+
+    if (pdu_size < 3) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    const uint16_t address = _ReadU16(pdu + 1);
+
+    IModbusServerObserver* owner = _FindRegisterOwner(slave_id, address);
+    if (!owner) {
+        mb->ReplyException(REPLY_ILLEGAL_ADDRESS, query);
+        return;
+    }
+
+    uint16_t values[ModbusEncoder::MAX_FIFO_COUNT];
+    unsigned count = 0;
+
+    TReplyState reply =
+        owner->OnReadFifo(HOLDING_REGISTER, slave_id, address, values, ModbusEncoder::MAX_FIFO_COUNT, count);
+
+    if (reply > 0) {
+        mb->ReplyException(reply, query);
+        return;
+    }
+
+    mb->Reply(query, _ReplyPdu, ModbusEncoder::EncodeReadFifo(_ReplyPdu, values, count));
+}
+
+IModbusServerObserver* TModbusServer::_FindRegisterOwner(uint8_t slave_id, uint16_t address)
+{
+    IModbusServerObserver* owner = nullptr;
+
+    _hr.forEachSegment(address + (slave_id << 16), 1, [&](int, int, const PModbusServerObserver& obs) {
+        owner = obs.get();
+        return true;
+    });
+
+    return owner;
+}
+
+void TModbusServer::_ProcessReadFileQuery(uint8_t slave_id, const TModbusQuery& query)
+{
+    // function code, byte count, sub-requests of reference type, file, record and record length
+    const uint8_t* pdu = &query.data[query.header_length];
+    const int pdu_size = query.size - query.header_length;
+    const int sub_request_size = 7;
+
+    if (pdu_size < 2 || pdu[1] < sub_request_size || pdu[1] > 0xF5 || pdu[1] % sub_request_size != 0 ||
+        pdu[1] > pdu_size - 2)
+    {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    uint16_t records[ModbusEncoder::MAX_PDU_LENGTH / 2];
+    size_t reply_size = 2;
+
+    for (const uint8_t* sub = pdu + 2; sub < pdu + 2 + pdu[1]; sub += sub_request_size) {
+        const uint16_t file = _ReadU16(sub + 1);
+        const uint16_t record = _ReadU16(sub + 3);
+        const uint16_t count = _ReadU16(sub + 5);
+
+        // sub-reply is length, reference type and records
+        if (reply_size + 2 + count * 2 > ModbusEncoder::MAX_PDU_LENGTH) {
+            mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+            return;
         }
 
-        if (reply <= 0) {
-            mb->Reply(query);
-        } else {
+        IModbusServerObserver* owner = _FindFileOwner(slave_id, file);
+        if (sub[0] != 6 || record > 9999 || !owner) {
+            mb->ReplyException(REPLY_ILLEGAL_ADDRESS, query);
+            return;
+        }
+
+        TReplyState reply = owner->OnReadFileRecord(slave_id, file, record, count, records);
+        if (reply > 0) {
+            mb->ReplyException(reply, query);
+            return;
+        }
+
+        _ReplyPdu[reply_size] = 1 + count * 2;
+        _ReplyPdu[reply_size + 1] = 6;
+        ModbusEncoder::PackRegisters(&_ReplyPdu[reply_size + 2], records, count);
+        reply_size += 2 + count * 2;
+    }
+
+    _ReplyPdu[0] = READ_FILE_RECORD;
+    _ReplyPdu[1] = reply_size - 2;
+
+    mb->Reply(query, _ReplyPdu, reply_size);
+}
+
+void TModbusServer::_ProcessWriteFileQuery(uint8_t slave_id, const TModbusQuery& query)
+{
+    // function code, byte count, sub-requests of reference type, file, record, record length and records
+    const uint8_t* pdu = &query.data[query.header_length];
+    const int pdu_size = query.size - query.header_length;
+    const int sub_header_size = 7;
+
+    if (pdu_size < 2 || pdu[1] < sub_header_size + 2 || pdu[1] > 0xFB || pdu[1] > pdu_size - 2) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    uint16_t records[ModbusEncoder::MAX_PDU_LENGTH / 2];
+    const uint8_t* end = pdu + 2 + pdu[1];
+
+    for (const uint8_t* sub = pdu + 2; sub < end;) {
+        if (end - sub < sub_header_size) {
+            mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+            return;
+        }
+
+        const uint16_t file = _ReadU16(sub + 1);
+        const uint16_t record = _ReadU16(sub + 3);
+        const uint16_t count = _ReadU16(sub + 5);
+
+        if (end - sub - sub_header_size < count * 2) {
+            mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+            return;
+        }
+
+        IModbusServerObserver* owner = _FindFileOwner(slave_id, file);
+        if (sub[0] != 6 || record > 9999 || !owner) {
+            mb->ReplyException(REPLY_ILLEGAL_ADDRESS, query);
+            return;
+        }
+
+        ModbusEncoder::UnpackRegisters(records, sub + sub_header_size, count);
+
+        TReplyState reply = owner->OnWriteFileRecord(slave_id, file, record, count, records);
+        if (reply > 0) {
             mb->ReplyException(reply, query);
-            throw 10; // just to exit from try {} block
+            return;
         }
-    } catch (const WrongSegmentException& e) {
-        mb->ReplyException(TReplyState::REPLY_ILLEGAL_ADDRESS, query);
-    } catch (const int&) {
-        // dummy, just to get away
+
+        sub += sub_header_size + count * 2;
+    }
+
+    // reply is an echo of request
+    mb->Reply(query, pdu, 2 + pdu[1]);
+}
+
+IModbusServerObserver* TModbusServer::_FindFileOwner(uint8_t slave_id, uint16_t file)
+{
+    auto obs = _FileObservers.find((slave_id << 16) + file);
+    return obs == _FileObservers.end() ? nullptr : obs->second.get();
+}
+
+void TModbusServer::_ProcessDiagnosticsQuery(const TModbusQuery& query)
+{
+    // function code, sub-function, data
+    const uint8_t* pdu = &query.data[query.header_length];
+    const int pdu_size = query.size - query.header_length;
+
+    if (pdu_size < 5) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    const uint16_t sub_function = _ReadU16(pdu + 1);
+    const uint16_t data = _ReadU16(pdu + 3);
+
+    // RTU frame size includes CRC, so only function, sub-function and data word are echoed
+    if (sub_function == 0x00) { // return query data
+        mb->Reply(query, pdu, 5);
+        return;
+    }
+
+    const TModbusBusCounters& bus = mb->GetBusCounters();
+    uint16_t counter;
+
+    switch (sub_function) {
+        case 0x0A: // clear counters and diagnostic register
+            counter = data;
+            break;
+        case 0x0B: // return bus message count
+            counter = bus.Messages;
+            break;
+        case 0x0C: // return bus communication error count
+            counter = bus.Errors;
+            break;
+        case 0x0D: // return bus exception error count
+            counter = bus.Exceptions;
+            break;
+        case 0x0E: // return server message count
+            counter = _ServerMessageCount;
+            break;
+        case 0x0F: // return server no response count
+            counter = bus.NoResponses;
+            break;
+        default:
+            mb->ReplyException(REPLY_ILLEGAL_FUNCTION, query);
+            return;
     }
+
+    if (data != 0) {
+        mb->ReplyException(REPLY_ILLEGAL_VALUE, query);
+        return;
+    }
+
+    if (sub_function == 0x0A) {
+        mb->ClearBusCounters();
+        _ServerMessageCount = 0;
+    }
+
+    uint8_t reply[5] = {DIAGNOSTICS, pdu[1], pdu[2], uint8_t(counter >> 8), uint8_t(counter & 0xFF)};
+    mb->Reply(query, reply, sizeof(reply));
 }
@@ -8,9 +8,13 @@
 #include <cstdint>
 #include <cstring>
 #include <list>
+#include <map>
 #include <memory>
+#include <vector>
 
 #include "address_range.h"
+#include "modbus_cache.h"
+#include "modbus_encoder.h"
 
 /*! Modbus store types */
 enum TStoreType
@@ -38,17 +42,43 @@ inline const std::string StoreTypeToString(TStoreType t)
 
 enum TReplyState
 {
-    REPLY_CACHED = -1, /*!< Don't use observer, use cached value instead */
+    REPLY_DEFERRED = -2, /*!< Reply later, server polls observer with OnPollDeferred() */
+    REPLY_CACHED = -1,   /*!< Don't use observer, use cached value instead */
     REPLY_OK = 0,      /*!< Reply is correct */
 
     REPLY_ILLEGAL_FUNCTION = 0x01,
     REPLY_ILLEGAL_ADDRESS = 0x02, /*!< Wrong address for this datablock */
     REPLY_ILLEGAL_VALUE = 0x03,   /*!< Wrong value given for this datablock */
     REPLY_SERVER_FAILURE = 0x04,  /*!< Server failure */
+    REPLY_SERVER_BUSY = 0x06,     /*!< Server is busy, client should retry later */
+
+    REPLY_GATEWAY_PATH_UNAVAILABLE = 0x0A, /*!< Gateway has no path to unit */
+    REPLY_GATEWAY_TARGET_FAILED = 0x0B,    /*!< Gateway target unit didn't respond */
 };
 
 typedef TAddressRange<void*> TModbusCacheAddressRange;
 
+/*! Part of Modbus request handled by single observer */
+template<typename TData> struct TModbusRequestSegment
+{
+    uint16_t start; /*!< First element address */
+    unsigned count; /*!< Number of elements */
+    TData* data;    /*!< Pointer to cache or to query data, one byte per coil or discrete input */
+};
+
+typedef TModbusRequestSegment<void> TModbusReadSegment;
+typedef TModbusRequestSegment<const void> TModbusWriteSegment;
+
+/*! Cached items of one observed segment */
+struct TModbusCacheSegment
+{
+    uint8_t UnitId;
+    TStoreType Type;
+    int Start;   /*!< First item address */
+    int Count;   /*!< Number of items */
+    void* Cache; /*!< Cache of first item, for bits it is byte holding Start as bit Start % 8 */
+};
+
 /*!
  * \brief Modbus server observer interface
  * Modbus server observer is able to reply on Modbus' READ_*, WRITE_* for coils and registers.
@@ -83,13 +113,134 @@ public:
      */
     virtual TReplyState OnSetValue(TStoreType type, uint8_t unit_id, uint16_t start, unsigned count, const void* data);
 
+    /*! Batched callback for READ_* functions
+     * Called once per request with all segments of request handled by this observer.
+     * Default implementation calls OnGetValue() for each segment.
+     * \param type      Type of store
+     * \param unit_id   Modbus TCP unit ID (or ID of serial device in case of RTU)
+     * \param segments  Segments of request in address order
+     * \return Reply state
+     */
+    virtual TReplyState OnGetValues(TStoreType type,
+                                    uint8_t unit_id,
+                                    const std::vector<TModbusReadSegment>& segments);
+
+    /*! Batched callback for WRITE_* functions
+     * Called once per request with all segments of request handled by this observer.
+     * Default implementation calls OnSetValue() for each segment.
+     * \param type      Type of store
+     * \param unit_id   Modbus TCP unit ID (or ID of serial device in case of RTU)
+     * \param segments  Segments of request in address order
+     * \return Reply state
+     */
+    virtual TReplyState OnSetValues(TStoreType type,
+                                    uint8_t unit_id,
+                                    const std::vector<TModbusWriteSegment>& segments);
+
+    /*! Callback for MASK_WRITE_REGISTER function
+     * Called with pointer to cached register, must apply masks atomically against other cache writers.
+     * Default implementation calculates result, passes it to OnSetValue() and stores it on success.
+     * \param type      Type of store
+     * \param unit_id   Modbus TCP unit ID (or ID of serial device in case of RTU)
+     * \param address   Register address
+     * \param and_mask  AND mask from request
+     * \param or_mask   OR mask from request
+     * \param value     Pointer to cached register value
+     * \return Reply state
+     */
+    virtual TReplyState OnMaskWriteValue(TStoreType type,
+                                         uint8_t unit_id,
+                                         uint16_t address,
+                                         uint16_t and_mask,
+                                         uint16_t or_mask,
+                                         uint16_t* value);
+
+    /*! Callback for READ_FIFO_QUEUE function
+     * Called to drain values queued by observer for register
+     * \param type      Type of store
+     * \param unit_id   Modbus TCP unit ID (or ID of serial device in case of RTU)
+     * \param address   FIFO pointer address
+     * \param values    Output buffer for queued registers
+     * \param max_count Size of output buffer in registers
+     * \param count     Number of registers written to output buffer
+     * \return Reply state, REPLY_ILLEGAL_ADDRESS by default (no FIFO)
+     */
+    virtual TReplyState OnReadFifo(TStoreType type,
+                                   uint8_t unit_id,
+                                   uint16_t address,
+                                   uint16_t* values,
+                                   unsigned max_count,
+                                   unsigned& count);
+
+    /*! Callback for READ_FILE_RECORD function
+     * \param unit_id   Modbus TCP unit ID (or ID of serial device in case of RTU)
+     * \param file      File number
+     * \param record    First record number
+     * \param count     Number of records (registers)
+     * \param data      Output buffer for records
+     * \return Reply state, REPLY_ILLEGAL_ADDRESS by default
+     */
+    virtual TReplyState OnReadFileRecord(uint8_t unit_id,
+                                         uint16_t file,
+                                         uint16_t record,
+                                         unsigned count,
+                                         uint16_t* data);
+
+    /*! Callback for WRITE_FILE_RECORD function
+     * \param unit_id   Modbus TCP unit ID (or ID of serial device in case of RTU)
+     * \param file      File number
+     * \param record    First record number
+     * \param count     Number of records (registers)
+     * \param data      Records from request
+     * \return Reply state, REPLY_ILLEGAL_ADDRESS by default
+     */
+    virtual TReplyState OnWriteFileRecord(uint8_t unit_id,
+                                          uint16_t file,
+                                          uint16_t record,
+                                          unsigned count,
+                                          const uint16_t* data);
+
+    /*! Copy cached values of observer to reply
+     * Called on read requests for observers which guard their cache (see GuardsCache()),
+     * so they copy whole values. Default implementation is plain copy.
+     * \param dst       Destination buffer
+     * \param cache     Cached values
+     * \param size      Size of values in bytes
+     */
+    virtual void OnReadCache(void* dst, const void* cache, size_t size);
+
+    /*! Check if observer changes cache from other threads and copies its values with OnReadCache()
+     * Values of other observers are replied directly from cache. Checked once on Observe().
+     * \return false by default
+     */
+    virtual bool GuardsCache() const;
+
     /*! Cache allocation callback
-     * Modbus server tells about allocated cache memory
+     * Modbus server tells about allocated cache memory. Coils and discrete inputs are
+     * packed eight per byte, pointer refers to byte holding the first item as bit (address % 8).
      * \param type      Type of store
      * \param cache     Cache address range with area begin pointers
      * \param unit_id   Unit (slave) ID
      */
     virtual void OnCacheAllocate(TStoreType type, uint8_t unit_id, const TModbusCacheAddressRange& cache);
+
+    /*! Get ID of the latest read or write answered with REPLY_DEFERRED
+     * Called by server thread right after request was deferred, ID is passed back to
+     * OnPollDeferred(), so observer tells apart requests waiting at the same time.
+     * Default implementation returns 0.
+     * \param read Deferred request is read, otherwise write
+     */
+    virtual uint64_t GetDeferredId(bool read);
+
+    /*! Poll read or write answered with REPLY_DEFERRED
+     * Called by server thread until it returns state other than REPLY_DEFERRED,
+     * then client gets reply. Read is repeated then to get reply values.
+     * Default implementation returns REPLY_OK.
+     * \param read Deferred request is read, otherwise write
+     * \param id ID of request returned by GetDeferredId()
+     * \return REPLY_OK to reply, exception to reply with or REPLY_DEFERRED to keep waiting
+     */
+    virtual TReplyState OnPollDeferred(bool read, uint64_t id);
 };
 
 /*! Shared pointer to IModbusServerObserver */
@@ -99,7 +250,10 @@ typedef std::shared_ptr<IModbusServerObserver> PModbusServerObserver;
 typedef TAddressRange<PModbusServerObserver> TModbusAddressRange;
 typedef std::shared_ptr<TModbusAddressRange> PModbusAddressRange;
 
-/*! Modbus query structure */
+/*! Modbus query structure
+ * Lightweight view of query data, the data itself stays in backend's receive buffer
+ * until query is released with IModbusBackend::ReleaseQuery()
+ */
 struct TModbusQuery
 {
     static TModbusQuery emptyQuery()
@@ -115,43 +269,30 @@ struct TModbusQuery
         return TModbusQuery::emptyQuery();
     }
 
-    uint8_t* data;     /*!< Query raw data */
-    int size;          /*!< Query size */
-    int header_length; /*!< Query header length - from Modbus context */
-    int socket_fd;     /*!< Reply socket descriptor (for TCP) */
+    const uint8_t* data; /*!< Query raw data */
+    int size;            /*!< Query size */
+    int header_length;   /*!< Query header length - from Modbus context */
+    int socket_fd;       /*!< Reply socket descriptor (for TCP) */
+    int slot;            /*!< Backend buffer slot holding query data, -1 if query doesn't own a slot */
 
-    TModbusQuery(uint8_t* _data, int _size, int _header_length, int _fd = -1)
-        : data(nullptr),
+    TModbusQuery(const uint8_t* _data, int _size, int _header_length, int _fd = -1, int _slot = -1)
+        : data(_data),
           size(_size),
           header_length(_header_length),
-          socket_fd(_fd)
-    {
-        if (_data != nullptr && size > 0) {
-            data = new uint8_t[size];
-            std::memcpy(data, _data, size);
-        }
-    }
-
-    TModbusQuery(const TModbusQuery& q)
-        : data(nullptr),
-          size(q.size),
-          header_length(q.header_length),
-          socket_fd(q.socket_fd)
-    {
-        if (data)
-            delete[] data;
-
-        if (size > 0) {
-            data = new uint8_t[size];
-            std::memcpy(data, q.data, size);
-        }
-    }
+          socket_fd(_fd),
+          slot(_slot)
+    {}
+};
 
-    ~TModbusQuery()
-    {
-        if (size > 0)
-            delete[] data;
-    }
+/*! Bus diagnostic counters kept by backend
+ * Counters are 16-bit and wrap around, as in Modbus diagnostics replies
+ */
+struct TModbusBusCounters
+{
+    uint16_t Messages = 0;    /*!< Frames detected on bus, including damaged ones */
+    uint16_t Errors = 0;      /*!< Frames with CRC or framing errors */
+    uint16_t Exceptions = 0;  /*!< Exception replies sent */
+    uint16_t NoResponses = 0; /*!< Queries left without reply (broadcasts, send failures) */
 };
 
 /*! Modbus exception */
@@ -189,20 +330,25 @@ public:
     /*! Start listening port/socket */
     virtual void Listen() = 0;
 
-    /*! Allocate cache areas for this instance
+    /*! Allocate cache for observed addresses of one store
+     * Existing cache may only grow, values are kept. Previous cache memory must stay valid
+     * until next AllocateCache() call, so observers can move their values to new cache.
      * \param unit_id   Unit ID to allocate cache for
-     * \param di Number of discrete inputs
-     * \param co Number of coils
-     * \param ir Number of input registers (2 bytes per register, so ir * 2 bytes will be allocated)
-     * \param hr Number of holding registers
+     * \param type      Store type
+     * \param addresses Observed addresses
      */
-    virtual void AllocateCache(uint8_t unit_id, size_t di, size_t co, size_t ir, size_t hr) = 0;
+    virtual void AllocateCache(uint8_t unit_id, TStoreType type, const TModbusAddressSet& addresses) = 0;
 
-    /*! Get cache base address
+    /*! Get cache address of item
+     * Called on every request, so it must not throw. Items observed as single segment
+     * are contiguous in cache. Coils and discrete inputs are packed eight per byte (LSB first),
+     * item is bit (address % 8) of returned byte.
      * \param type Store type we want to get cache for
-     * \return Pointer to cache base address
+     * \param slave_id Unit ID
+     * \param address Item address
+     * \return Pointer to cached item or nullptr if address has no cache
      */
-    virtual void* GetCache(TStoreType type, uint8_t slave_id = 0) = 0;
+    virtual void* GetCache(TStoreType type, uint8_t slave_id = 0, int address = 0) = 0;
 
     /*! Poll new queries and fill queue
      * \param timeout Poll timeout (in ms)
@@ -216,21 +362,36 @@ public:
     virtual bool Available() = 0;
 
     /*! Receive query from queue (or wait for new query)
+     * Query data stays valid until query is released with ReleaseQuery()
      * \param block Blocking call (wait for new query on empty queue)
      * \return New query, or .size == 0 on empty queue
      */
     virtual TModbusQuery ReceiveQuery(bool block = false) = 0;
 
+    /*! Release query buffer after reply
+     * \param query Query received with ReceiveQuery()
+     */
+    virtual void ReleaseQuery(const TModbusQuery& query) = 0;
+
     /*! Send reply
+     * Backend only adds transport header (MBAP for TCP, address and CRC for RTU)
      * \param query Query to reply on
+     * \param pdu Reply PDU (function code and data)
+     * \param size Reply PDU size
      */
-    virtual void Reply(const TModbusQuery& query) = 0;
+    virtual void Reply(const TModbusQuery& query, const uint8_t* pdu, size_t size) = 0;
 
     /*! Send exception reply
      * \param exception Exception code
      */
     virtual void ReplyException(TReplyState state, const TModbusQuery& query) = 0;
 
+    /*! Get bus diagnostic counters */
+    virtual const TModbusBusCounters& GetBusCounters() = 0;
+
+    /*! Reset bus diagnostic counters */
+    virtual void ClearBusCounters() = 0;
+
     /*! Get last error code */
     virtual int GetError() = 0;
 
@@ -240,6 +401,12 @@ public:
     /*! Close connection */
     virtual void Close() = 0;
 
+    /*! Interrupt WaitForMessages() from other thread, so server handles MQTT updates at once
+     * Backend which can't be interrupted leaves updates for the end of poll timeout
+     */
+    virtual void Wakeup()
+    {}
+
     /*! Virtual destructor */
     virtual ~IModbusBackend();
 };
@@ -247,10 +414,16 @@ public:
 /*! Shared pointer to IModbusBackend */
 typedef std::shared_ptr<IModbusBackend> PModbusBackend;
 
+class TModbusShmExport;
+class TModbusCacheSnapshot;
+class TRegisterGroup;
+class TUpdateQueue;
+class TStatsPublisher;
+
 /*! Modbus server wrapper base class */
 class TModbusServer
 {
-    enum Command
+    enum Command: uint8_t
     {
         READ_COIL_STATUS = 0x01,
         READ_DISCRETE_INPUTS = 0x02,
@@ -260,8 +433,16 @@ class TModbusServer
         FORCE_SINGLE_COIL = 0x05,
         PRESET_SINGLE_REGISTER = 0x06,
 
+        DIAGNOSTICS = 0x08,
+
         FORCE_MULTIPLE_COILS = 0x0F,
-        PRESET_MULTIPLE_REGISTERS = 0x10
+        PRESET_MULTIPLE_REGISTERS = 0x10,
+
+        READ_FILE_RECORD = 0x14,
+        WRITE_FILE_RECORD = 0x15,
+        MASK_WRITE_REGISTER = 0x16,
+        WRITE_READ_REGISTERS = 0x17,
+        READ_FIFO_QUEUE = 0x18
     };
 
     inline bool _IsReadCmd(Command cmd)
@@ -324,12 +505,28 @@ public:
      * \param slave Slave ID
      * \param store Store type (member of TStoreType)
      * \param range Address range to handle
+     * \param cache_backed Observer keeps its values in server cache,
+     *                     so OnGetValue() is never called for it
      */
     virtual void Observe(PModbusServerObserver o,
                          TStoreType store,
                          const TModbusAddressRange& range,
-                         uint8_t slave_id = 0);
-    /* virtual void Unobserve(PModbusServerObserver o) = 0; */
+                         uint8_t slave_id = 0,
+                         bool cache_backed = false);
+
+    /*! Remove observer from all stores, slave IDs and files
+     * Cache is not shrunk, so values of other observers stay in place
+     * \param o Pointer to observer object
+     */
+    virtual void Unobserve(PModbusServerObserver o);
+
+    /*! Register observer for file accessed by READ_FILE_RECORD / WRITE_FILE_RECORD
+     * Files don't use register address space
+     * \param o Pointer to observer object
+     * \param file File number
+     * \param slave_id Slave ID
+     */
+    virtual void ObserveFile(PModbusServerObserver o, uint16_t file, uint8_t slave_id = 0);
 
     /*! Check if slave ID is observed
      * \param slave Slave ID
@@ -337,6 +534,39 @@ public:
      */
     virtual bool IsObserved(uint8_t slave_id) const;
 
+    /*! Set reply on queries to unobserved slave IDs
+     * \param reply Exception to reply with, REPLY_OK to ignore such queries (default)
+     */
+    void SetUnknownUnitReply(TReplyState reply);
+
+    /*! Mirror cache to shared memory, export layout is rebuilt on AllocateCache()
+     * \param shm_export Export, nullptr to disable
+     */
+    void SetShmExport(std::shared_ptr<TModbusShmExport> shm_export);
+
+    /*! Checkpoint cache to file periodically, cache is restored from it on first AllocateCache()
+     * \param snapshot Snapshot, nullptr to disable
+     */
+    void SetCacheSnapshot(std::shared_ptr<TModbusCacheSnapshot> snapshot);
+
+    /*! Checkpoint cache now and wait for it to be written, called on shutdown */
+    void SaveCacheSnapshot();
+
+    /*! Set register groups committed by server thread between queries
+     * \param groups Groups, replace previous ones
+     */
+    void SetRegisterGroups(const std::vector<std::shared_ptr<TRegisterGroup>>& groups);
+
+    /*! Set queue of MQTT updates drained by server thread between queries
+     * \param queue Update queue, nullptr if observers write to cache themselves
+     */
+    void SetUpdateQueue(std::shared_ptr<TUpdateQueue> queue);
+
+    /*! Publish gateway counters periodically from server thread
+     * \param stats Statistics publisher, nullptr to disable
+     */
+    void SetStatsPublisher(std::shared_ptr<TStatsPublisher> stats);
+
 private:
     void _ProcessQuery(const TModbusQuery& query);
     void _ProcessReadQuery(TStoreType type,
@@ -352,10 +582,151 @@ private:
                             unsigned count,
                             const TModbusQuery& query,
                             const void* data);
+    void _ProcessWriteReadQuery(uint8_t slave_id, const TModbusQuery& query);
+    void _ProcessMaskWriteQuery(uint8_t slave_id, const TModbusQuery& query);
+    void _ProcessReadFifoQuery(uint8_t slave_id, const TModbusQuery& query);
+    void _ProcessDiagnosticsQuery(const TModbusQuery& query);
+    void _ProcessReadFileQuery(uint8_t slave_id, const TModbusQuery& query);
+    void _ProcessWriteFileQuery(uint8_t slave_id, const TModbusQuery& query);
+
+    /*! Find observer of file
+     * \return Observer or nullptr if file is not observed
+     */
+    IModbusServerObserver* _FindFileOwner(uint8_t slave_id, uint16_t file);
+
+    /*! Find observer owning holding register
+     * \return Observer or nullptr if register is not observed
+     */
+    IModbusServerObserver* _FindRegisterOwner(uint8_t slave_id, uint16_t address);
+
+    /*! Check read area and run read callbacks
+     * \param values Pointer to cached values of area
+     * \return Reply state
+     */
+    TReplyState _ReadValues(TStoreType type,
+                            TModbusAddressRange& range,
+                            uint8_t slave_id,
+                            int start,
+                            unsigned count,
+                            const void*& values);
+
+    /*! Check write area, run write callbacks and store values in cache
+     * \return Reply state
+     */
+    TReplyState _WriteValues(TStoreType type,
+                             TModbusAddressRange& range,
+                             uint8_t slave_id,
+                             int start,
+                             unsigned count,
+                             const void* data);
+
+    /*! Pack bits returned by read callbacks to cache
+     * \param cache_ptr Cache of first item of read area
+     * \param start First item address of read area
+     * \param segments Segments of observer with values in _ReadBuffer
+     */
+    void _StoreBits(void* cache_ptr, int start, const std::vector<TModbusReadSegment>& segments);
+
+    /*! Reply on read with values returned by _ReadValues(), bits are taken from packed cache starting at start % 8 */
+    void _ReplyRead(TStoreType type, const TModbusQuery& query, const void* values, int start, unsigned count);
+
+    /*! Reply on query, or keep reply until observers which deferred write are done */
+    void _Reply(const TModbusQuery& query, const uint8_t* pdu, size_t size);
+
+    /*! Send deferred replies whose observers are done */
+    void _PollDeferred();
+
+    /*! Recalculate cache sizes and observed slave IDs from address ranges */
+    void _UpdateSlaveAddresses();
+
+    /*! Get cache segments of all observed items */
+    std::vector<TModbusCacheSegment> _GetCacheSegments();
+
+    /*! Apply values queued by MQTT thread and commit register groups which are due */
+    void _ApplyUpdates();
 
     std::map<Command, TModbusAddressRange*> _CmdRangeMap;
     std::map<Command, TStoreType> _CmdStoreTypeMap;
 
+    /*! Reply on queries to unobserved slave IDs, ignored if not an exception */
+    TReplyState _UnknownUnitReply = REPLY_OK;
+
+    /*! Shared memory mirror of cache, may be null */
+    std::shared_ptr<TModbusShmExport> _ShmExport;
+
+    /*! Cache checkpoint file, may be null */
+    std::shared_ptr<TModbusCacheSnapshot> _CacheSnapshot;
+
+    /*! Register groups staging MQTT updates */
+    std::vector<std::shared_ptr<TRegisterGroup>> _RegisterGroups;
+
+    /*! Queue of MQTT updates, may be null */
+    std::shared_ptr<TUpdateQueue> _UpdateQueue;
+
+    /*! Gateway counters publisher, may be null */
+    std::shared_ptr<TStatsPublisher> _StatsPublisher;
+
+    /*! Observer which deferred request and ID it gave to request */
+    struct TDeferringObserver
+    {
+        IModbusServerObserver* Observer;
+        uint64_t Id;
+    };
+
+    /*! Read area repeated when deferred read is done */
+    struct TDeferredRead
+    {
+        TStoreType Type;
+        TModbusAddressRange* Range; /*!< Store range, null if reply isn't on read */
+        uint8_t SlaveId;
+        int Start;
+        unsigned Count;
+    };
+
+    /*! Reply held until its observers are done */
+    struct TDeferredReply
+    {
+        TModbusQuery Query;                          /*!< View of QueryData */
+        std::vector<uint8_t> QueryData;              /*!< Query copy, backend slot is released after processing */
+        std::vector<TDeferringObserver> Writers;     /*!< Observers which still defer write */
+        std::vector<TDeferringObserver> Readers;     /*!< Observers which still defer read */
+        std::vector<uint8_t> Pdu;                    /*!< Reply on write, reply on read is encoded when it is done */
+        TDeferredRead Read;
+        TReplyState Reply; /*!< Exception to reply with instead of PDU, REPLY_OK if none */
+    };
+
+    std::list<TDeferredReply> _DeferredReplies;
+
+    /*! Observers which deferred write or read of current query */
+    std::vector<TDeferringObserver> _Deferring, _DeferringReads;
+
+    /*! Read area of current query, valid if read is deferred */
+    TDeferredRead _DeferredRead = {};
+
+    /*! Number of queries processed by server, for diagnostics */
+    uint16_t _ServerMessageCount = 0;
+
+    /*! File observers by slave ID (high 16 bits) and file number */
+    std::map<int, PModbusServerObserver> _FileObservers;
+
+    /*! Ranges of observers which require OnGetValue() calls */
+    std::map<TStoreType, TModbusAddressRange> _ReadCallbackRanges;
+
+    /*! Ranges of observers which copy their cached values with OnReadCache() */
+    std::map<TStoreType, TModbusAddressRange> _ReadCacheRanges;
+
+    /*! Per-request scratch buffers, kept between requests to avoid allocations */
+    std::vector<std::pair<IModbusServerObserver*, TModbusReadSegment>> _ReadSegments;
+    std::vector<std::pair<IModbusServerObserver*, TModbusWriteSegment>> _WriteSegments;
+    std::vector<TModbusReadSegment> _ReadBatch;
+    std::vector<TModbusWriteSegment> _WriteBatch;
+
+    /*! Values of read request copied from cache, one byte per bit or two bytes per register */
+    alignas(uint16_t) uint8_t _ReadBuffer[ModbusEncoder::MAX_PDU_LENGTH * 8];
+
+    /*! Reply PDU buffer */
+    uint8_t _ReplyPdu[ModbusEncoder::MAX_PDU_LENGTH];
+
     struct TRSet
     {
         int di = 0;
@@ -0,0 +1,233 @@
+#include "mqtt_dispatcher.h"
+
+#include "log.h"
+
+#include <optional>
+
+#define LOG(logger) ::logger.Log() << "[mqtt] "
+
+using namespace std;
+using namespace WBMQTT;
+
+namespace
+{
+    const string DEVICES_PREFIX = "/devices/";
+    const string CONTROLS = "/controls/";
+}
+
+TMqttTopicDispatcher::TMqttTopicDispatcher(PMqttClient client)
+    : Client(client),
+      Started(false),
+      SyncStart(chrono::steady_clock::now()),
+      ReadyTime(0),
+      Ready(false),
+      SyncCount(0)
+{}
+
+string TMqttTopicDispatcher::Filter(const string& topic)
+{
+    // /devices/<device>/controls/<control>, control may not contain '/'
+    if (topic.compare(0, DEVICES_PREFIX.size(), DEVICES_PREFIX) != 0)
+        return topic;
+
+    const size_t controls = topic.find('/', DEVICES_PREFIX.size());
+    if (controls == string::npos || controls == DEVICES_PREFIX.size() ||
+        topic.compare(controls, CONTROLS.size(), CONTROLS) != 0)
+        return topic;
+
+    const size_t control = controls + CONTROLS.size();
+    if (control == topic.size() || topic.find_first_of("/+#", control) != string::npos)
+        return topic;
+
+    return topic.substr(0, control) + "+";
+}
+
+void TMqttTopicDispatcher::Start()
+{
+    {
+        unique_lock<shared_mutex> lock(Mutex);
+        Started = true;
+    }
+
+    {
+        lock_guard<mutex> lock(SyncMutex);
+        SyncStart = chrono::steady_clock::now();
+        SyncCount = 1;
+    }
+
+    Client->Start();
+}
+
+void TMqttTopicDispatcher::Stop()
+{
+    Client->Stop();
+}
+
+void TMqttTopicDispatcher::Publish(const TMqttMessage& message)
+{
+    Client->Publish(message);
+}
+
+TFuture<void> TMqttTopicDispatcher::PublishSynced(const TMqttMessage& message)
+{
+    return Client->PublishSynced(message);
+}
+
+void TMqttTopicDispatcher::Subscribe(TMqttMessageHandler callback, const string& topic)
+{
+    const string filter = Filter(topic);
+    bool subscribe = false;
+    bool replay = false;
+
+    {
+        unique_lock<shared_mutex> lock(Mutex);
+
+        auto& handlers = Handlers[topic];
+        if (handlers.empty())
+            subscribe = (Subscriptions[filter]++ == 0);
+
+        handlers.push_back(callback);
+
+        // broker has already sent retained value of topic with subscription of its device
+        replay = !subscribe && Started;
+    }
+
+    // client isn't called under lock, it may hold its own one while dispatching messages
+    if (subscribe)
+        Client->Subscribe([this](const TMqttMessage& msg) { this->Dispatch(msg); }, filter);
+
+    if (!replay)
+        return;
+
+    // resubscription would make broker resend retained values of the whole device
+    optional<TMqttMessage> message;
+    {
+        lock_guard<mutex> lock(LastMutex);
+        auto last = LastMessages.find(topic);
+        if (last != LastMessages.end())
+            message = last->second;
+    }
+
+    if (!message)
+        return;
+
+    shared_lock<shared_mutex> lock(Mutex);
+    callback(*message);
+    TrackSync(topic, true);
+}
+
+void TMqttTopicDispatcher::Subscribe(TMqttMessageHandler callback, const vector<string>& topics)
+{
+    for (const auto& topic: topics)
+        Subscribe(callback, topic);
+}
+
+void TMqttTopicDispatcher::Unsubscribe(const string& topic)
+{
+    const string filter = Filter(topic);
+    bool unsubscribe = false;
+
+    {
+        unique_lock<shared_mutex> lock(Mutex);
+
+        // drops all handlers of topic, as unsubscription by client does
+        if (!Handlers.erase(topic))
+            return;
+
+        auto subscription = Subscriptions.find(filter);
+        if (--subscription->second == 0) {
+            Subscriptions.erase(subscription);
+            unsubscribe = true;
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(SyncMutex);
+        Synced.erase(topic);
+    }
+
+    if (unsubscribe)
+        Client->Unsubscribe(filter);
+}
+
+void TMqttTopicDispatcher::Unsubscribe(const vector<string>& topics)
+{
+    for (const auto& topic: topics)
+        Unsubscribe(topic);
+}
+
+void TMqttTopicDispatcher::WaitForReady(function<void()> readyCallback)
+{
+    Client->WaitForReady(readyCallback);
+}
+
+void TMqttTopicDispatcher::Dispatch(const TMqttMessage& message)
+{
+    // the latest value is replayed, not the one broker has sent with subscription
+    {
+        lock_guard<mutex> lock(LastMutex);
+        if (message.Retained && message.Payload.empty())
+            LastMessages.erase(message.Topic);
+        else
+            LastMessages[message.Topic] = message;
+    }
+
+    shared_lock<shared_mutex> lock(Mutex);
+
+    // other controls of device come with wildcard subscription
+    auto handlers = Handlers.find(message.Topic);
+    if (handlers == Handlers.end())
+        return;
+
+    for (const auto& handler: handlers->second)
+        handler(message);
+
+    if (message.Retained)
+        TrackSync(message.Topic);
+}
+
+void TMqttTopicDispatcher::TrackSync(const string& topic, bool replayed)
+{
+    lock_guard<mutex> lock(SyncMutex);
+
+    const auto now = chrono::steady_clock::now();
+
+    if (!Synced.insert(topic).second && !replayed) {
+        if (!Ready) {
+            LOG(Debug) << "Resubscribed before all topics got values: " << Synced.size() << " of "
+                       << Handlers.size();
+        }
+
+        Synced.clear();
+        Synced.insert(topic);
+        SyncStart = now;
+        Ready = false;
+        ++SyncCount;
+    }
+
+    if (!Ready && Synced.size() == Handlers.size()) {
+        Ready = true;
+        ReadyTime = chrono::duration_cast<chrono::milliseconds>(now - SyncStart);
+
+        LOG(Info) << "All " << Handlers.size() << " topics got values in " << ReadyTime.count() << " ms, "
+                  << Subscriptions.size() << " subscriptions";
+    }
+}
+
+size_t TMqttTopicDispatcher::GetSubscriptionCount() const
+{
+    shared_lock<shared_mutex> lock(Mutex);
+    return Subscriptions.size();
+}
+
+chrono::milliseconds TMqttTopicDispatcher::GetReadyTime() const
+{
+    lock_guard<mutex> lock(SyncMutex);
+    return ReadyTime;
+}
+
+unsigned TMqttTopicDispatcher::GetSyncCount() const
+{
+    lock_guard<mutex> lock(SyncMutex);
+    return SyncCount;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+/*!
+ * \file mqtt_dispatcher.h
+ * \brief MQTT client subscribing to device wildcards instead of single controls
+ */
+
+#include <wblib/mqtt.h>
+
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*! MQTT client decorator dispatching messages of wildcard subscriptions
+ * Control topics /devices/<device>/controls/<control> are covered by one
+ * subscription /devices/<device>/controls/+ per device, other topics are
+ * subscribed as is. Incoming messages are dispatched to handlers by hash table
+ * lookup of exact topic, messages of unmapped controls are dropped.
+ * Last retained value of every topic is kept, so handler added after start to
+ * already subscribed device gets it without resubscription.
+ *
+ * Dispatcher also measures time to ready: time until every subscribed topic
+ * has got its retained value, on start and after each resubscription
+ * by client (broker reconnect).
+ */
+class TMqttTopicDispatcher: public WBMQTT::TMqttClient
+{
+public:
+    /*! Create dispatcher
+     * \param client Client connected to broker
+     */
+    explicit TMqttTopicDispatcher(WBMQTT::PMqttClient client);
+
+    void Start() override;
+    void Stop() override;
+    void Publish(const WBMQTT::TMqttMessage& message) override;
+    WBMQTT::TFuture<void> PublishSynced(const WBMQTT::TMqttMessage& message) override;
+    void Subscribe(WBMQTT::TMqttMessageHandler callback, const std::string& topic) override;
+    void Subscribe(WBMQTT::TMqttMessageHandler callback, const std::vector<std::string>& topics) override;
+    void Unsubscribe(const std::string& topic) override;
+    void Unsubscribe(const std::vector<std::string>& topics) override;
+    void WaitForReady(std::function<void()> readyCallback) override;
+
+    /*! Number of subscriptions made to broker */
+    size_t GetSubscriptionCount() const;
+
+    /*! Time to ready of last completed synchronization, 0 if there was none */
+    std::chrono::milliseconds GetReadyTime() const;
+
+    /*! Number of synchronizations: start and resubscriptions after reconnect */
+    unsigned GetSyncCount() const;
+
+private:
+    /*! Get subscription topic covering topic */
+    static std::string Filter(const std::string& topic);
+
+    void Dispatch(const WBMQTT::TMqttMessage& message);
+
+    /*! Account retained message, called under shared lock
+     * \param topic Message topic
+     * \param replayed Message is replayed by dispatcher, so it doesn't mean resubscription
+     */
+    void TrackSync(const std::string& topic, bool replayed = false);
+
+    WBMQTT::PMqttClient Client;
+
+    /*! Guards handlers and subscriptions, message handlers run under shared lock */
+    mutable std::shared_mutex Mutex;
+    std::unordered_map<std::string, std::vector<WBMQTT::TMqttMessageHandler>> Handlers;
+    std::unordered_map<std::string, size_t> Subscriptions; /*!< Number of topics by subscription */
+    bool Started;
+
+    /*! Last message by topic, including unmapped controls, live updates come without retain flag */
+    std::mutex LastMutex;
+    std::unordered_map<std::string, WBMQTT::TMqttMessage> LastMessages;
+
+    /*! Broker sends retained value of topic once per subscription, so repeated one
+     * means that client has resubscribed after reconnect
+     */
+    mutable std::mutex SyncMutex;
+    std::unordered_set<std::string> Synced;
+    std::chrono::steady_clock::time_point SyncStart;
+    std::chrono::milliseconds ReadyTime;
+    bool Ready;
+    unsigned SyncCount;
+};
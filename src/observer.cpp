@@ -1,34 +1,479 @@
 #include "observer.h"
 
 #include "log.h"
+#include "modbus_encoder.h"
+
+#include <algorithm>
+#include <cstring>
 
 using namespace std;
 using namespace WBMQTT;
 
-TGatewayObserver::TGatewayObserver(const string& topic, PMQTTConverter conv, PMqttClient mqtt)
+TGatewayObserver::TGatewayObserver(const string& topic, PMQTTConverter conv, PMqttClient mqtt, size_t fifo_size)
     : Cache(nullptr),
       CacheSize(0),
       Conv(conv),
       Topic(topic),
-      Mqtt(mqtt)
+      OnTopic(topic + "/on"),
+      Mqtt(mqtt),
+      Qos(1),
+      MinPublishInterval(0),
+      CacheSequence(0),
+      FifoSize(fifo_size),
+      FifoHead(0),
+      FifoCount(0),
+      Type(HOLDING_REGISTER),
+      UnitId(0),
+      Address(0),
+      Queued(false),
+      AckTimeout(0),
+      AckPending(false),
+      LastAckId(0),
+      LastUpdate(0),
+      MaxAge(0),
+      StaleReply(REPLY_GATEWAY_TARGET_FAILED),
+      ErrorFlags(0),
+      PullTimeout(0),
+      PullPending(false),
+      PullStart(0)
+{
+    Subscribe();
+}
+
+void TGatewayObserver::Subscribe()
+{
+    Mqtt->Subscribe([this](const TMqttMessage& msg) { this->OnMessage(msg); }, Topic);
+}
+
+void TGatewayObserver::SetShmExport(PModbusShmExport shm_export)
+{
+    std::lock_guard<std::mutex> lock(CacheMutex);
+    ShmExport = shm_export;
+}
+
+void TGatewayObserver::SetGroup(PRegisterGroup group)
+{
+    std::lock_guard<std::mutex> lock(CacheMutex);
+    Group = group;
+}
+
+void TGatewayObserver::SetUpdateQueue(PUpdateQueue queue)
+{
+    std::lock_guard<std::mutex> lock(CacheMutex);
+    if (FifoSize == 0)
+        UpdateQueue = queue;
+}
+
+void TGatewayObserver::SetPublishQueue(PPublishQueue queue)
+{
+    PublishQueue = queue;
+}
+
+void TGatewayObserver::SetQos(int qos)
+{
+    Qos = qos;
+}
+
+void TGatewayObserver::SetMinPublishInterval(chrono::milliseconds interval)
 {
-    Mqtt->Subscribe([this](const TMqttMessage& msg) { this->OnMessage(msg); }, topic);
+    MinPublishInterval = interval;
+}
+
+void TGatewayObserver::SetWriteAck(chrono::milliseconds timeout, PWriteAckStats stats)
+{
+    AckTimeout = timeout;
+    AckStats = stats;
+}
+
+void TGatewayObserver::SetMaxAge(chrono::milliseconds max_age, TReplyState stale_reply)
+{
+    MaxAge = max_age;
+    StaleReply = stale_reply;
+}
+
+void TGatewayObserver::SetPull(const string& topic, const string& payload, chrono::milliseconds timeout)
+{
+    PullTopic = topic;
+    PullPayload = payload;
+    PullTimeout = timeout;
+}
+
+void TGatewayObserver::SubscribeErrors()
+{
+    Mqtt->Subscribe(
+        [this](const TMqttMessage& msg) {
+            uint16_t flags = 0;
+            for (char c: msg.Payload) {
+                if (c == 'r')
+                    flags |= 1;
+                else if (c == 'w')
+                    flags |= 2;
+                else if (c == 'p')
+                    flags |= 4;
+            }
+            ErrorFlags.store(flags, std::memory_order_relaxed);
+        },
+        Topic + "/meta/error");
+}
+
+chrono::steady_clock::duration TGatewayObserver::GetAge() const
+{
+    const int64_t last = LastUpdate.load(std::memory_order_acquire);
+    if (last == 0)
+        return chrono::steady_clock::duration::max();
+
+    return chrono::steady_clock::now().time_since_epoch() - chrono::steady_clock::duration(last);
+}
+
+uint16_t TGatewayObserver::GetAgeSeconds() const
+{
+    const auto age = GetAge();
+    if (age == chrono::steady_clock::duration::max())
+        return 0xFFFF;
+
+    return std::min<int64_t>(chrono::duration_cast<chrono::seconds>(age).count(), 0xFFFF);
+}
+
+uint16_t TGatewayObserver::GetErrorFlags() const
+{
+    return ErrorFlags.load(std::memory_order_relaxed);
+}
+
+TReplyState TGatewayObserver::OnGetValue(TStoreType type, uint8_t unit_id, uint16_t start, unsigned count, void* data)
+{
+    if (MaxAge == chrono::milliseconds::zero() || GetAge() <= MaxAge)
+        return REPLY_CACHED;
+
+    if (PullTopic.empty())
+        return StaleReply;
+
+    // other reads of stale value wait for the same request
+    if (!PullPending) {
+        TMqttMessage msg(PullTopic, PullPayload, Qos, false);
+
+        PullPending = true;
+        PullStart = chrono::steady_clock::now().time_since_epoch().count();
+
+        if (PublishQueue) {
+            if (!PublishQueue->Push(msg)) {
+                PullPending = false;
+                return REPLY_SERVER_BUSY;
+            }
+        } else {
+            Mqtt->Publish(msg);
+        }
+
+        ::Debug.Log() << "[gateway] Requested value: " << Topic;
+    }
+
+    return REPLY_DEFERRED;
 }
 
 void TGatewayObserver::OnMessage(const TMqttMessage& message)
 {
-    // no pointer to cache - retire
-    if (!Cache)
+    PRegisterGroup group;
+    PUpdateQueue queue;
+    size_t cache_size;
+
+    {
+        std::lock_guard<std::mutex> lock(CacheMutex);
+        group = Group;
+        queue = UpdateQueue;
+        cache_size = CacheSize;
+    }
+
+    // echo is noticed when it comes, even if value gets to cache later
+    if (AckPending.load(std::memory_order_acquire))
+        CheckAck(message.Payload, cache_size);
+
+    // group commits value together with other members
+    if (group) {
+        group->Stage(this, message.Payload);
         return;
+    }
+
+    if (queue) {
+        {
+            std::lock_guard<std::mutex> lock(QueueMutex);
+            QueuedPayload = message.Payload;
+            if (Queued) {
+                queue->CountCoalesced();
+                return;
+            }
+            Queued = true;
+        }
+
+        if (queue->Push(this))
+            return;
+
+        // queue is full - convert in MQTT thread
+        string payload;
+        {
+            std::lock_guard<std::mutex> lock(QueueMutex);
+            payload.swap(QueuedPayload);
+            Queued = false;
+        }
+
+        queue->CountOverflow();
+        ApplyPayload(payload);
+        return;
+    }
+
+    ApplyPayload(message.Payload);
+}
+
+void TGatewayObserver::CheckAck(const string& payload, size_t cache_size)
+{
+    std::lock_guard<std::mutex> lock(AckMutex);
+
+    if (Acks.empty())
+        return;
+
+    // compare packed values, so "1" and "1.0" are the same
+    AckEcho.assign(cache_size * sizeof(uint16_t), 0);
+    Conv->Pack(payload, AckEcho.data(), cache_size);
+
+    const auto now = chrono::steady_clock::now();
+    for (auto& ack: Acks) {
+        if (!ack.Received && ack.Offset + ack.Value.size() <= AckEcho.size() &&
+            memcmp(AckEcho.data() + ack.Offset, ack.Value.data(), ack.Value.size()) == 0)
+        {
+            ack.Received = true;
+            ack.Latency = now - ack.Start;
+        }
+    }
+}
+
+uint64_t TGatewayObserver::GetDeferredId(bool read)
+{
+    if (read)
+        return 0;
 
-    // pack incoming message into Modbus cache
-    Conv->Pack(message.Payload, Cache, CacheSize);
+    std::lock_guard<std::mutex> lock(AckMutex);
+    return LastAckId;
+}
+
+TReplyState TGatewayObserver::OnPollDeferred(bool read, uint64_t id)
+{
+    return read ? PollPull() : PollAck(id);
+}
+
+TReplyState TGatewayObserver::PollPull()
+{
+    // value has come for other read of this observer
+    if (!PullPending)
+        return REPLY_OK;
+
+    if (LastUpdate.load(std::memory_order_acquire) >= PullStart) {
+        PullPending = false;
+        return REPLY_OK;
+    }
+
+    if (chrono::steady_clock::now().time_since_epoch() - chrono::steady_clock::duration(PullStart) < PullTimeout)
+        return REPLY_DEFERRED;
+
+    PullPending = false;
+
+    ::Warn.Log() << "[gateway] Requested value of " << Topic << " hasn't come in " << PullTimeout.count() << " ms";
+
+    return StaleReply;
+}
+
+TReplyState TGatewayObserver::PollAck(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(AckMutex);
+
+    auto ack = std::find_if(Acks.begin(), Acks.end(), [&](const TPendingAck& a) { return a.Id == id; });
+
+    // write was dropped as expired, it is never confirmed without echo
+    if (ack == Acks.end()) {
+        ::Warn.Log() << "[gateway] Write to " << Topic << " is not acknowledged in " << AckTimeout.count() << " ms";
+        return REPLY_GATEWAY_TARGET_FAILED;
+    }
+
+    if (ack->Received) {
+        const uint64_t ms = chrono::duration_cast<chrono::milliseconds>(ack->Latency).count();
+        Acks.erase(ack);
+        AckPending = !Acks.empty();
+
+        if (AckStats) {
+            ++AckStats->Acked;
+            AckStats->LastLatencyMs = ms;
+            AckStats->TotalLatencyMs += ms;
+            if (ms > AckStats->MaxLatencyMs)
+                AckStats->MaxLatencyMs = ms;
+        }
+
+        return REPLY_OK;
+    }
+
+    if (chrono::steady_clock::now() - ack->Start < AckTimeout)
+        return REPLY_DEFERRED;
+
+    Acks.erase(ack);
+    AckPending = !Acks.empty();
+    if (AckStats)
+        ++AckStats->Timeouts;
+
+    ::Warn.Log() << "[gateway] Write to " << Topic << " is not acknowledged in " << AckTimeout.count() << " ms";
+
+    return REPLY_GATEWAY_TARGET_FAILED;
+}
+
+void TGatewayObserver::ApplyQueued()
+{
+    {
+        // both buffers keep their capacity, so steady flow doesn't allocate
+        std::lock_guard<std::mutex> lock(QueueMutex);
+        DrainedPayload = QueuedPayload;
+        Queued = false;
+    }
+
+    ApplyPayload(DrainedPayload);
+}
+
+void TGatewayObserver::ApplyPayload(const string& payload)
+{
+    std::lock_guard<std::mutex> lock(CacheMutex);
+
+    // no pointer to cache yet - keep value until allocation
+    if (!Cache) {
+        PendingPayload = payload;
+    } else {
+        // pack incoming message into Modbus cache, Modbus thread reads it without lock
+        CacheSequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        PackToCache(payload);
+        CacheSequence.fetch_add(1, std::memory_order_release);
+
+        if (ShmExport)
+            ShmExport->Update(Type, UnitId, Address, Cache, CacheSize);
+
+        if (!Fifo.empty())
+            PushFifo();
+    }
+
+    // value is in cache when it becomes fresh, so pulled read gets it; age is calculated only on request
+    LastUpdate.store(chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release);
+}
+
+void TGatewayObserver::PackToCache(const string& payload)
+{
+    if (Type != COIL && Type != DISCRETE_INPUT) {
+        Conv->Pack(payload, Cache, CacheSize);
+        return;
+    }
+
+    // converter gives one byte per bit, neighbouring bits of cache belong to other observers
+    Bits.assign(CacheSize, 0);
+    Conv->Pack(payload, Bits.data(), CacheSize);
+    ModbusEncoder::StoreBits(static_cast<uint8_t*>(Cache), Address % 8, Bits.data(), CacheSize);
+}
+
+void TGatewayObserver::PushFifo()
+{
+    const size_t tail = (FifoHead + FifoCount) % FifoSize;
+    memcpy(&Fifo[tail * CacheSize], Cache, CacheSize * sizeof(uint16_t));
+
+    if (FifoCount < FifoSize) {
+        ++FifoCount;
+    } else {
+        FifoHead = (FifoHead + 1) % FifoSize;
+    }
+}
+
+TReplyState TGatewayObserver::OnReadFifo(TStoreType type,
+                                         uint8_t unit_id,
+                                         uint16_t address,
+                                         uint16_t* values,
+                                         unsigned max_count,
+                                         unsigned& count)
+{
+    if (Fifo.empty())
+        return IModbusServerObserver::OnReadFifo(type, unit_id, address, values, max_count, count);
+
+    std::lock_guard<std::mutex> lock(CacheMutex);
+
+    // drain as many whole values as fit into reply
+    size_t n = std::min(FifoCount, max_count / CacheSize);
+    for (size_t i = 0; i < n; ++i) {
+        memcpy(values + i * CacheSize, &Fifo[FifoHead * CacheSize], CacheSize * sizeof(uint16_t));
+        FifoHead = (FifoHead + 1) % FifoSize;
+    }
+
+    FifoCount -= n;
+    count = n * CacheSize;
+
+    return REPLY_OK;
+}
+
+void TGatewayObserver::OnReadCache(void* dst, const void* cache, size_t size)
+{
+    // copy again if MQTT thread has changed value meanwhile
+    for (;;) {
+        const uint32_t sequence = CacheSequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+            continue;
+
+        memcpy(dst, cache, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (CacheSequence.load(std::memory_order_relaxed) == sequence)
+            return;
+    }
+}
+
+bool TGatewayObserver::GuardsCache() const
+{
+    return true;
 }
 
 void TGatewayObserver::OnCacheAllocate(TStoreType type, uint8_t slave_id, const TModbusCacheAddressRange& range)
 {
-    Cache = range.cbegin()->second.second;
-    CacheSize = range.cbegin()->second.first;
+    std::lock_guard<std::mutex> lock(CacheMutex);
+
+    // range keeps end address of segment, not its size
+    auto segment = range.cbegin();
+    void* old_cache = Cache;
+    Cache = segment->second.second;
+    CacheSize = segment->second.first - segment->first;
+    Type = type;
+    UnitId = slave_id;
+    Address = segment->first;
+
+    // cache was reallocated, carry value over including MQTT updates which came after server copied it
+    if (old_cache && old_cache != Cache) {
+        if (type == COIL || type == DISCRETE_INPUT) {
+            Bits.resize(CacheSize);
+            ModbusEncoder::LoadBits(Bits.data(), static_cast<const uint8_t*>(old_cache), Address % 8, CacheSize);
+            ModbusEncoder::StoreBits(static_cast<uint8_t*>(Cache), Address % 8, Bits.data(), CacheSize);
+        } else {
+            memcpy(Cache, old_cache, CacheSize * sizeof(uint16_t));
+        }
+    }
+
+    if (!old_cache && !PendingPayload.empty()) {
+        PackToCache(PendingPayload);
+        PendingPayload.clear();
+    }
+
+    // FIFO is read by register address, so only holding registers may have it
+    if (type == HOLDING_REGISTER && FifoSize > 0 && Fifo.size() != FifoSize * CacheSize) {
+        Fifo.assign(FifoSize * CacheSize, 0);
+        FifoHead = FifoCount = 0;
+    }
+}
+
+TReplyState TGatewayObserver::OnMaskWriteValue(TStoreType type,
+                                               uint8_t unit_id,
+                                               uint16_t address,
+                                               uint16_t and_mask,
+                                               uint16_t or_mask,
+                                               uint16_t* value)
+{
+    // MQTT update can't slip between reading register and storing result
+    std::lock_guard<std::mutex> lock(CacheMutex);
+    return IModbusServerObserver::OnMaskWriteValue(type, unit_id, address, and_mask, or_mask, value);
 }
 
 TReplyState TGatewayObserver::OnSetValue(TStoreType type,
@@ -37,12 +482,156 @@ TReplyState TGatewayObserver::OnSetValue(TStoreType type,
                                          unsigned count,
                                          const void* data)
 {
+    TMqttMessage msg(OnTopic, Conv->Unpack(data, count), Qos, false);
+    const bool ack = (AckTimeout > chrono::milliseconds::zero());
+
+    // echo may come before publish returns, so wait for it in advance
+    if (ack) {
+        const bool bits = (type == COIL || type == DISCRETE_INPUT);
+        const size_t item_size = bits ? sizeof(uint8_t) : sizeof(uint16_t);
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+        const auto now = chrono::steady_clock::now();
 
-    TMqttMessage msg(Topic + "/on", Conv->Unpack(data, count), 1, false);
+        std::lock_guard<std::mutex> lock(AckMutex);
+        // writes of dropped replies aren't polled anymore
+        Acks.remove_if([&](const TPendingAck& a) { return now - a.Start >= 2 * AckTimeout; });
 
-    Mqtt->Publish(msg);
+        TPendingAck pending{++LastAckId, (start - Address) * item_size, {}, now, false, {}};
+        pending.Value.assign(bytes, bytes + count * item_size);
+        // server keeps coils as 0xFF, converter packs echo as 1
+        if (bits)
+            std::transform(pending.Value.begin(), pending.Value.end(), pending.Value.begin(), [](uint8_t b) {
+                return b != 0;
+            });
+        Acks.push_back(std::move(pending));
+        AckPending = true;
+    }
+
+    // client gets reply without waiting for broker
+    if (PublishQueue) {
+        if (!PublishQueue->Push(msg, MinPublishInterval)) {
+            if (ack) {
+                std::lock_guard<std::mutex> lock(AckMutex);
+                Acks.pop_back();
+                AckPending = !Acks.empty();
+            }
+            return REPLY_SERVER_BUSY;
+        }
+    } else {
+        Mqtt->Publish(msg);
+    }
 
     ::Debug.Log() << "[gateway] Set value via Modbus: " << Topic << " : " << msg.Payload;
 
+    return ack ? REPLY_DEFERRED : REPLY_OK;
+}
+
+TGatewayStatusObserver::TGatewayStatusObserver(PGatewayObserver source, TValue value): Source(source), Value(value)
+{}
+
+TReplyState TGatewayStatusObserver::OnGetValue(TStoreType type,
+                                               uint8_t unit_id,
+                                               uint16_t start,
+                                               unsigned count,
+                                               void* data)
+{
+    const uint16_t value = (Value == AGE) ? Source->GetAgeSeconds() : Source->GetErrorFlags();
+    std::fill_n(static_cast<uint16_t*>(data), count, value);
+    return REPLY_OK;
+}
+
+TGatewayFileObserver::TGatewayFileObserver(const string& topic, size_t size, PMqttClient mqtt)
+    : Records((size + 1) / 2),
+      Topic(topic),
+      OnTopic(topic + "/on"),
+      Mqtt(mqtt),
+      Qos(1)
+{
+    Subscribe();
+}
+
+void TGatewayFileObserver::Subscribe()
+{
+    Mqtt->Subscribe([this](const TMqttMessage& msg) { this->OnMessage(msg); }, Topic);
+}
+
+void TGatewayFileObserver::SetPublishQueue(PPublishQueue queue)
+{
+    PublishQueue = queue;
+}
+
+void TGatewayFileObserver::SetQos(int qos)
+{
+    Qos = qos;
+}
+
+void TGatewayFileObserver::OnMessage(const TMqttMessage& message)
+{
+    std::lock_guard<std::mutex> lock(RecordsMutex);
+
+    // payload longer than file is truncated
+    const size_t size = std::min(message.Payload.size(), Records.size() * 2);
+
+    std::fill(Records.begin(), Records.end(), 0);
+    for (size_t i = 0; i < size; ++i) {
+        const uint8_t byte = message.Payload[i];
+        Records[i / 2] |= (i % 2) ? byte : (byte << 8);
+    }
+}
+
+TReplyState TGatewayFileObserver::OnReadFileRecord(uint8_t unit_id,
+                                                   uint16_t file,
+                                                   uint16_t record,
+                                                   unsigned count,
+                                                   uint16_t* data)
+{
+    std::lock_guard<std::mutex> lock(RecordsMutex);
+
+    if (record + count > Records.size())
+        return REPLY_ILLEGAL_ADDRESS;
+
+    std::copy_n(Records.begin() + record, count, data);
+
+    return REPLY_OK;
+}
+
+TReplyState TGatewayFileObserver::OnWriteFileRecord(uint8_t unit_id,
+                                                    uint16_t file,
+                                                    uint16_t record,
+                                                    unsigned count,
+                                                    const uint16_t* data)
+{
+    string payload;
+
+    {
+        std::lock_guard<std::mutex> lock(RecordsMutex);
+
+        if (record + count > Records.size())
+            return REPLY_ILLEGAL_ADDRESS;
+
+        std::copy_n(data, count, Records.begin() + record);
+
+        payload.reserve(Records.size() * 2);
+        for (uint16_t r: Records) {
+            payload.push_back(char(r >> 8));
+            payload.push_back(char(r & 0xFF));
+        }
+    }
+
+    // cut off zero padding
+    payload.erase(payload.find_last_not_of('\0') + 1);
+
+    TMqttMessage msg(OnTopic, payload, Qos, false);
+
+    if (PublishQueue) {
+        if (!PublishQueue->Push(msg))
+            return REPLY_SERVER_BUSY;
+    } else {
+        Mqtt->Publish(msg);
+    }
+
+    ::Debug.Log() << "[gateway] Set file via Modbus: " << Topic << " : " << payload.size() << " bytes";
+
     return REPLY_OK;
 }
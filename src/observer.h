@@ -7,21 +7,145 @@
 
 #include <wblib/mqtt.h>
 
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <vector>
+
 #include "modbus_wrapper.h"
 #include "mqtt_converters.h"
+#include "publish_queue.h"
+#include "register_group.h"
+#include "shm_export.h"
+#include "update_queue.h"
+
+/*! Counters of writes acknowledged by echo, shared by observers */
+struct TWriteAckStats
+{
+    std::atomic<uint64_t> Acked{0};          /*!< Writes echoed in time */
+    std::atomic<uint64_t> Timeouts{0};       /*!< Writes not echoed in time */
+    std::atomic<uint64_t> LastLatencyMs{0};  /*!< Time from write to echo of the latest acknowledged write */
+    std::atomic<uint64_t> MaxLatencyMs{0};   /*!< Maximum time from write to echo */
+    std::atomic<uint64_t> TotalLatencyMs{0}; /*!< Sum of times from write to echo, for average */
+};
+
+typedef std::shared_ptr<TWriteAckStats> PWriteAckStats;
 
 class TGatewayObserver: public IModbusServerObserver
 {
 public:
-    TGatewayObserver(const std::string& topic, PMQTTConverter conv, WBMQTT::PMqttClient mqtt);
+    /*! Create gateway observer
+     * \param topic MQTT topic
+     * \param conv MQTT converter
+     * \param mqtt MQTT client
+     * \param fifo_size Number of values recorded for READ_FIFO_QUEUE, 0 to disable
+     */
+    TGatewayObserver(const std::string& topic, PMQTTConverter conv, WBMQTT::PMqttClient mqtt, size_t fifo_size = 0);
+
+    /*! Subscribe to MQTT topic, called on construction
+     * May be called again after topic was unsubscribed by other observer
+     */
+    void Subscribe();
+
+    /*! Mirror values received from MQTT to shared memory export */
+    void SetShmExport(PModbusShmExport shm_export);
+
+    /*! Stage values received from MQTT in group instead of writing them to cache
+     * \param group Register group, null to write values immediately
+     */
+    void SetGroup(PRegisterGroup group);
+
+    /*! Write value received from MQTT to cache, called by group on commit */
+    void ApplyPayload(const std::string& payload);
+
+    /*! Convert values received from MQTT in Modbus thread
+     * Ignored for registers with FIFO, as they record every value.
+     * \param queue Update queue, null to convert values in MQTT thread
+     */
+    void SetUpdateQueue(PUpdateQueue queue);
+
+    /*! Write the latest queued value to cache, called on queue drain */
+    void ApplyQueued();
+
+    /*! Publish values written by Modbus clients from publisher thread
+     * \param queue Publish queue, null to publish before reply
+     */
+    void SetPublishQueue(PPublishQueue queue);
+
+    /*! Set QoS of messages with values written by Modbus clients, 1 by default */
+    void SetQos(int qos);
+
+    /*! Limit rate of messages with values written by Modbus clients
+     * Values written more often are replaced by the latest one, it is published when
+     * interval elapses. Applied only with publish queue.
+     * \param interval Minimum interval between messages, 0 for no limit
+     */
+    void SetMinPublishInterval(std::chrono::milliseconds interval);
+
+    /*! Reply on writes only after control topic echoes written value
+     * Other clients are served meanwhile. Write which isn't echoed in time is answered
+     * with Gateway Target Device Failed to Respond exception.
+     * \param timeout Time to wait for echo, 0 to reply right after publishing
+     * \param stats Acknowledge counters, may be null
+     */
+    void SetWriteAck(std::chrono::milliseconds timeout, PWriteAckStats stats);
+
+    /*! Refuse reads of values which weren't updated from MQTT for too long
+     * Observer must be registered as not cache-backed, so server asks it on reads.
+     * \param max_age Maximum age of value, 0 to serve values of any age
+     * \param stale_reply Exception to reply on read of stale value
+     */
+    void SetMaxAge(std::chrono::milliseconds max_age, TReplyState stale_reply);
+
+    /*! Request value from its producer on read of stale value
+     * Client's reply is held until value comes or timeout elapses, other clients are
+     * served meanwhile. Maximum age must be set, fresh values are read from cache.
+     * \param topic Topic where request is published
+     * \param payload Request payload
+     * \param timeout Time to wait for value, stale exception is replied after it
+     */
+    void SetPull(const std::string& topic, const std::string& payload, std::chrono::milliseconds timeout);
+
+    /*! Subscribe to meta/error topic of control, called again after topic was unsubscribed */
+    void SubscribeErrors();
+
+    /*! Get seconds since the latest value came from MQTT, 0xFFFF if there was none or it is older */
+    uint16_t GetAgeSeconds() const;
+
+    /*! Get flags of control's meta/error: 1 - read error, 2 - write error, 4 - poll period miss */
+    uint16_t GetErrorFlags() const;
 
     // Modbus callbacks
     TReplyState OnSetValue(TStoreType type, uint8_t unit_id, uint16_t start, unsigned count, const void* data) override;
+    TReplyState OnMaskWriteValue(TStoreType type,
+                                 uint8_t unit_id,
+                                 uint16_t address,
+                                 uint16_t and_mask,
+                                 uint16_t or_mask,
+                                 uint16_t* value) override;
+    TReplyState OnReadFifo(TStoreType type,
+                           uint8_t unit_id,
+                           uint16_t address,
+                           uint16_t* values,
+                           unsigned max_count,
+                           unsigned& count) override;
+    void OnReadCache(void* dst, const void* cache, size_t size) override;
+
+    /*! Values are packed to cache by MQTT thread, so they are copied under sequence lock */
+    bool GuardsCache() const override;
+
     void OnCacheAllocate(TStoreType type, uint8_t area, const TModbusCacheAddressRange& cache) override;
-    // no need of OnGetValue, use cache instead
+    uint64_t GetDeferredId(bool read) override;
+    TReplyState OnPollDeferred(bool read, uint64_t id) override;
+
+    /*! Check age of value and request stale value in pull mode, called only if observer
+     * isn't cache-backed (maximum age is set), otherwise server reads cache directly
+     */
+    TReplyState OnGetValue(TStoreType type, uint8_t unit_id, uint16_t start, unsigned count, void* data) override;
 
 protected:
-    /*! Pointer to Modbus cache area */
+    /*! Pointer to Modbus cache area, bits are packed there from bit (Address % 8) */
     void* Cache;
 
     /*! Size of allocated cache - safety */
@@ -33,11 +157,215 @@ protected:
     /*! Bridged MQTT topic */
     std::string Topic;
 
+    /*! Topic for values written by Modbus clients */
+    std::string OnTopic;
+
     /*! Pointer to MQTT client */
     WBMQTT::PMqttClient Mqtt;
 
+    /*! Queue of messages for publisher thread, may be null */
+    PPublishQueue PublishQueue;
+
+    /*! QoS of messages with written values */
+    int Qos;
+
+    /*! Minimum interval between messages with written values */
+    std::chrono::milliseconds MinPublishInterval;
+
+    /*! Serializes cache updates from MQTT and read-modify-write requests from Modbus */
+    std::mutex CacheMutex;
+
+    /*! Sequence lock of cached value, odd while value is packed by MQTT thread */
+    std::atomic<uint32_t> CacheSequence;
+
+    /*! Maximum number of values in FIFO */
+    size_t FifoSize;
+
+    /*! Ring of recorded register values, FifoSize * CacheSize registers */
+    std::vector<uint16_t> Fifo;
+
+    /*! Index of oldest value in FIFO and number of values in it */
+    size_t FifoHead, FifoCount;
+
+    /*! Last MQTT payload received before cache allocation (observer added on reload) */
+    std::string PendingPayload;
+
+    /*! Bits converted one per byte before they are packed to cache, guarded by CacheMutex */
+    std::vector<uint8_t> Bits;
+
+    /*! Store, unit ID and address of cached items, known after cache allocation */
+    TStoreType Type;
+    uint8_t UnitId;
+    int Address;
+
+    /*! Shared memory export, may be null */
+    PModbusShmExport ShmExport;
+
+    /*! Register group committing values, may be null */
+    PRegisterGroup Group;
+
+    /*! Queue of values waiting for conversion, may be null */
+    PUpdateQueue UpdateQueue;
+
+    /*! The latest value waiting in update queue, guarded by QueueMutex */
+    std::mutex QueueMutex;
+    std::string QueuedPayload;
+    bool Queued;
+
+    /*! Copy of queued value being applied, used by draining thread only */
+    std::string DrainedPayload;
+
+    /*! Time to wait for echo of written value, 0 if writes are not acknowledged */
+    std::chrono::milliseconds AckTimeout;
+
+    /*! Acknowledge counters, may be null */
+    PWriteAckStats AckStats;
+
+    /*! Write waiting for echo */
+    struct TPendingAck
+    {
+        uint64_t Id;
+        size_t Offset;              /*!< Offset of written items in value, bytes */
+        std::vector<uint8_t> Value; /*!< Written items */
+        std::chrono::steady_clock::time_point Start;
+        bool Received;
+        std::chrono::steady_clock::duration Latency;
+    };
+
+    /*! Writes waiting for echo in order of arrival, guarded by AckMutex */
+    std::mutex AckMutex;
+    std::list<TPendingAck> Acks;
+    std::atomic<bool> AckPending; /*!< Acks isn't empty */
+    uint64_t LastAckId;           /*!< ID of the latest deferred write */
+    std::vector<uint8_t> AckEcho; /*!< Received value packed for comparison */
+
+    /*! Time when the latest value came from MQTT, steady clock ticks, 0 if there was none */
+    std::atomic<int64_t> LastUpdate;
+
+    /*! Maximum age of value served to clients, 0 for no limit */
+    std::chrono::milliseconds MaxAge;
+    TReplyState StaleReply;
+
+    /*! Flags of control's meta/error */
+    std::atomic<uint16_t> ErrorFlags;
+
+    /*! Request of stale value, topic is empty if values aren't requested */
+    std::string PullTopic;
+    std::string PullPayload;
+    std::chrono::milliseconds PullTimeout;
+
+    /*! Request waits for value which comes after PullStart, used by Modbus thread only */
+    bool PullPending;
+    int64_t PullStart;
+
 private:
     void OnMessage(const WBMQTT::TMqttMessage& message);
+
+    /*! Check if received value completes write waiting for echo */
+    void CheckAck(const std::string& payload, size_t cache_size);
+
+    /*! Get time since the latest value came from MQTT, duration::max() if there was none */
+    std::chrono::steady_clock::duration GetAge() const;
+
+    /*! Poll write waiting for echo */
+    TReplyState PollAck(uint64_t id);
+
+    /*! Poll read waiting for requested value */
+    TReplyState PollPull();
+
+    /*! Record current cached value in FIFO, oldest value is dropped if FIFO is full */
+    void PushFifo();
+
+    /*! Convert payload into cache, called under CacheMutex */
+    void PackToCache(const std::string& payload);
 };
 
 typedef std::shared_ptr<TGatewayObserver> PGatewayObserver;
+
+/*! Read-only register with state of gateway observer's control
+ * Lets clients check health of source device without polling it.
+ */
+class TGatewayStatusObserver: public IModbusServerObserver
+{
+public:
+    enum TValue
+    {
+        AGE,   /*!< Seconds since the latest update, see TGatewayObserver::GetAgeSeconds() */
+        ERRORS /*!< Flags of meta/error, see TGatewayObserver::GetErrorFlags() */
+    };
+
+    /*! Create status observer
+     * \param source Observer of control
+     * \param value Reported value
+     */
+    TGatewayStatusObserver(PGatewayObserver source, TValue value);
+
+    // Modbus callbacks
+    TReplyState OnGetValue(TStoreType type, uint8_t unit_id, uint16_t start, unsigned count, void* data) override;
+
+private:
+    PGatewayObserver Source;
+    TValue Value;
+};
+
+/*! Gateway observer exposing MQTT payload as Modbus file
+ * Payload bytes are packed two per record (register), big-endian,
+ * file is padded with zero bytes which are cut off on write.
+ */
+class TGatewayFileObserver: public IModbusServerObserver
+{
+public:
+    /*! Create file observer
+     * \param topic MQTT topic
+     * \param size File size in bytes
+     * \param mqtt MQTT client
+     */
+    TGatewayFileObserver(const std::string& topic, size_t size, WBMQTT::PMqttClient mqtt);
+
+    /*! Subscribe to MQTT topic, called on construction */
+    void Subscribe();
+
+    /*! Publish files written by Modbus clients from publisher thread
+     * \param queue Publish queue, null to publish before reply
+     */
+    void SetPublishQueue(PPublishQueue queue);
+
+    /*! Set QoS of messages with files written by Modbus clients, 1 by default */
+    void SetQos(int qos);
+
+    // Modbus callbacks
+    TReplyState OnReadFileRecord(uint8_t unit_id, uint16_t file, uint16_t record, unsigned count, uint16_t* data)
+        override;
+    TReplyState OnWriteFileRecord(uint8_t unit_id,
+                                  uint16_t file,
+                                  uint16_t record,
+                                  unsigned count,
+                                  const uint16_t* data) override;
+
+protected:
+    /*! File contents */
+    std::vector<uint16_t> Records;
+
+    /*! Serializes file updates from MQTT and Modbus */
+    std::mutex RecordsMutex;
+
+    /*! Bridged MQTT topic */
+    std::string Topic;
+
+    /*! Topic for files written by Modbus clients */
+    std::string OnTopic;
+
+    /*! Pointer to MQTT client */
+    WBMQTT::PMqttClient Mqtt;
+
+    /*! Queue of messages for publisher thread, may be null */
+    PPublishQueue PublishQueue;
+
+    /*! QoS of messages with written files */
+    int Qos;
+
+private:
+    void OnMessage(const WBMQTT::TMqttMessage& message);
+};
+
+typedef std::shared_ptr<TGatewayFileObserver> PGatewayFileObserver;
@@ -0,0 +1,146 @@
+#include "publish_queue.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace WBMQTT;
+
+TPublishQueue::TPublishQueue(PMqttClient mqtt, size_t capacity, TFullPolicy policy)
+    : Mqtt(mqtt),
+      Capacity(capacity),
+      Policy(policy),
+      Stopped(false),
+      Published(0),
+      Rejected(0),
+      Coalesced(0),
+      MaxBatch(0)
+{
+    Thread = thread([this] { Run(); });
+}
+
+TPublishQueue::~TPublishQueue()
+{
+    Stop();
+}
+
+void TPublishQueue::Stop()
+{
+    {
+        lock_guard<mutex> lock(Mutex);
+        Stopped = true;
+    }
+
+    HasMessages.notify_one();
+    if (Thread.joinable())
+        Thread.join();
+}
+
+bool TPublishQueue::Push(const TMqttMessage& message, chrono::milliseconds min_interval)
+{
+    unique_lock<mutex> lock(Mutex);
+    TThrottle* throttle = nullptr;
+
+    // publisher thread is gone, message would never be sent
+    if (Stopped)
+        return false;
+
+    if (min_interval > chrono::milliseconds::zero()) {
+        throttle = &Throttled[message.Topic];
+
+        if (throttle->Pending) {
+            throttle->Message = message;
+            ++Coalesced;
+            return true;
+        }
+
+        // too early - message waits, later ones replace it
+        if (chrono::steady_clock::now() - throttle->LastPublish < min_interval) {
+            throttle->Pending = true;
+            throttle->Message = message;
+            Due.emplace(throttle->LastPublish + min_interval, message.Topic);
+
+            lock.unlock();
+            HasMessages.notify_one();
+            return true;
+        }
+    }
+
+    if (Messages.size() >= Capacity) {
+        if (Policy == REJECT) {
+            ++Rejected;
+            return false;
+        }
+
+        HasSpace.wait(lock, [this] { return Messages.size() < Capacity; });
+    }
+
+    Messages.push_back(message);
+    if (throttle)
+        throttle->LastPublish = chrono::steady_clock::now();
+    lock.unlock();
+
+    HasMessages.notify_one();
+    return true;
+}
+
+void TPublishQueue::TakeDue(bool all)
+{
+    const auto now = chrono::steady_clock::now();
+
+    // waiting messages don't count to capacity, there is at most one per topic
+    while (!Due.empty() && (all || Due.top().first <= now)) {
+        auto& throttle = Throttled[Due.top().second];
+        Messages.push_back(std::move(throttle.Message));
+        throttle.Pending = false;
+        throttle.LastPublish = now;
+        Due.pop();
+    }
+}
+
+void TPublishQueue::Run()
+{
+    deque<TMqttMessage> batch;
+
+    for (;;) {
+        {
+            unique_lock<mutex> lock(Mutex);
+
+            for (;;) {
+                // messages queued before stop are still published, waiting ones without delay
+                TakeDue(Stopped);
+                if (Stopped || !Messages.empty())
+                    break;
+
+                if (Due.empty()) {
+                    HasMessages.wait(lock);
+                } else {
+                    HasMessages.wait_until(lock, Due.top().first);
+                }
+            }
+
+            if (Messages.empty())
+                return;
+
+            batch.swap(Messages);
+            MaxBatch = max(MaxBatch, batch.size());
+        }
+
+        HasSpace.notify_all();
+
+        for (const auto& message: batch)
+            Mqtt->Publish(message);
+
+        {
+            lock_guard<mutex> lock(Mutex);
+            Published += batch.size();
+        }
+
+        batch.clear();
+    }
+}
+
+TPublishQueue::TStats TPublishQueue::GetStats() const
+{
+    lock_guard<mutex> lock(Mutex);
+    return TStats{Published, Rejected, Coalesced, Messages.size(), MaxBatch};
+}
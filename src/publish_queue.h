@@ -0,0 +1,117 @@
+#pragma once
+
+/*!
+ * \file publish_queue.h
+ * \brief Background publishing of values written by Modbus clients
+ */
+
+#include <wblib/mqtt.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*! Queue of MQTT messages published by own thread
+ * Modbus thread only queues messages and replies to client, publisher thread
+ * takes all queued messages at once and publishes them in order.
+ *
+ * Topic may have minimum publish interval. Message coming earlier waits until
+ * interval elapses and is replaced by later messages to the same topic, so
+ * the last value is always published, but not more often than allowed.
+ */
+class TPublishQueue
+{
+public:
+    /*! Behaviour on full queue */
+    enum TFullPolicy
+    {
+        REJECT, /*!< Refuse message, write is answered with Server Busy */
+        BLOCK   /*!< Wait until publisher thread frees space */
+    };
+
+    /*! Queue counters */
+    struct TStats
+    {
+        uint64_t Published; /*!< Messages published */
+        uint64_t Rejected;  /*!< Messages refused as queue was full */
+        uint64_t Coalesced; /*!< Messages replaced by later ones within publish interval */
+        size_t Depth;       /*!< Messages waiting now */
+        size_t MaxBatch;    /*!< Maximum number of messages published at once */
+    };
+
+    /*! Create queue and start publisher thread
+     * \param mqtt MQTT client
+     * \param capacity Maximum number of waiting messages
+     * \param policy Behaviour on full queue
+     */
+    TPublishQueue(WBMQTT::PMqttClient mqtt, size_t capacity, TFullPolicy policy);
+
+    /*! Publish messages left in queue and stop publisher thread */
+    ~TPublishQueue();
+
+    /*! Publish messages left in queue, waiting ones without delay, and stop publisher thread
+     * Must be called while MQTT client is still running, later messages are refused
+     */
+    void Stop();
+
+    /*! Queue message
+     * \param message Message
+     * \param min_interval Minimum interval between publications to message topic
+     * \return false if queue is full and policy is REJECT or if queue is stopped
+     */
+    bool Push(const WBMQTT::TMqttMessage& message,
+              std::chrono::milliseconds min_interval = std::chrono::milliseconds::zero());
+
+    TStats GetStats() const;
+
+private:
+    typedef std::chrono::steady_clock::time_point TTimePoint;
+
+    /*! Publish state of rate limited topic */
+    struct TThrottle
+    {
+        TTimePoint LastPublish;
+        bool Pending;                 /*!< Message waits for interval to elapse */
+        WBMQTT::TMqttMessage Message; /*!< The latest waiting message */
+    };
+
+    void Run();
+
+    /*! Move waiting messages whose time has come to queue, called under lock
+     * \param all Move all waiting messages
+     */
+    void TakeDue(bool all);
+
+    WBMQTT::PMqttClient Mqtt;
+    size_t Capacity;
+    TFullPolicy Policy;
+
+    mutable std::mutex Mutex;
+    std::condition_variable HasMessages, HasSpace;
+    std::deque<WBMQTT::TMqttMessage> Messages;
+    bool Stopped;
+
+    /*! Rate limited topics and their waiting messages ordered by publish time */
+    std::unordered_map<std::string, TThrottle> Throttled;
+    std::priority_queue<std::pair<TTimePoint, std::string>,
+                        std::vector<std::pair<TTimePoint, std::string>>,
+                        std::greater<std::pair<TTimePoint, std::string>>>
+        Due;
+
+    uint64_t Published, Rejected, Coalesced;
+    size_t MaxBatch;
+
+    std::thread Thread;
+};
+
+typedef std::shared_ptr<TPublishQueue> PPublishQueue;
@@ -0,0 +1,143 @@
+#include "register_group.h"
+
+#include "log.h"
+#include "observer.h"
+
+#include <algorithm>
+
+#define LOG(logger) ::logger.Log() << "[gateway] "
+
+using namespace std;
+using namespace WBMQTT;
+
+TRegisterGroup::TRegisterGroup(const string& name,
+                               chrono::milliseconds window,
+                               const string& trigger,
+                               PMqttClient mqtt)
+    : Name(name),
+      Window(window),
+      Trigger(trigger),
+      Mqtt(mqtt),
+      HasStaged(false),
+      Triggered(false),
+      Generation(0)
+{
+    Subscribe();
+}
+
+const string& TRegisterGroup::GetName() const
+{
+    return Name;
+}
+
+const string& TRegisterGroup::GetTrigger() const
+{
+    return Trigger;
+}
+
+void TRegisterGroup::Subscribe()
+{
+    if (!Trigger.empty())
+        Mqtt->Subscribe([this](const TMqttMessage& msg) { this->OnTrigger(msg); }, Trigger);
+}
+
+void TRegisterGroup::SetWakeup(function<void()> wakeup)
+{
+    Wakeup = wakeup;
+}
+
+void TRegisterGroup::Stage(TGatewayObserver* observer, const string& payload)
+{
+    unique_lock<mutex> lock(Mutex);
+
+    auto it = find_if(Staged.begin(), Staged.end(), [&](const pair<TGatewayObserver*, string>& value) {
+        return value.first == observer;
+    });
+
+    if (it != Staged.end()) {
+        it->second = payload;
+        return;
+    }
+
+    // window starts with first update of generation
+    const bool first = Staged.empty();
+    if (first)
+        Deadline = chrono::steady_clock::now() + Window;
+
+    Staged.emplace_back(observer, payload);
+    HasStaged.store(true, memory_order_release);
+    lock.unlock();
+
+    // Modbus thread waits with poll timeout, which doesn't know about new window yet
+    if (first && Window.count() > 0 && Wakeup)
+        Wakeup();
+}
+
+void TRegisterGroup::OnTrigger(const TMqttMessage& message)
+{
+    {
+        lock_guard<mutex> lock(Mutex);
+
+        // trigger without updates doesn't commit values coming after it
+        if (Staged.empty())
+            return;
+
+        Triggered = true;
+    }
+
+    if (Wakeup)
+        Wakeup();
+}
+
+int TRegisterGroup::GetCommitTimeout()
+{
+    if (!HasStaged.load(memory_order_acquire))
+        return -1;
+
+    lock_guard<mutex> lock(Mutex);
+
+    if (Triggered)
+        return 0;
+
+    if (Window.count() == 0)
+        return -1;
+
+    // rounded up, so server doesn't wake up just before deadline
+    auto left = chrono::ceil<chrono::milliseconds>(Deadline - chrono::steady_clock::now());
+    return max<int>(left.count(), 0);
+}
+
+bool TRegisterGroup::Commit(bool force)
+{
+    if (!HasStaged.load(memory_order_acquire))
+        return false;
+
+    vector<pair<TGatewayObserver*, string>> staged;
+
+    {
+        lock_guard<mutex> lock(Mutex);
+
+        const bool window_elapsed = Window.count() > 0 && chrono::steady_clock::now() >= Deadline;
+        if (!force && !Triggered && !window_elapsed)
+            return false;
+
+        staged.swap(Staged);
+        Triggered = false;
+        HasStaged.store(false, memory_order_relaxed);
+    }
+
+    // Modbus thread doesn't serve reads meanwhile, so no read sees part of generation
+    for (const auto& value: staged)
+        value.first->ApplyPayload(value.second);
+
+    ++Generation;
+
+    LOG(Debug) << "Group " << Name << " committed " << staged.size() << " values, generation " << Generation;
+
+    return true;
+}
+
+uint32_t TRegisterGroup::GetGeneration() const
+{
+    return Generation;
+}
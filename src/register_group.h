@@ -0,0 +1,90 @@
+#pragma once
+
+/*!
+ * \file register_group.h
+ * \brief Registers updated from MQTT together
+ */
+
+#include <wblib/mqtt.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class TGatewayObserver;
+
+/*! Group of registers whose MQTT updates are committed to cache at once
+ * Values received by members are staged until group window (counted from first
+ * staged value) elapses or message comes to trigger topic. Staged values are
+ * committed by Modbus thread between queries, so any read sees values of the
+ * same generation for all registers of group.
+ */
+class TRegisterGroup
+{
+public:
+    /*! Create group
+     * \param name Group name from config
+     * \param window Time to collect updates after first one, 0 to commit on trigger only
+     * \param trigger MQTT topic committing staged values, empty to commit on window only
+     * \param mqtt MQTT client
+     */
+    TRegisterGroup(const std::string& name,
+                   std::chrono::milliseconds window,
+                   const std::string& trigger,
+                   WBMQTT::PMqttClient mqtt);
+
+    const std::string& GetName() const;
+
+    /*! Trigger topic, empty if group has none */
+    const std::string& GetTrigger() const;
+
+    /*! Subscribe to trigger topic, called on construction
+     * May be called again after topic was unsubscribed by other observer
+     */
+    void Subscribe();
+
+    /*! Set function waking up Modbus thread when group is ready to commit or its window starts */
+    void SetWakeup(std::function<void()> wakeup);
+
+    /*! Stage value received by member, later value replaces earlier one (MQTT thread) */
+    void Stage(TGatewayObserver* observer, const std::string& payload);
+
+    /*! Commit staged values if window has elapsed or trigger has come (Modbus thread)
+     * \param force Commit regardless of window and trigger
+     * \return true if values were committed
+     */
+    bool Commit(bool force = false);
+
+    /*! Time left until group window elapses (Modbus thread)
+     * \return Milliseconds, 0 if group is ready to commit, -1 if nothing waits for window
+     */
+    int GetCommitTimeout();
+
+    /*! Number of commits done */
+    uint32_t GetGeneration() const;
+
+private:
+    void OnTrigger(const WBMQTT::TMqttMessage& message);
+
+    std::string Name;
+    std::chrono::milliseconds Window;
+    std::string Trigger;
+    WBMQTT::PMqttClient Mqtt;
+    std::function<void()> Wakeup;
+
+    /*! Cheap check for Modbus thread, set while something is staged */
+    std::atomic<bool> HasStaged;
+
+    std::mutex Mutex;
+    std::vector<std::pair<TGatewayObserver*, std::string>> Staged;
+    std::chrono::steady_clock::time_point Deadline;
+    bool Triggered;
+    uint32_t Generation;
+};
+
+typedef std::shared_ptr<TRegisterGroup> PRegisterGroup;
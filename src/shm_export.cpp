@@ -0,0 +1,144 @@
+#include "shm_export.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LOG(logger) ::logger.Log() << "[shm] "
+
+using namespace std;
+
+namespace
+{
+    /*! Get value of item, cached bits are packed and the first one is bit (start % 8) */
+    uint16_t ItemValue(TStoreType type, const void* values, int start, unsigned index)
+    {
+        if (type == COIL || type == DISCRETE_INPUT) {
+            const unsigned bit = start % 8 + index;
+            return (static_cast<const uint8_t*>(values)[bit / 8] >> (bit % 8)) & 1;
+        }
+
+        return static_cast<const uint16_t*>(values)[index];
+    }
+}
+
+TModbusShmExport::TModbusShmExport(const string& name)
+    : Name(name),
+      Memory(nullptr),
+      MemorySize(0),
+      Header(nullptr),
+      Entries(nullptr)
+{}
+
+TModbusShmExport::~TModbusShmExport()
+{
+    Destroy();
+}
+
+void TModbusShmExport::Destroy()
+{
+    if (!Memory)
+        return;
+
+    // readers keep their mappings, tell them to reopen
+    Header->Stale.store(1, memory_order_release);
+    munmap(Memory, MemorySize);
+    shm_unlink(Name.c_str());
+
+    Memory = nullptr;
+    MemorySize = 0;
+    Header = nullptr;
+    Entries = nullptr;
+}
+
+void TModbusShmExport::Create(vector<TModbusCacheSegment> segments)
+{
+    lock_guard<mutex> lock(Mutex);
+
+    Destroy();
+
+    sort(segments.begin(), segments.end(), [](const TModbusCacheSegment& a, const TModbusCacheSegment& b) {
+        return make_tuple(a.UnitId, uint8_t(a.Type), a.Start) < make_tuple(b.UnitId, uint8_t(b.Type), b.Start);
+    });
+
+    size_t count = 0;
+    for (const auto& segment: segments)
+        count += segment.Count;
+
+    const size_t size = sizeof(MbgateShm::THeader) + count * sizeof(MbgateShm::TEntry);
+
+    // object may be left by previous gateway instance, truncating it would crash readers still mapping it
+    shm_unlink(Name.c_str());
+
+    // other processes may only read
+    int fd = shm_open(Name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        LOG(Error) << "Can't create shared memory object " << Name << ": " << strerror(errno);
+        return;
+    }
+
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (memory == MAP_FAILED) {
+        LOG(Error) << "Can't map shared memory object " << Name << ": " << strerror(errno);
+        close(fd);
+        shm_unlink(Name.c_str());
+        return;
+    }
+    close(fd);
+
+    Memory = memory;
+    MemorySize = size;
+    Header = new (memory) MbgateShm::THeader{MbgateShm::MAGIC, MbgateShm::VERSION, uint32_t(count), {0}, {0}, 0};
+    Entries = reinterpret_cast<MbgateShm::TEntry*>(Header + 1);
+
+    MbgateShm::TEntry* entry = Entries;
+    for (const auto& segment: segments) {
+        for (int i = 0; i < segment.Count; ++i, ++entry) {
+            new (entry) MbgateShm::TEntry{{0},
+                                          segment.UnitId,
+                                          uint8_t(segment.Type),
+                                          uint16_t(segment.Start + i),
+                                          {ItemValue(segment.Type, segment.Cache, segment.Start, i)},
+                                          0};
+        }
+    }
+
+    LOG(Info) << "Cache exported to shared memory object " << Name << ", " << count << " items";
+}
+
+void TModbusShmExport::Update(TStoreType type, uint8_t unit_id, int start, const void* values, unsigned count)
+{
+    lock_guard<mutex> lock(Mutex);
+
+    if (!Entries)
+        return;
+
+    MbgateShm::TEntry* end = Entries + Header->EntryCount;
+    const auto key = make_tuple(unit_id, uint8_t(type), uint16_t(start));
+
+    MbgateShm::TEntry* entry = lower_bound(Entries, end, key, [](const MbgateShm::TEntry& e, const auto& k) {
+        return MbgateShm::Key(e) < k;
+    });
+
+    // items of observed segment are consecutive entries, value spanning them is replaced as a whole
+    MbgateShm::BeginUpdate(*Header);
+    for (unsigned i = 0; i < count && entry != end; ++i, ++entry) {
+        if (MbgateShm::Key(*entry) != make_tuple(unit_id, uint8_t(type), uint16_t(start + i)))
+            break;
+
+        const uint16_t value = ItemValue(type, values, start, i);
+        if (entry->Value.load(memory_order_relaxed) != value)
+            MbgateShm::Store(*entry, value);
+    }
+    MbgateShm::EndUpdate(*Header);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+/*!
+ * \file shm_export.h
+ * \brief Mirror of Modbus cache in POSIX shared memory
+ */
+
+#include "mbgate_shm.h"
+#include "modbus_wrapper.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*! Writer of shared memory export, layout is described in mbgate_shm.h
+ * Cache updates come from Modbus and MQTT threads, so writer side is serialized,
+ * readers in other processes don't lock anything.
+ */
+class TModbusShmExport
+{
+public:
+    /*! Create export, object is created by Create()
+     * \param name POSIX shared memory object name
+     */
+    explicit TModbusShmExport(const std::string& name);
+    ~TModbusShmExport();
+
+    /*! Create object with entries for given segments, filled with cached values
+     * Previous object is marked stale and replaced. On system error export is
+     * disabled until next call.
+     */
+    void Create(std::vector<TModbusCacheSegment> segments);
+
+    /*! Mirror updated cache values
+     * \param type Store type
+     * \param unit_id Unit ID
+     * \param start First item address
+     * \param values Cached values of items, bits are packed from bit (start % 8)
+     * \param count Number of items
+     */
+    void Update(TStoreType type, uint8_t unit_id, int start, const void* values, unsigned count);
+
+private:
+    void Destroy();
+
+    std::string Name;
+    std::mutex Mutex;
+
+    void* Memory;
+    size_t MemorySize;
+    MbgateShm::THeader* Header;
+    MbgateShm::TEntry* Entries;
+};
+
+typedef std::shared_ptr<TModbusShmExport> PModbusShmExport;
@@ -0,0 +1,51 @@
+#include "stats_publisher.h"
+
+using namespace std;
+using namespace WBMQTT;
+
+TStatsPublisher::TStatsPublisher(PMqttClient mqtt, const string& device, chrono::seconds interval)
+    : Mqtt(mqtt),
+      Device(device),
+      Interval(interval),
+      LastPublish(chrono::steady_clock::now()),
+      MetaPublished(false)
+{}
+
+void TStatsPublisher::AddCounter(const string& name, function<uint64_t()> counter)
+{
+    Counters.push_back(TCounter{name, counter, 0, false});
+    MetaPublished = false;
+}
+
+void TStatsPublisher::PublishIfDue()
+{
+    if (chrono::steady_clock::now() - LastPublish >= Interval)
+        Publish();
+}
+
+void TStatsPublisher::Publish()
+{
+    LastPublish = chrono::steady_clock::now();
+
+    const string device_topic = "/devices/" + Device;
+
+    if (!MetaPublished) {
+        Mqtt->Publish(TMqttMessage(device_topic + "/meta/name", Device, 1, true));
+        for (const auto& counter: Counters) {
+            const string control_topic = device_topic + "/controls/" + counter.Name;
+            Mqtt->Publish(TMqttMessage(control_topic + "/meta/type", "value", 1, true));
+            Mqtt->Publish(TMqttMessage(control_topic + "/meta/readonly", "1", 1, true));
+        }
+        MetaPublished = true;
+    }
+
+    for (auto& counter: Counters) {
+        const uint64_t value = counter.Get();
+        if (counter.Published && value == counter.Value)
+            continue;
+
+        Mqtt->Publish(TMqttMessage(device_topic + "/controls/" + counter.Name, to_string(value), 1, true));
+        counter.Value = value;
+        counter.Published = true;
+    }
+}
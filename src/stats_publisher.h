@@ -0,0 +1,61 @@
+#pragma once
+
+/*!
+ * \file stats_publisher.h
+ * \brief Gateway counters published as MQTT device
+ */
+
+#include <wblib/mqtt.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*! Publisher of gateway counters
+ * Each counter is a read-only control /devices/<device>/controls/<name>,
+ * values are published retained when they change. Counters are read and
+ * published from Modbus thread.
+ */
+class TStatsPublisher
+{
+public:
+    /*! Create publisher
+     * \param mqtt MQTT client
+     * \param device MQTT device name
+     * \param interval Publish interval
+     */
+    TStatsPublisher(WBMQTT::PMqttClient mqtt, const std::string& device, std::chrono::seconds interval);
+
+    /*! Add counter
+     * \param name Control name
+     * \param counter Function returning current value
+     */
+    void AddCounter(const std::string& name, std::function<uint64_t()> counter);
+
+    /*! Publish counters if interval has passed since last publication */
+    void PublishIfDue();
+
+    /*! Publish changed counters */
+    void Publish();
+
+private:
+    struct TCounter
+    {
+        std::string Name;
+        std::function<uint64_t()> Get;
+        uint64_t Value;
+        bool Published;
+    };
+
+    WBMQTT::PMqttClient Mqtt;
+    std::string Device;
+    std::chrono::seconds Interval;
+    std::chrono::steady_clock::time_point LastPublish;
+    bool MetaPublished;
+    std::vector<TCounter> Counters;
+};
+
+typedef std::shared_ptr<TStatsPublisher> PStatsPublisher;
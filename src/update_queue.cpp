@@ -0,0 +1,116 @@
+#include "update_queue.h"
+
+#include "observer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+TUpdateQueue::TUpdateQueue(size_t capacity)
+    : Head(0),
+      Tail(0),
+      Queued(0),
+      Coalesced(0),
+      Overflows(0),
+      Applied(0),
+      MaxBatch(0)
+{
+    // ring needs at least two cells to tell full cell from free one
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    Cells = vector<TCell>(size);
+    Mask = size - 1;
+
+    for (size_t i = 0; i < size; ++i)
+        Cells[i].Sequence.store(i, memory_order_relaxed);
+}
+
+void TUpdateQueue::SetWakeup(function<void()> wakeup)
+{
+    Wakeup = wakeup;
+}
+
+bool TUpdateQueue::Push(TGatewayObserver* observer)
+{
+    // bounded MPMC ring: cell sequence tells whether cell is free for this lap
+    size_t pos = Head.load(memory_order_relaxed);
+    TCell* cell;
+
+    for (;;) {
+        cell = &Cells[pos & Mask];
+        const size_t sequence = cell->Sequence.load(memory_order_acquire);
+        const intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+
+        if (diff == 0) {
+            if (Head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = Head.load(memory_order_relaxed);
+        }
+    }
+
+    cell->Observer = observer;
+    cell->Sequence.store(pos + 1, memory_order_seq_cst);
+    Queued.fetch_add(1, memory_order_relaxed);
+
+    // drain has caught up with this cell, so nothing else will wake Modbus thread for it;
+    // pairs with tail store of drain, which either sees the cell or is seen here
+    if (Wakeup && Tail.load(memory_order_seq_cst) == pos)
+        Wakeup();
+
+    return true;
+}
+
+void TUpdateQueue::CountCoalesced()
+{
+    Coalesced.fetch_add(1, memory_order_relaxed);
+}
+
+void TUpdateQueue::CountOverflow()
+{
+    Overflows.fetch_add(1, memory_order_relaxed);
+}
+
+size_t TUpdateQueue::Drain()
+{
+    size_t pos = Tail.load(memory_order_relaxed);
+    size_t count = 0;
+
+    // only Modbus thread takes values, so tail is not contended; observers queued
+    // again during drain wait for the next one if queue is flooded
+    while (count <= Mask) {
+        TCell& cell = Cells[pos & Mask];
+        if (cell.Sequence.load(memory_order_acquire) != pos + 1)
+            break;
+
+        TGatewayObserver* observer = cell.Observer;
+        cell.Sequence.store(pos + Mask + 1, memory_order_release);
+        Tail.store(++pos, memory_order_seq_cst);
+
+        observer->ApplyQueued();
+        ++count;
+    }
+
+    // values pushed meanwhile didn't wake Modbus thread, as queue wasn't empty
+    if (count > Mask && Wakeup)
+        Wakeup();
+
+    Applied += count;
+    MaxBatch = max(MaxBatch, count);
+
+    return count;
+}
+
+TUpdateQueue::TStats TUpdateQueue::GetStats() const
+{
+    return TStats{Queued.load(memory_order_relaxed),
+                  Coalesced.load(memory_order_relaxed),
+                  Overflows.load(memory_order_relaxed),
+                  Applied,
+                  Head.load(memory_order_relaxed) - Tail.load(memory_order_relaxed),
+                  MaxBatch};
+}
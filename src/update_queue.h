@@ -0,0 +1,83 @@
+#pragma once
+
+/*!
+ * \file update_queue.h
+ * \brief Queue of MQTT updates waiting for conversion to cache
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class TGatewayObserver;
+
+/*! Bounded lock-free queue of observers with new MQTT values
+ * Observer keeps only the latest received payload and is queued once until
+ * it is applied, so burst of messages for register is converted to cache once
+ * per drain. Queue is drained by Modbus thread between queries and wakes it
+ * up when first value comes to empty queue.
+ */
+class TUpdateQueue
+{
+public:
+    /*! Queue counters */
+    struct TStats
+    {
+        uint64_t Queued;    /*!< Observers queued */
+        uint64_t Coalesced; /*!< Messages replaced by later ones before drain */
+        uint64_t Overflows; /*!< Messages applied by MQTT thread as queue was full */
+        uint64_t Applied;   /*!< Values applied by drain */
+        size_t Depth;       /*!< Observers waiting now */
+        size_t MaxBatch;    /*!< Maximum number of values applied by one drain */
+    };
+
+    /*! Create queue
+     * \param capacity Number of observers queue can hold, rounded up to power of 2, at least 2
+     */
+    explicit TUpdateQueue(size_t capacity);
+
+    /*! Set function waking up Modbus thread, called before MQTT thread starts */
+    void SetWakeup(std::function<void()> wakeup);
+
+    /*! Queue observer (MQTT thread)
+     * \return false if queue is full, observer must apply value itself
+     */
+    bool Push(TGatewayObserver* observer);
+
+    /*! Count message which replaced queued one (MQTT thread) */
+    void CountCoalesced();
+
+    /*! Count message applied without queue (MQTT thread) */
+    void CountOverflow();
+
+    /*! Apply values of all queued observers (Modbus thread)
+     * \return Number of applied values
+     */
+    size_t Drain();
+
+    /*! Get counters (Modbus thread) */
+    TStats GetStats() const;
+
+private:
+    struct TCell
+    {
+        std::atomic<size_t> Sequence;
+        TGatewayObserver* Observer;
+    };
+
+    std::vector<TCell> Cells;
+    size_t Mask;
+    std::function<void()> Wakeup;
+
+    alignas(64) std::atomic<size_t> Head;
+    alignas(64) std::atomic<size_t> Tail;
+
+    std::atomic<uint64_t> Queued, Coalesced, Overflows;
+    uint64_t Applied;
+    size_t MaxBatch;
+};
+
+typedef std::shared_ptr<TUpdateQueue> PUpdateQueue;
@@ -276,3 +276,66 @@ TEST_F(TAddressRangeTest, ShiftTest)
     r2 -= 10;
     EXPECT_EQ(r, r2);
 }
+
+TEST_F(TAddressRangeTest, CoversTest)
+{
+    TestAddressRange r = TestAddressRange(0, 5, 1) + TestAddressRange(5, 5, 2) + TestAddressRange(20, 5, 3);
+
+    EXPECT_TRUE(r.covers(0, 10));
+    EXPECT_TRUE(r.covers(3, 4));
+    EXPECT_TRUE(r.covers(20, 5));
+    EXPECT_FALSE(r.covers(5, 10));
+    EXPECT_FALSE(r.covers(12, 1));
+    EXPECT_FALSE(r.covers(30, 1));
+    EXPECT_FALSE(r.covers(-1, 2));
+    EXPECT_FALSE(r.covers(0, 0));
+    EXPECT_FALSE(TestAddressRange().covers(0, 1));
+
+    std::vector<int> params;
+    EXPECT_TRUE(r.forEachSegment(2, 6, [&](int start, int count, const int& param) {
+        params.push_back(param);
+        return true;
+    }));
+    EXPECT_THAT(params, ElementsAre(1, 2));
+
+    EXPECT_FALSE(r.forEachSegment(8, 14, [&](int start, int count, const int& param) {
+        ADD_FAILURE() << "must not be called on sparse area";
+        return true;
+    }));
+}
+
+TEST_F(TAddressRangeTest, IntersectionVisitTest)
+{
+    TestAddressRange r = TestAddressRange(0, 5, 1) + TestAddressRange(10, 5, 2) + TestAddressRange(20, 5, 3);
+
+    std::vector<TestAddressRange> parts;
+    r.forEachIntersection(3, 20, [&](int start, int count, const int& param) {
+        parts.push_back(TestAddressRange(start, count, param));
+        return true;
+    });
+    EXPECT_THAT(parts, ElementsAre(TestAddressRange(3, 2, 1), TestAddressRange(10, 5, 2), TestAddressRange(20, 3, 3)));
+
+    parts.clear();
+    r.forEachIntersection(5, 5, [&](int start, int count, const int& param) {
+        parts.push_back(TestAddressRange(start, count, param));
+        return true;
+    });
+    EXPECT_TRUE(parts.empty());
+}
+
+TEST_F(TAddressRangeTest, EraseTest)
+{
+    TestAddressRange test_range;
+
+    test_range.insert(0, 10, 1);
+    test_range.insert(10, 5, 2);
+    test_range.insert(20, 5, 1);
+
+    EXPECT_TRUE(test_range.erase(1));
+    EXPECT_FALSE(test_range.erase(1));
+    EXPECT_EQ(test_range, TestAddressRange(10, 5, 2));
+
+    // freed addresses may be taken by another param
+    test_range.insert(0, 10, 3);
+    EXPECT_EQ(test_range.getParam(5), 3);
+}
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+
+#include "cache_snapshot.h"
+
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+class TModbusCacheSnapshotTest: public ::testing::Test
+{
+protected:
+    std::string Path = "/tmp/wb-mqtt-mbgate-test-" + std::to_string(getpid()) + ".snapshot";
+
+    void TearDown()
+    {
+        std::remove(Path.c_str());
+    }
+};
+
+TEST_F(TModbusCacheSnapshotTest, RestoreTest)
+{
+    uint16_t regs[] = {0x1234, 0x5678};
+    // cache keeps coils packed, file keeps them one per byte
+    uint8_t coils[] = {0x05};
+
+    {
+        TModbusCacheSnapshot snapshot(Path, 42, std::chrono::seconds(10));
+        snapshot.Attach({{1, COIL, 0, 3, coils}, {1, HOLDING_REGISTER, 100, 2, regs}});
+
+        regs[1] = 0x4321;
+        snapshot.Save(true);
+    }
+
+    // same config gets last saved values
+    uint16_t restored_regs[2] = {};
+    uint8_t restored_coils[1] = {};
+    {
+        TModbusCacheSnapshot snapshot(Path, 42, std::chrono::seconds(10));
+        snapshot.Attach({{1, COIL, 0, 3, restored_coils}, {1, HOLDING_REGISTER, 100, 2, restored_regs}});
+
+        EXPECT_EQ(restored_regs[0], 0x1234);
+        EXPECT_EQ(restored_regs[1], 0x4321);
+        EXPECT_EQ(restored_coils[0], 0x05);
+
+        // values are restored on start only
+        restored_regs[0] = 0;
+        snapshot.Attach({{1, HOLDING_REGISTER, 100, 2, restored_regs}});
+        EXPECT_EQ(restored_regs[0], 0);
+    }
+
+    // changed config or layout is not restored
+    uint16_t other_regs[2] = {};
+    {
+        TModbusCacheSnapshot snapshot(Path, 43, std::chrono::seconds(10));
+        snapshot.Attach({{1, HOLDING_REGISTER, 100, 2, other_regs}});
+        EXPECT_EQ(other_regs[1], 0);
+
+        other_regs[1] = 0x1111;
+        snapshot.Save(true);
+    }
+    other_regs[1] = 0;
+    {
+        TModbusCacheSnapshot snapshot(Path, 43, std::chrono::seconds(10));
+        snapshot.Attach({{1, HOLDING_REGISTER, 101, 2, other_regs}});
+        EXPECT_EQ(other_regs[1], 0);
+    }
+}
@@ -0,0 +1,115 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "modbus_encoder.h"
+
+#include <cstring>
+#include <vector>
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+
+TEST(ModbusEncoderTest, RegistersTest)
+{
+    const uint16_t regs[] = {0x0102, 0x0304, 0x0506, 0x0708, 0x090A, 0xABCD};
+    uint8_t out[sizeof(regs)];
+
+    ModbusEncoder::PackRegisters(out, regs, 6);
+    EXPECT_THAT(out, ElementsAre(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0xAB, 0xCD));
+
+    uint16_t back[6];
+    ModbusEncoder::UnpackRegisters(back, out, 6);
+    EXPECT_THAT(back, ElementsAreArray(regs));
+}
+
+TEST(ModbusEncoderTest, BitsTest)
+{
+    // any non-zero value is 1
+    const uint8_t bits[] = {1, 0, 0xFF, 0, 0, 0, 0, 0x80, 0, 1, 1};
+    uint8_t out[2] = {0xAA, 0xAA};
+
+    ModbusEncoder::PackBits(out, bits, sizeof(bits));
+    EXPECT_THAT(out, ElementsAre(0x85, 0x06));
+
+    uint8_t back[11];
+    ModbusEncoder::UnpackBits(back, out, sizeof(back));
+    EXPECT_THAT(back, ElementsAre(1, 0, 1, 0, 0, 0, 0, 1, 0, 1, 1));
+
+    ModbusEncoder::UnpackBits(back, out, sizeof(back), 0xFF);
+    EXPECT_THAT(back, ElementsAre(0xFF, 0, 0xFF, 0, 0, 0, 0, 0xFF, 0, 0xFF, 0xFF));
+}
+
+TEST(ModbusEncoderTest, ShiftedBitsTest)
+{
+    // 80 items from bit 3 of packed cache, the rest of bytes belongs to other items
+    uint8_t items[80];
+    for (size_t i = 0; i < sizeof(items); ++i)
+        items[i] = (i % 3 == 0) ? 0xFF : 0;
+
+    uint8_t packed[11];
+    memset(packed, 0xA5, sizeof(packed));
+    ModbusEncoder::StoreBits(packed, 3, items, sizeof(items));
+
+    EXPECT_EQ(packed[0] & 0x07, 0x05);
+    EXPECT_EQ(packed[10] & 0xF8, 0xA0);
+
+    uint8_t back[80];
+    ModbusEncoder::LoadBits(back, packed, 3, sizeof(back));
+    for (size_t i = 0; i < sizeof(back); ++i)
+        EXPECT_EQ(back[i], items[i] ? 1 : 0) << "item " << i;
+
+    // stream starts from bit 0, unused bits of last byte are zero
+    uint8_t stream[10], expected[10];
+    ModbusEncoder::PackBits(expected, items, 75);
+    ModbusEncoder::CopyBits(stream, packed, 3, 75);
+    EXPECT_THAT(stream, ElementsAreArray(expected));
+
+    ModbusEncoder::CopyBits(stream, packed + 1, 0, 3);
+    EXPECT_EQ(stream[0], (packed[1] & 0x07));
+}
+
+TEST(ModbusEncoderTest, ReplyTest)
+{
+    uint8_t pdu[ModbusEncoder::MAX_PDU_LENGTH];
+
+    const uint16_t regs[] = {0x1234, 0x5678};
+    ASSERT_EQ(ModbusEncoder::EncodeReadRegisters(pdu, 0x03, regs, 2), 6);
+    EXPECT_THAT(std::vector<uint8_t>(pdu, pdu + 6), ElementsAre(0x03, 0x04, 0x12, 0x34, 0x56, 0x78));
+
+    // packed cache holds items from bit 6
+    const uint8_t bits[] = {0xC0, 0xFE};
+    ASSERT_EQ(ModbusEncoder::EncodeReadBits(pdu, 0x01, bits, 6, 3), 3);
+    EXPECT_THAT(std::vector<uint8_t>(pdu, pdu + 3), ElementsAre(0x01, 0x01, 0x03));
+
+    ASSERT_EQ(ModbusEncoder::EncodeException(pdu, 0x03, 0x02), 2);
+    EXPECT_THAT(std::vector<uint8_t>(pdu, pdu + 2), ElementsAre(0x83, 0x02));
+}
+
+TEST(ModbusEncoderTest, CrcTest)
+{
+    // read 2 holding registers from 0 of unit 1: 01 03 00 00 00 02 C4 0B
+    const uint8_t adu[] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x02};
+
+    EXPECT_EQ(ModbusEncoder::Crc16(adu, sizeof(adu)), 0x0BC4);
+    EXPECT_EQ(ModbusEncoder::Crc16Update(ModbusEncoder::Crc16(adu, 1), adu + 1, sizeof(adu) - 1), 0x0BC4);
+}
+
+TEST(ModbusEncoderTest, RequestLengthTest)
+{
+    // function code, meta part and data part add up to whole request PDU
+    const std::vector<std::vector<uint8_t>> requests = {
+        {0x03, 0x00, 0x00, 0x00, 0x02},
+        {0x08, 0x00, 0x0B, 0x00, 0x00},
+        {0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78},
+        {0x15, 0x09, 0x06, 0x00, 0x03, 0x00, 0x01, 0x00, 0x01, 0x21, 0x21},
+        {0x16, 0x00, 0x04, 0xFF, 0xEE, 0x00, 0x01},
+        {0x17, 0x00, 0x01, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x02, 0x12, 0x34},
+        {0x18, 0x00, 0x0A},
+        {0x11},
+    };
+
+    for (const auto& r: requests) {
+        const size_t meta = ModbusEncoder::RequestMetaLength(r[0]);
+        EXPECT_EQ(1 + meta + ModbusEncoder::RequestDataLength(r.data()), r.size()) << "function " << int(r[0]);
+    }
+}
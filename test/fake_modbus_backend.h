@@ -1,8 +1,13 @@
 #pragma once
 
+#include "modbus_query_ring.h"
 #include "modbus_wrapper.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <map>
 #include <queue>
+#include <vector>
 
 class TFakeModbusBackend: public IModbusBackend
 {
@@ -10,15 +15,12 @@ public:
     virtual ~TFakeModbusBackend()
     {
         for (auto& slave: Caches) {
-            for (auto& item: slave.second) {
-                if (item.second) {
-                    if (item.first == COIL || item.first == DISCRETE_INPUT)
-                        delete[] static_cast<uint8_t*>(item.second);
-                    else
-                        delete[] static_cast<uint16_t*>(item.second);
-                }
-            }
+            for (auto& item: slave.second)
+                FreeCache(item.first, item.second);
         }
+
+        for (auto& item: RetiredCaches)
+            FreeCache(item.first, item.second);
     }
 
     virtual void SetSlave(uint8_t slave_id)
@@ -37,38 +39,53 @@ public:
     virtual void Listen()
     {}
 
-    /*! Allocate cache areas for this instance and given slave ID
+    /*! Allocate cache for observed addresses, fake backend keeps dense cache up to the last address
+     *  with bits packed 8 per byte
+     */
+    virtual void AllocateCache(uint8_t slave_id, TStoreType type, const TModbusAddressSet& addresses)
+    {
+        if (addresses.cbegin() == addresses.cend())
+            return;
+
+        if (type == COIL || type == DISCRETE_INPUT)
+            GrowCache<uint8_t>(slave_id, type, (addresses.getEnd() + 7) / 8);
+        else
+            GrowCache<uint16_t>(slave_id, type, addresses.getEnd());
+    }
+
+    /*! Allocate cache areas for given slave ID
      * \param slave_id Slave ID
      * \param di Number of discrete inputs
      * \param co Number of coils
      * \param ir Number of input registers (2 bytes per register, so ir * 2 bytes will be allocated)
      * \param hr Number of holding registers
      */
-    virtual void AllocateCache(uint8_t slave_id, size_t di, size_t co, size_t ir, size_t hr)
+    void AllocateCache(uint8_t slave_id, size_t di, size_t co, size_t ir, size_t hr)
     {
-        if (!Caches[slave_id].empty())
-            return; // no reallocation
-
-        Caches[slave_id][DISCRETE_INPUT] = new uint8_t[di];
-        Caches[slave_id][COIL] = new uint8_t[co];
-        Caches[slave_id][INPUT_REGISTER] = new uint16_t[ir];
-        Caches[slave_id][HOLDING_REGISTER] = new uint16_t[hr];
+        GrowCache<uint8_t>(slave_id, DISCRETE_INPUT, (di + 7) / 8);
+        GrowCache<uint8_t>(slave_id, COIL, (co + 7) / 8);
+        GrowCache<uint16_t>(slave_id, INPUT_REGISTER, ir);
+        GrowCache<uint16_t>(slave_id, HOLDING_REGISTER, hr);
     }
 
-    /*! Get cache base address
+    /*! Get cache address of item
      * \param type Store type we want to get cache for
-     * \return Pointer to cache base address
+     * \return Pointer to cached item or nullptr if cache is not allocated
      */
-    virtual void* GetCache(TStoreType type, uint8_t slave_id = 0)
+    virtual void* GetCache(TStoreType type, uint8_t slave_id = 0, int address = 0)
     {
-        if (Caches.find(slave_id) == Caches.end())
-            throw TModbusException(std::string("Cache for slave id ") + std::to_string(slave_id) + " is not allocated");
+        if (Caches.find(slave_id) == Caches.end() || !Caches[slave_id][type])
+            return nullptr;
+
+        if (type == COIL || type == DISCRETE_INPUT)
+            return static_cast<uint8_t*>(Caches[slave_id][type]) + address / 8;
 
-        return Caches[slave_id][type];
+        return static_cast<uint16_t*>(Caches[slave_id][type]) + address;
     }
 
     virtual int WaitForMessages(int timeout = -1)
     {
+        LastWaitTimeout = timeout;
         return IncomingQueries.size();
     }
 
@@ -80,12 +97,18 @@ public:
         if (!IncomingQueries.empty()) {
             auto ret = IncomingQueries.front();
             IncomingQueries.pop();
+            ++BusCounters.Messages;
             return ret;
         }
 
         return TModbusQuery::emptyQuery();
     }
 
+    virtual void ReleaseQuery(const TModbusQuery& query)
+    {
+        ++ReleasedQueries;
+    }
+
     virtual bool Available()
     {
         return !IncomingQueries.empty();
@@ -94,12 +117,20 @@ public:
     virtual void Close()
     {}
 
+    virtual void Wakeup()
+    {
+        ++Wakeups;
+    }
+
     /*! Send reply
      * \param query Query to reply on
+     * \param pdu Reply PDU
+     * \param size Reply PDU size
      */
-    virtual void Reply(const TModbusQuery& query)
+    virtual void Reply(const TModbusQuery& query, const uint8_t* pdu, size_t size)
     {
         RepliedQueries.push(query);
+        RepliedPdus.push(std::vector<uint8_t>(pdu, pdu + size));
     }
 
     /*! Send exception reply
@@ -107,7 +138,19 @@ public:
      */
     virtual void ReplyException(TReplyState state, const TModbusQuery& query)
     {
+        ++BusCounters.Exceptions;
         RepliedQueries.push(TModbusQuery::exceptionQuery(state));
+        RepliedPdus.push({uint8_t(query.data[query.header_length] | 0x80), uint8_t(state)});
+    }
+
+    virtual const TModbusBusCounters& GetBusCounters()
+    {
+        return BusCounters;
+    }
+
+    virtual void ClearBusCounters()
+    {
+        BusCounters = TModbusBusCounters();
     }
 
     /*! Get last error code */
@@ -132,9 +175,94 @@ public:
 
 public:
     std::map<uint8_t, std::map<TStoreType, void*>> Caches;
+    std::map<uint8_t, std::map<TStoreType, size_t>> CacheSizes;
+    std::vector<std::pair<TStoreType, void*>> RetiredCaches;
     std::queue<TModbusQuery> IncomingQueries;
     std::queue<TModbusQuery> RepliedQueries;
+    std::queue<std::vector<uint8_t>> RepliedPdus;
+    int ReleasedQueries = 0;
+    std::atomic<int> Wakeups = 0;
+    int LastWaitTimeout = 0;
+    TModbusBusCounters BusCounters;
 
 protected:
     uint8_t _slaveId;
+
+    /*! Grow cache keeping values, old cache is kept until destruction */
+    template<typename T> void GrowCache(uint8_t slave_id, TStoreType type, size_t size)
+    {
+        size_t& current_size = CacheSizes[slave_id][type];
+        void*& cache = Caches[slave_id][type];
+
+        if (cache && size <= current_size)
+            return;
+
+        T* grown = new T[size]();
+        if (cache) {
+            std::copy_n(static_cast<T*>(cache), current_size, grown);
+            RetiredCaches.emplace_back(type, cache);
+        }
+
+        cache = grown;
+        current_size = size;
+    }
+
+    static void FreeCache(TStoreType type, void* cache)
+    {
+        if (type == COIL || type == DISCRETE_INPUT)
+            delete[] static_cast<uint8_t*>(cache);
+        else
+            delete[] static_cast<uint16_t*>(cache);
+    }
+};
+
+/*! Fake backend receiving queries into ring of slots, like libmodbus backend does */
+class TRingModbusBackend: public TFakeModbusBackend
+{
+public:
+    TRingModbusBackend(size_t slots): Ring(slots, 260 /* maximum ADU length */)
+    {}
+
+    virtual int WaitForMessages(int timeout = -1)
+    {
+        LastWaitTimeout = timeout;
+        return Ring.Available();
+    }
+
+    virtual TModbusQuery ReceiveQuery(bool block = false)
+    {
+        if (!Ring.Available())
+            return TModbusQuery::emptyQuery();
+
+        ++BusCounters.Messages;
+        return Ring.Pop();
+    }
+
+    virtual void ReleaseQuery(const TModbusQuery& query)
+    {
+        TFakeModbusBackend::ReleaseQuery(query);
+        Ring.Release(query);
+    }
+
+    virtual bool Available()
+    {
+        return Ring.Available();
+    }
+
+    /*! Receive query into free slot
+     * \param socket_fd Client socket, to tell clients apart in replies
+     * \return false if all slots are occupied
+     */
+    bool ReceiveIntoRing(const uint8_t* data, size_t size, int socket_fd = -1)
+    {
+        uint8_t* buffer = Ring.Acquire();
+        if (!buffer)
+            return false;
+
+        std::memcpy(buffer, data, size);
+        Ring.Commit(size, 0, socket_fd);
+        return true;
+    }
+
+    TModbusQueryRing Ring;
 };
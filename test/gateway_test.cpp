@@ -2,12 +2,17 @@
 #include "mock_mqtt_client.h"
 #include "modbus_wrapper.h"
 #include "observer.h"
+#include "register_group.h"
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <string>
+#include <thread>
 
 using namespace std;
 using namespace WBMQTT;
@@ -128,3 +133,631 @@ TEST_F(GatewayTest, CoilWriteTest)
     while (!ModbusBackend->IncomingQueries.empty())
         ModbusServer->Loop();
 }
+
+TEST_F(GatewayTest, MaskWriteTest)
+{
+    uint16_t* regs = static_cast<uint16_t*>(ModbusBackend->GetCache(HOLDING_REGISTER));
+    regs[0] = 0x0012;
+
+    // Mask Write Register 0: AND 0x00F2, OR 0x0025 gives 0x0017 (23d)
+    uint8_t q1[] = {0x16, 0x00, 0x00, 0x00, 0xF2, 0x00, 0x25};
+    TModbusQuery query1(q1, sizeof(q1), 0);
+    ModbusBackend->PushQuery(query1);
+
+    EXPECT_CALL(*Mqtt,
+                Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/device1/controls/topic1/on"),
+                              Field(&TMqttMessage::Payload, "23"))));
+
+    while (!ModbusBackend->IncomingQueries.empty())
+        ModbusServer->Loop();
+
+    EXPECT_EQ(regs[0], 0x0017);
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x16, 0x00, 0x00, 0x00, 0xF2, 0x00, 0x25));
+}
+
+TEST_F(GatewayTest, ReadFifoTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/fifo"))).WillOnce(SaveArg<0>(&handler));
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto fifo_observer = make_shared<TGatewayObserver>("/devices/device1/fifo", conv, Mqtt, 3);
+    ModbusServer->Observe(fifo_observer, TStoreType::HOLDING_REGISTER, TModbusAddressRange(10, 1));
+    ModbusServer->AllocateCache();
+
+    // oldest value is dropped when FIFO is full
+    for (auto value: {"1", "2", "3", "4"})
+        handler(TMqttMessage("/devices/device1/fifo", value, 0, true));
+
+    // drain FIFO, read it again when it's empty, read register without FIFO
+    uint8_t q1[] = {0x18, 0x00, 0x0A};
+    uint8_t q2[] = {0x18, 0x00, 0x00};
+    ModbusBackend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+
+    while (!ModbusBackend->IncomingQueries.empty())
+        ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 3);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(),
+                ElementsAre(0x18, 0x00, 0x08, 0x00, 0x03, 0x00, 0x02, 0x00, 0x03, 0x00, 0x04));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x18, 0x00, 0x02, 0x00, 0x00));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x98, REPLY_ILLEGAL_ADDRESS));
+}
+
+TEST_F(GatewayTest, ReloadTest)
+{
+    TMqttMessageHandler kept_handler, added_handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/kept")))
+        .WillOnce(SaveArg<0>(&kept_handler));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/added")))
+        .WillOnce(SaveArg<0>(&added_handler));
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto kept = make_shared<TGatewayObserver>("/devices/device1/kept", conv, Mqtt);
+    ModbusServer->Observe(kept, TStoreType::HOLDING_REGISTER, TModbusAddressRange(20, 1));
+    ModbusServer->AllocateCache();
+
+    kept_handler(TMqttMessage("/devices/device1/kept", "4660", 0, true));
+
+    // remove one register and add another one out of allocated cache,
+    // retained value of new register comes before cache allocation
+    ModbusServer->Unobserve(observers[1]);
+
+    auto added = make_shared<TGatewayObserver>("/devices/device1/added", conv, Mqtt);
+    ModbusServer->Observe(added, TStoreType::HOLDING_REGISTER, TModbusAddressRange(150, 1));
+    added_handler(TMqttMessage("/devices/device1/added", "22136", 0, true));
+
+    ModbusServer->AllocateCache();
+
+    uint8_t q1[] = {0x03, 0x00, 0x14, 0x00, 0x01};
+    uint8_t q2[] = {0x03, 0x00, 0x96, 0x00, 0x01};
+    uint8_t q3[] = {0x03, 0x00, 0x01, 0x00, 0x01};
+    ModbusBackend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+
+    while (!ModbusBackend->IncomingQueries.empty())
+        ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 3);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x03, 0x02, 0x12, 0x34));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x03, 0x02, 0x56, 0x78));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x83, REPLY_ILLEGAL_ADDRESS));
+}
+
+TEST_F(GatewayTest, TornReadStressTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/counter")))
+        .WillOnce(SaveArg<0>(&handler));
+
+    // 64-bit value in 4 registers
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 8);
+    auto counter = make_shared<TGatewayObserver>("/devices/device1/counter", conv, Mqtt);
+    ModbusServer->Observe(counter, TStoreType::HOLDING_REGISTER, TModbusAddressRange(20, 4));
+    ModbusServer->AllocateCache();
+
+    // MQTT thread flips all bits of value while Modbus thread reads it
+    atomic<bool> done(false);
+    thread writer([&] {
+        for (bool odd = false; !done; odd = !odd)
+            handler(TMqttMessage("/devices/device1/counter", odd ? "18446744073709551615" : "0", 0, false));
+    });
+
+    uint8_t q[] = {0x03, 0x00, 0x14, 0x00, 0x04};
+    int torn = 0;
+
+    for (int i = 0; i < 20000; ++i) {
+        ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+        ModbusServer->Loop();
+
+        const auto& pdu = ModbusBackend->RepliedPdus.front();
+        if (pdu.size() != 10 || !all_of(pdu.begin() + 2, pdu.end(), [&](uint8_t b) { return b == pdu[2]; }))
+            ++torn;
+
+        ModbusBackend->RepliedPdus.pop();
+        ModbusBackend->RepliedQueries.pop();
+    }
+
+    done = true;
+    writer.join();
+
+    EXPECT_EQ(torn, 0);
+}
+
+TEST_F(GatewayTest, RegisterGroupTriggerTest)
+{
+    TMqttMessageHandler voltage_handler, time_handler, trigger_handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/voltage")))
+        .WillOnce(SaveArg<0>(&voltage_handler));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/time")))
+        .WillOnce(SaveArg<0>(&time_handler));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/commit")))
+        .WillOnce(SaveArg<0>(&trigger_handler));
+
+    auto group = make_shared<TRegisterGroup>("meter", chrono::milliseconds(0), "/devices/device1/commit", Mqtt);
+    ModbusServer->SetRegisterGroups({group});
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto voltage = make_shared<TGatewayObserver>("/devices/device1/voltage", conv, Mqtt);
+    auto time = make_shared<TGatewayObserver>("/devices/device1/time", conv, Mqtt);
+    voltage->SetGroup(group);
+    time->SetGroup(group);
+    ModbusServer->Observe(voltage, TStoreType::HOLDING_REGISTER, TModbusAddressRange(30, 1));
+    ModbusServer->Observe(time, TStoreType::HOLDING_REGISTER, TModbusAddressRange(31, 1));
+    ModbusServer->AllocateCache();
+
+    uint8_t q[] = {0x03, 0x00, 0x1E, 0x00, 0x02};
+
+    // trigger without staged values does nothing
+    trigger_handler(TMqttMessage("/devices/device1/commit", "", 0, false));
+
+    voltage_handler(TMqttMessage("/devices/device1/voltage", "230", 0, false));
+    time_handler(TMqttMessage("/devices/device1/time", "1", 0, false));
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    // later update of staged value replaces it
+    voltage_handler(TMqttMessage("/devices/device1/voltage", "231", 0, false));
+    trigger_handler(TMqttMessage("/devices/device1/commit", "", 0, false));
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 2);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x03, 0x04, 0x00, 0x00, 0x00, 0x00));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x03, 0x04, 0x00, 0xE7, 0x00, 0x01));
+    EXPECT_EQ(group->GetGeneration(), 1);
+}
+
+TEST_F(GatewayTest, RegisterGroupWindowTest)
+{
+    TMqttMessageHandler phase_handlers[2];
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/l1")))
+        .WillOnce(SaveArg<0>(&phase_handlers[0]));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/l2")))
+        .WillOnce(SaveArg<0>(&phase_handlers[1]));
+
+    auto group = make_shared<TRegisterGroup>("phases", chrono::milliseconds(20), "", Mqtt);
+    ModbusServer->SetRegisterGroups({group});
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto l1 = make_shared<TGatewayObserver>("/devices/device1/l1", conv, Mqtt);
+    auto l2 = make_shared<TGatewayObserver>("/devices/device1/l2", conv, Mqtt);
+    l1->SetGroup(group);
+    l2->SetGroup(group);
+    ModbusServer->Observe(l1, TStoreType::INPUT_REGISTER, TModbusAddressRange(0, 1));
+    ModbusServer->Observe(l2, TStoreType::INPUT_REGISTER, TModbusAddressRange(1, 1));
+    ModbusServer->AllocateCache();
+
+    phase_handlers[0](TMqttMessage("/devices/device1/l1", "1", 0, false));
+    phase_handlers[1](TMqttMessage("/devices/device1/l2", "2", 0, false));
+
+    EXPECT_FALSE(group->Commit());
+
+    // first staged value wakes server up, so it waits no longer than window
+    EXPECT_EQ(ModbusBackend->Wakeups, 1);
+    ModbusServer->Loop(1000);
+    EXPECT_LE(ModbusBackend->LastWaitTimeout, 20);
+    this_thread::sleep_for(chrono::milliseconds(30));
+
+    // idle server commits group when window has elapsed
+    ModbusServer->Loop();
+    EXPECT_EQ(group->GetGeneration(), 1);
+
+    uint8_t q[] = {0x04, 0x00, 0x00, 0x00, 0x02};
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x04, 0x04, 0x00, 0x01, 0x00, 0x02));
+}
+
+TEST_F(GatewayTest, WriteAckTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/valve")))
+        .WillOnce(SaveArg<0>(&handler));
+
+    auto stats = make_shared<TWriteAckStats>();
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto valve = make_shared<TGatewayObserver>("/devices/device1/controls/valve", conv, Mqtt);
+    valve->SetWriteAck(chrono::seconds(10), stats);
+    ModbusServer->Observe(valve, TStoreType::HOLDING_REGISTER, TModbusAddressRange(40, 1));
+    ModbusServer->AllocateCache();
+
+    // write waits for echo, other client is served meanwhile
+    uint8_t write[] = {0x06, 0x00, 0x28, 0x00, 0x07};
+    uint8_t read[] = {0x03, 0x00, 0x00, 0x00, 0x01};
+    ModbusBackend->PushQuery(TModbusQuery(write, sizeof(write), 0));
+    ModbusBackend->PushQuery(TModbusQuery(read, sizeof(read), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_EQ(ModbusBackend->RepliedPdus.front()[0], 0x03);
+    ModbusBackend->RepliedPdus.pop();
+    // deferred reply keeps its own copy of query
+    EXPECT_EQ(ModbusBackend->ReleasedQueries, 2);
+
+    // other value is not an echo
+    handler(TMqttMessage("/devices/device1/controls/valve", "6", 0, false));
+    ModbusServer->Loop();
+    EXPECT_TRUE(ModbusBackend->RepliedPdus.empty());
+
+    handler(TMqttMessage("/devices/device1/controls/valve", "7.0", 0, false));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x06, 0x00, 0x28, 0x00, 0x07));
+    EXPECT_EQ(ModbusBackend->ReleasedQueries, 2);
+    EXPECT_EQ(stats->Acked, 1);
+    EXPECT_EQ(stats->Timeouts, 0);
+}
+
+TEST_F(GatewayTest, WriteAckCoilTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/pump")))
+        .WillOnce(SaveArg<0>(&handler));
+
+    auto stats = make_shared<TWriteAckStats>();
+    PMQTTConverter conv = make_shared<TMQTTDiscrConverter>();
+    auto pump = make_shared<TGatewayObserver>("/devices/device1/controls/pump", conv, Mqtt);
+    pump->SetWriteAck(chrono::seconds(10), stats);
+    ModbusServer->Observe(pump, TStoreType::COIL, TModbusAddressRange(10, 1));
+    ModbusServer->AllocateCache();
+
+    uint8_t write[] = {0x05, 0x00, 0x0A, 0xFF, 0x00};
+    ModbusBackend->PushQuery(TModbusQuery(write, sizeof(write), 0));
+    ModbusServer->Loop();
+    EXPECT_TRUE(ModbusBackend->RepliedPdus.empty());
+
+    handler(TMqttMessage("/devices/device1/controls/pump", "1", 0, false));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x05, 0x00, 0x0A, 0xFF, 0x00));
+    EXPECT_EQ(stats->Acked, 1);
+    EXPECT_EQ(stats->Timeouts, 0);
+}
+
+TEST_F(GatewayTest, WriteAckRingTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/valve")))
+        .WillOnce(SaveArg<0>(&handler));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/level")));
+
+    auto backend = make_shared<TRingModbusBackend>(4);
+    auto server = make_shared<TModbusServer>(backend);
+    backend->AllocateCache(0, 100, 100, 100, 100);
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto valve = make_shared<TGatewayObserver>("/devices/device1/controls/valve", conv, Mqtt);
+    valve->SetWriteAck(chrono::seconds(10), make_shared<TWriteAckStats>());
+    server->Observe(valve, TStoreType::HOLDING_REGISTER, TModbusAddressRange(40, 1));
+    auto level = make_shared<TGatewayObserver>("/devices/device1/controls/level", conv, Mqtt);
+    server->Observe(level, TStoreType::HOLDING_REGISTER, TModbusAddressRange(0, 1));
+    server->AllocateCache();
+
+    uint8_t write[] = {0x06, 0x00, 0x28, 0x00, 0x07};
+    uint8_t read[] = {0x03, 0x00, 0x00, 0x00, 0x01};
+    ASSERT_TRUE(backend->ReceiveIntoRing(write, sizeof(write)));
+    server->Loop();
+    EXPECT_TRUE(backend->RepliedPdus.empty());
+
+    // pending write doesn't occupy slot, so more queries than slots are received meanwhile
+    for (size_t i = 0; i < backend->Ring.Size() * 2; ++i) {
+        ASSERT_TRUE(backend->ReceiveIntoRing(read, sizeof(read)));
+        server->Loop();
+
+        ASSERT_EQ(backend->RepliedPdus.size(), 1);
+        EXPECT_EQ(backend->RepliedPdus.front()[0], 0x03);
+        backend->RepliedPdus.pop();
+    }
+
+    handler(TMqttMessage("/devices/device1/controls/valve", "7", 0, false));
+    server->Loop();
+
+    ASSERT_EQ(backend->RepliedPdus.size(), 1);
+    EXPECT_THAT(backend->RepliedPdus.front(), ElementsAre(0x06, 0x00, 0x28, 0x00, 0x07));
+}
+
+TEST_F(GatewayTest, WriteAckTimeoutTest)
+{
+    auto stats = make_shared<TWriteAckStats>();
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto valve = make_shared<TGatewayObserver>("/devices/device1/controls/valve", conv, Mqtt);
+    valve->SetWriteAck(chrono::milliseconds(20), stats);
+    ModbusServer->Observe(valve, TStoreType::HOLDING_REGISTER, TModbusAddressRange(40, 1));
+    ModbusServer->AllocateCache();
+
+    uint8_t write[] = {0x10, 0x00, 0x28, 0x00, 0x01, 0x02, 0x00, 0x07};
+    ModbusBackend->PushQuery(TModbusQuery(write, sizeof(write), 0));
+    ModbusServer->Loop();
+    EXPECT_TRUE(ModbusBackend->RepliedQueries.empty());
+
+    this_thread::sleep_for(chrono::milliseconds(30));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedQueries.size(), 1);
+    EXPECT_EQ(ModbusBackend->RepliedQueries.front().size, -REPLY_GATEWAY_TARGET_FAILED);
+    EXPECT_EQ(ModbusBackend->ReleasedQueries, 1);
+    EXPECT_EQ(stats->Timeouts, 1);
+}
+
+TEST_F(GatewayTest, WriteAckOverlapTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/valve")))
+        .WillOnce(SaveArg<0>(&handler));
+
+    auto stats = make_shared<TWriteAckStats>();
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto valve = make_shared<TGatewayObserver>("/devices/device1/controls/valve", conv, Mqtt);
+    valve->SetWriteAck(chrono::milliseconds(20), stats);
+    ModbusServer->Observe(valve, TStoreType::HOLDING_REGISTER, TModbusAddressRange(40, 1));
+    ModbusServer->AllocateCache();
+
+    // each write waits for its own echo
+    uint8_t first[] = {0x06, 0x00, 0x28, 0x00, 0x07};
+    uint8_t second[] = {0x06, 0x00, 0x28, 0x00, 0x08};
+    ModbusBackend->PushQuery(TModbusQuery(first, sizeof(first), 0));
+    ModbusBackend->PushQuery(TModbusQuery(second, sizeof(second), 0));
+    ModbusServer->Loop();
+    EXPECT_TRUE(ModbusBackend->RepliedPdus.empty());
+
+    handler(TMqttMessage("/devices/device1/controls/valve", "7", 0, false));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x06, 0x00, 0x28, 0x00, 0x07));
+    ModbusBackend->RepliedPdus.pop();
+
+    // the second write is never echoed
+    this_thread::sleep_for(chrono::milliseconds(30));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x86, REPLY_GATEWAY_TARGET_FAILED));
+    EXPECT_EQ(stats->Acked, 1);
+    EXPECT_EQ(stats->Timeouts, 1);
+}
+
+TEST_F(GatewayTest, StaleReadTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/flow")))
+        .WillOnce(SaveArg<0>(&handler));
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto flow = make_shared<TGatewayObserver>("/devices/device1/controls/flow", conv, Mqtt);
+    flow->SetMaxAge(chrono::milliseconds(20), REPLY_SERVER_BUSY);
+    ModbusServer->Observe(flow, TStoreType::HOLDING_REGISTER, TModbusAddressRange(50, 1), 0, false);
+    ModbusServer->AllocateCache();
+
+    uint8_t q[] = {0x03, 0x00, 0x32, 0x00, 0x01};
+
+    // value never came from MQTT
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    handler(TMqttMessage("/devices/device1/controls/flow", "5", 0, false));
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    this_thread::sleep_for(chrono::milliseconds(30));
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 3);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x83, REPLY_SERVER_BUSY));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x03, 0x02, 0x00, 0x05));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x83, REPLY_SERVER_BUSY));
+}
+
+TEST_F(GatewayTest, StatusRegistersTest)
+{
+    TMqttMessageHandler handler, error_handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/flow")))
+        .WillOnce(SaveArg<0>(&handler));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/flow/meta/error")))
+        .WillOnce(SaveArg<0>(&error_handler));
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto flow = make_shared<TGatewayObserver>("/devices/device1/controls/flow", conv, Mqtt);
+    flow->SubscribeErrors();
+    ModbusServer->Observe(flow, TStoreType::INPUT_REGISTER, TModbusAddressRange(50, 1), 0, true);
+    ModbusServer->Observe(make_shared<TGatewayStatusObserver>(flow, TGatewayStatusObserver::AGE),
+                          TStoreType::INPUT_REGISTER,
+                          TModbusAddressRange(60, 1));
+    ModbusServer->Observe(make_shared<TGatewayStatusObserver>(flow, TGatewayStatusObserver::ERRORS),
+                          TStoreType::INPUT_REGISTER,
+                          TModbusAddressRange(61, 1));
+    ModbusServer->AllocateCache();
+
+    uint8_t q[] = {0x04, 0x00, 0x3C, 0x00, 0x02};
+
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    handler(TMqttMessage("/devices/device1/controls/flow", "5", 0, false));
+    error_handler(TMqttMessage("/devices/device1/controls/flow/meta/error", "rp", 0, false));
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    // error is cleared with empty payload
+    error_handler(TMqttMessage("/devices/device1/controls/flow/meta/error", "", 0, false));
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 3);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x04, 0x04, 0xFF, 0xFF, 0x00, 0x00));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x04, 0x04, 0x00, 0x00, 0x00, 0x05));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x04, 0x04, 0x00, 0x00, 0x00, 0x00));
+}
+
+TEST_F(GatewayTest, PullReadTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/energy")))
+        .WillOnce(SaveArg<0>(&handler));
+    EXPECT_CALL(*Mqtt,
+                Publish(AllOf(Field(&TMqttMessage::Topic, "/rpc/meter/energy"), Field(&TMqttMessage::Payload, "get"))))
+        .Times(1);
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto energy = make_shared<TGatewayObserver>("/devices/device1/controls/energy", conv, Mqtt);
+    energy->SetMaxAge(chrono::seconds(10), REPLY_GATEWAY_TARGET_FAILED);
+    energy->SetPull("/rpc/meter/energy", "get", chrono::seconds(10));
+    ModbusServer->Observe(energy, TStoreType::INPUT_REGISTER, TModbusAddressRange(70, 1), 0, false);
+    ModbusServer->AllocateCache();
+
+    // two clients wait for one request, third one is served meanwhile
+    uint8_t pull[] = {0x04, 0x00, 0x46, 0x00, 0x01};
+    uint8_t other[] = {0x03, 0x00, 0x00, 0x00, 0x01};
+    ModbusBackend->PushQuery(TModbusQuery(pull, sizeof(pull), 0));
+    ModbusBackend->PushQuery(TModbusQuery(pull, sizeof(pull), 0));
+    ModbusBackend->PushQuery(TModbusQuery(other, sizeof(other), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_EQ(ModbusBackend->RepliedPdus.front()[0], 0x03);
+    ModbusBackend->RepliedPdus.pop();
+
+    handler(TMqttMessage("/devices/device1/controls/energy", "9", 0, false));
+    ModbusServer->Loop();
+
+    // fresh value is read from cache without request
+    ModbusBackend->PushQuery(TModbusQuery(pull, sizeof(pull), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 3);
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x04, 0x02, 0x00, 0x09));
+        ModbusBackend->RepliedPdus.pop();
+    }
+    EXPECT_EQ(ModbusBackend->ReleasedQueries, 4);
+}
+
+TEST_F(GatewayTest, PullReadRingTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/energy")))
+        .WillOnce(SaveArg<0>(&handler));
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/level")));
+
+    auto backend = make_shared<TRingModbusBackend>(2);
+    auto server = make_shared<TModbusServer>(backend);
+    backend->AllocateCache(0, 100, 100, 100, 100);
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto energy = make_shared<TGatewayObserver>("/devices/device1/controls/energy", conv, Mqtt);
+    energy->SetMaxAge(chrono::seconds(10), REPLY_GATEWAY_TARGET_FAILED);
+    energy->SetPull("/rpc/meter/energy", "get", chrono::seconds(10));
+    server->Observe(energy, TStoreType::INPUT_REGISTER, TModbusAddressRange(70, 1), 0, false);
+    auto level = make_shared<TGatewayObserver>("/devices/device1/controls/level", conv, Mqtt);
+    server->Observe(level, TStoreType::HOLDING_REGISTER, TModbusAddressRange(0, 1));
+    server->AllocateCache();
+
+    // more clients wait for pulled value than ring has slots, other clients are served meanwhile
+    uint8_t pull[] = {0x04, 0x00, 0x46, 0x00, 0x01};
+    uint8_t other[] = {0x03, 0x00, 0x00, 0x00, 0x01};
+    const int clients = backend->Ring.Size() * 2;
+    for (int fd = 0; fd < clients; ++fd) {
+        ASSERT_TRUE(backend->ReceiveIntoRing(pull, sizeof(pull), fd));
+        server->Loop();
+        ASSERT_TRUE(backend->ReceiveIntoRing(other, sizeof(other), clients + fd));
+        server->Loop();
+
+        ASSERT_EQ(backend->RepliedQueries.size(), 1);
+        EXPECT_EQ(backend->RepliedQueries.front().socket_fd, clients + fd);
+        backend->RepliedQueries.pop();
+        backend->RepliedPdus.pop();
+    }
+
+    handler(TMqttMessage("/devices/device1/controls/energy", "9", 0, false));
+    server->Loop();
+
+    // each waiting client gets its own reply
+    ASSERT_EQ(backend->RepliedQueries.size(), clients);
+    for (int fd = 0; fd < clients; ++fd) {
+        EXPECT_EQ(backend->RepliedQueries.front().socket_fd, fd);
+        EXPECT_THAT(backend->RepliedPdus.front(), ElementsAre(0x04, 0x02, 0x00, 0x09));
+        backend->RepliedQueries.pop();
+        backend->RepliedPdus.pop();
+    }
+}
+
+TEST_F(GatewayTest, PullTimeoutTest)
+{
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto energy = make_shared<TGatewayObserver>("/devices/device1/controls/energy", conv, Mqtt);
+    energy->SetMaxAge(chrono::seconds(10), REPLY_GATEWAY_TARGET_FAILED);
+    energy->SetPull("/rpc/meter/energy", "", chrono::milliseconds(20));
+    ModbusServer->Observe(energy, TStoreType::INPUT_REGISTER, TModbusAddressRange(70, 1), 0, false);
+    ModbusServer->AllocateCache();
+
+    uint8_t pull[] = {0x04, 0x00, 0x46, 0x00, 0x01};
+    ModbusBackend->PushQuery(TModbusQuery(pull, sizeof(pull), 0));
+    ModbusServer->Loop();
+    EXPECT_TRUE(ModbusBackend->RepliedPdus.empty());
+
+    this_thread::sleep_for(chrono::milliseconds(30));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x84, REPLY_GATEWAY_TARGET_FAILED));
+    EXPECT_EQ(ModbusBackend->ReleasedQueries, 1);
+}
+
+TEST_F(GatewayTest, FileRecordTest)
+{
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/status"))).WillOnce(SaveArg<0>(&handler));
+
+    auto file_observer = make_shared<TGatewayFileObserver>("/devices/device1/status", 8, Mqtt);
+    file_observer->SetQos(2);
+    ModbusServer->ObserveFile(file_observer, 3);
+
+    handler(TMqttMessage("/devices/device1/status", "Hello", 0, true));
+
+    // read two sub-requests, overwrite 2 records, read out of file size, read unknown file
+    uint8_t q1[] = {0x14, 0x0E, 0x06, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x06, 0x00, 0x03, 0x00, 0x02, 0x00, 0x01};
+    uint8_t q2[] = {0x15, 0x0B, 0x06, 0x00, 0x03, 0x00, 0x01, 0x00, 0x02, 0x21, 0x21, 0x21, 0x00};
+    uint8_t q3[] = {0x14, 0x07, 0x06, 0x00, 0x03, 0x00, 0x03, 0x00, 0x02};
+    uint8_t q4[] = {0x14, 0x07, 0x06, 0x00, 0x09, 0x00, 0x00, 0x00, 0x01};
+    ModbusBackend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+    ModbusBackend->PushQuery(TModbusQuery(q4, sizeof(q4), 0));
+
+    EXPECT_CALL(*Mqtt,
+                Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/device1/status/on"),
+                              Field(&TMqttMessage::Payload, "He!!!"),
+                              Field(&TMqttMessage::Qos, 2))));
+
+    while (!ModbusBackend->IncomingQueries.empty())
+        ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 4);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(),
+                ElementsAre(0x14, 0x0A, 0x05, 0x06, 'H', 'e', 'l', 'l', 0x03, 0x06, 'o', 0x00));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAreArray(q2));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x94, REPLY_ILLEGAL_ADDRESS));
+    ModbusBackend->RepliedPdus.pop();
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x94, REPLY_ILLEGAL_ADDRESS));
+}
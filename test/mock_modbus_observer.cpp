@@ -2,3 +2,9 @@
 
 MockModbusServerObserver::~MockModbusServerObserver()
 {}
+
+MockGuardedModbusServerObserver::~MockGuardedModbusServerObserver()
+{}
+
+MockBatchedModbusServerObserver::~MockBatchedModbusServerObserver()
+{}
@@ -16,3 +16,25 @@ public:
                  TReplyState(TStoreType type, uint8_t unit_id, uint16_t start, unsigned count, const void* data));
     MOCK_METHOD3(OnCacheAllocate, void(TStoreType type, uint8_t unit_id, const TModbusCacheAddressRange& cache));
 };
+
+/*! Mock'ed Modbus observer copying its cached values itself */
+class MockGuardedModbusServerObserver: public MockModbusServerObserver
+{
+public:
+    virtual ~MockGuardedModbusServerObserver();
+
+    MOCK_CONST_METHOD0(GuardsCache, bool());
+    MOCK_METHOD3(OnReadCache, void(void* dst, const void* cache, size_t size));
+};
+
+/*! Mock'ed Modbus observer with batched callbacks */
+class MockBatchedModbusServerObserver: public IModbusServerObserver
+{
+public:
+    virtual ~MockBatchedModbusServerObserver();
+
+    MOCK_METHOD3(OnGetValues,
+                 TReplyState(TStoreType type, uint8_t unit_id, const std::vector<TModbusReadSegment>& segments));
+    MOCK_METHOD3(OnSetValues,
+                 TReplyState(TStoreType type, uint8_t unit_id, const std::vector<TModbusWriteSegment>& segments));
+};
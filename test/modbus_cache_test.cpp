@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include "modbus_cache.h"
+
+TEST(TModbusPagedCacheTest, SparseTest)
+{
+    TModbusPagedCache cache(16);
+
+    EXPECT_EQ(cache.Get(0), nullptr);
+
+    // single register at high address takes single page
+    cache.Allocate(TModbusAddressSet(40010, 1));
+
+    EXPECT_EQ(cache.Size(), TModbusPagedCache::PAGE_SIZE);
+    ASSERT_NE(cache.Get(40010), nullptr);
+    EXPECT_EQ(*static_cast<uint16_t*>(cache.Get(40010)), 0);
+    EXPECT_NE(cache.Get(40000), nullptr);
+    EXPECT_EQ(cache.Get(39999), nullptr);
+    EXPECT_EQ(cache.Get(40064), nullptr);
+    EXPECT_EQ(cache.Get(0), nullptr);
+    EXPECT_EQ(cache.Get(-1), nullptr);
+}
+
+TEST(TModbusPagedCacheTest, SpanTest)
+{
+    TModbusPagedCache cache(16);
+
+    TModbusAddressSet addresses(60, 10);
+    addresses.insert(1000, 2);
+    cache.Allocate(addresses);
+
+    EXPECT_EQ(cache.Size(), 3 * TModbusPagedCache::PAGE_SIZE);
+
+    // pages of one segment are contiguous
+    uint16_t* first = static_cast<uint16_t*>(cache.Get(60));
+    EXPECT_EQ(cache.Get(69), first + 9);
+    EXPECT_EQ(cache.Get(1001), static_cast<uint16_t*>(cache.Get(1000)) + 1);
+}
+
+TEST(TModbusPagedCacheTest, GrowTest)
+{
+    TModbusPagedCache cache(8);
+
+    cache.Allocate(TModbusAddressSet(10, 1));
+    cache.Allocate(TModbusAddressSet(1000, 1));
+
+    uint8_t* old_ptr = static_cast<uint8_t*>(cache.Get(10));
+    uint8_t* far_ptr = static_cast<uint8_t*>(cache.Get(1000));
+    *old_ptr = 0x42;
+    *far_ptr = 0x24;
+
+    // adjacent page is merged into block with existing one, values are kept
+    cache.Allocate(TModbusAddressSet(70, 1));
+
+    uint8_t* new_ptr = static_cast<uint8_t*>(cache.Get(10));
+    EXPECT_EQ(*new_ptr, 0x42);
+    EXPECT_EQ(cache.Get(70), new_ptr + 60);
+    EXPECT_EQ(cache.Get(1000), far_ptr);
+    EXPECT_EQ(cache.Size(), 3 * TModbusPagedCache::PAGE_SIZE);
+
+    // replaced block stays valid until next allocation
+    EXPECT_EQ(*old_ptr, 0x42);
+
+    // nothing changes if all addresses are mapped
+    cache.Allocate(TModbusAddressSet(0, 128));
+    EXPECT_EQ(cache.Get(10), new_ptr);
+}
+
+TEST(TModbusPagedCacheTest, PackedBitsTest)
+{
+    TModbusPagedCache cache(1);
+
+    cache.Allocate(TModbusAddressSet(10, 1));
+    cache.Allocate(TModbusAddressSet(1000, 100));
+
+    // page of 64 bits takes 8 bytes, item is bit (address % 8) of its byte
+    EXPECT_EQ(cache.Size(), 4 * TModbusPagedCache::PAGE_SIZE);
+    uint8_t* first = static_cast<uint8_t*>(cache.Get(0));
+    EXPECT_EQ(cache.Get(10), first + 1);
+    EXPECT_EQ(cache.Get(63), first + 7);
+    EXPECT_EQ(cache.Get(1001), static_cast<uint8_t*>(cache.Get(992)) + 1);
+    EXPECT_EQ(cache.Get(1087), static_cast<uint8_t*>(cache.Get(960)) + 15);
+}
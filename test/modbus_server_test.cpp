@@ -11,6 +11,7 @@ using namespace std;
 using ::testing::_;
 using ::testing::AtLeast;
 using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
 using ::testing::Expectation;
 using ::testing::Pointee;
 using ::testing::Return;
@@ -65,7 +66,7 @@ TEST_F(ModbusServerTest, AllocationTest)
 
     // get cache pointers
     TModbusCacheAddressRange cache_range1(0, 10, Backend->GetCache(COIL, 1));
-    TModbusCacheAddressRange cache_range2(10, 10, static_cast<uint8_t*>(Backend->GetCache(COIL, 1)) + 10);
+    TModbusCacheAddressRange cache_range2(10, 10, Backend->GetCache(COIL, 1, 10));
 
     TModbusCacheAddressRange cache_range3(30, 5, static_cast<uint16_t*>(Backend->GetCache(INPUT_REGISTER, 2)) + 30);
 
@@ -90,7 +91,7 @@ TEST_F(ModbusServerTest, ReadCallbackTest)
     Server->Observe(obs1, HOLDING_REGISTER, range3);
 
     TModbusCacheAddressRange cache_range1(0, 10, Backend->GetCache(DISCRETE_INPUT));
-    TModbusCacheAddressRange cache_range2(10, 10, static_cast<uint8_t*>(Backend->GetCache(DISCRETE_INPUT)) + 10);
+    TModbusCacheAddressRange cache_range2(10, 10, Backend->GetCache(DISCRETE_INPUT, 0, 10));
     TModbusCacheAddressRange cache_range3(40, 10, static_cast<uint16_t*>(Backend->GetCache(HOLDING_REGISTER)) + 40);
 
     // test allocators again, with same allocator for different ranges
@@ -109,12 +110,8 @@ TEST_F(ModbusServerTest, ReadCallbackTest)
     Backend->PushQuery(read1);
     Backend->PushQuery(read2);
 
-    EXPECT_CALL(*obs1,
-                OnGetValue(DISCRETE_INPUT, 0, 5, 2, static_cast<uint8_t*>(Backend->GetCache(DISCRETE_INPUT)) + 5))
-        .WillOnce(Return(REPLY_CACHED));
-    EXPECT_CALL(*obs2,
-                OnGetValue(DISCRETE_INPUT, 0, 10, 2, static_cast<uint8_t*>(Backend->GetCache(DISCRETE_INPUT)) + 10))
-        .WillOnce(Return(REPLY_CACHED));
+    EXPECT_CALL(*obs1, OnGetValue(DISCRETE_INPUT, 0, 5, 2, _)).WillOnce(Return(REPLY_CACHED));
+    EXPECT_CALL(*obs2, OnGetValue(DISCRETE_INPUT, 0, 10, 2, _)).WillOnce(Return(REPLY_CACHED));
 
     while (!Backend->IncomingQueries.empty())
         Server->Loop();
@@ -133,7 +130,7 @@ TEST_F(ModbusServerTest, WriteCallbackTest)
     Server->Observe(obs1, HOLDING_REGISTER, range3);
 
     TModbusCacheAddressRange cache_range1(0, 2, Backend->GetCache(DISCRETE_INPUT));
-    TModbusCacheAddressRange cache_range2(10, 10, static_cast<uint8_t*>(Backend->GetCache(DISCRETE_INPUT)) + 10);
+    TModbusCacheAddressRange cache_range2(10, 10, Backend->GetCache(DISCRETE_INPUT, 0, 10));
     TModbusCacheAddressRange cache_range3(40, 10, static_cast<uint16_t*>(Backend->GetCache(HOLDING_REGISTER)) + 40);
 
     // test allocators again, with same allocator for different ranges
@@ -157,3 +154,356 @@ TEST_F(ModbusServerTest, WriteCallbackTest)
     while (!Backend->IncomingQueries.empty())
         Server->Loop();
 }
+
+TEST_F(ModbusServerTest, ExceptionReplyTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10));
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    // partially out of range, completely out of range, unsupported function, refused write
+    uint8_t q1[] = {0x03, 0x00, 0x05, 0x00, 0x0A};
+    uint8_t q2[] = {0x03, 0x00, 0x20, 0x00, 0x01};
+    uint8_t q3[] = {0x2B, 0x0E, 0x01, 0x00};
+    uint8_t q4[] = {0x06, 0x00, 0x01, 0x12, 0x34};
+
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    Backend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+    Backend->PushQuery(TModbusQuery(q4, sizeof(q4), 0));
+
+    EXPECT_CALL(*obs1, OnGetValue(_, _, _, _, _)).Times(0);
+    EXPECT_CALL(*obs1, OnSetValue(HOLDING_REGISTER, 0, 1, 1, Pointee16(0x1234))).WillOnce(Return(REPLY_SERVER_FAILURE));
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedQueries.size(), 4);
+    EXPECT_EQ(Backend->ReleasedQueries, 4);
+
+    EXPECT_EQ(Backend->RepliedQueries.front().size, -REPLY_ILLEGAL_ADDRESS);
+    Backend->RepliedQueries.pop();
+    EXPECT_EQ(Backend->RepliedQueries.front().size, -REPLY_ILLEGAL_ADDRESS);
+    Backend->RepliedQueries.pop();
+    EXPECT_EQ(Backend->RepliedQueries.front().size, -REPLY_ILLEGAL_FUNCTION);
+    Backend->RepliedQueries.pop();
+    EXPECT_EQ(Backend->RepliedQueries.front().size, -REPLY_SERVER_FAILURE);
+}
+
+MATCHER_P2(SegmentAt, start, count, "")
+{
+    return arg.start == start && arg.count == unsigned(count);
+}
+
+TEST_F(ModbusServerTest, CacheBackedReadTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+    std::shared_ptr<MockModbusServerObserver> obs2 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 0, true);
+    Server->Observe(obs2, HOLDING_REGISTER, TModbusAddressRange(10, 10), 0, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    EXPECT_CALL(*obs2, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    uint8_t q1[] = {0x03, 0x00, 0x05, 0x00, 0x0A};
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+
+    EXPECT_CALL(*obs1, OnGetValue(_, _, _, _, _)).Times(0);
+    EXPECT_CALL(*obs2, OnGetValue(_, _, _, _, _)).Times(0);
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedQueries.size(), 1);
+    EXPECT_GT(Backend->RepliedQueries.front().size, 0);
+}
+
+TEST_F(ModbusServerTest, GuardedCacheReadTest)
+{
+    std::shared_ptr<MockGuardedModbusServerObserver> obs1 = make_shared<MockGuardedModbusServerObserver>();
+    std::shared_ptr<MockModbusServerObserver> obs2 = make_shared<MockModbusServerObserver>();
+
+    EXPECT_CALL(*obs1, GuardsCache()).WillRepeatedly(Return(true));
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 0, true);
+    Server->Observe(obs2, HOLDING_REGISTER, TModbusAddressRange(10, 10), 0, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    EXPECT_CALL(*obs2, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    uint16_t* regs = static_cast<uint16_t*>(Backend->GetCache(HOLDING_REGISTER));
+    regs[9] = 0x1234;
+    regs[10] = 0x5678;
+
+    // only guarded observer copies its values, others are replied from cache
+    uint8_t q1[] = {0x03, 0x00, 0x0A, 0x00, 0x01};
+    uint8_t q2[] = {0x03, 0x00, 0x09, 0x00, 0x02};
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+
+    EXPECT_CALL(*obs1, OnReadCache(_, _, sizeof(uint16_t)))
+        .WillOnce([](void* dst, const void* cache, size_t size) { memcpy(dst, cache, size); });
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 2);
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x03, 0x02, 0x56, 0x78));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x03, 0x04, 0x12, 0x34, 0x56, 0x78));
+}
+
+TEST_F(ModbusServerTest, BatchedCallbackTest)
+{
+    std::shared_ptr<MockBatchedModbusServerObserver> obs1 = make_shared<MockBatchedModbusServerObserver>();
+    std::shared_ptr<MockModbusServerObserver> obs2 = make_shared<MockModbusServerObserver>();
+
+    // obs1 owns two segments around cache-backed obs2
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 5));
+    Server->Observe(obs2, HOLDING_REGISTER, TModbusAddressRange(5, 5), 0, true);
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(10, 5));
+
+    EXPECT_CALL(*obs2, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    uint8_t q1[] = {0x03, 0x00, 0x02, 0x00, 0x0A};
+    uint8_t q2[] = {0x10, 0x00, 0x04, 0x00, 0x07, 0x0E, 0, 1, 0, 2, 0, 3, 0, 4, 0, 5, 0, 6, 0, 7};
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+
+    EXPECT_CALL(*obs1, OnGetValues(HOLDING_REGISTER, 0, ElementsAre(SegmentAt(2, 3), SegmentAt(10, 2))))
+        .WillOnce(Return(REPLY_CACHED));
+    EXPECT_CALL(*obs2, OnGetValue(_, _, _, _, _)).Times(0);
+
+    EXPECT_CALL(*obs1, OnSetValues(HOLDING_REGISTER, 0, ElementsAre(SegmentAt(4, 1), SegmentAt(10, 1))))
+        .WillOnce(Return(REPLY_OK));
+    EXPECT_CALL(*obs2, OnSetValue(HOLDING_REGISTER, 0, 5, 5, Pointee16(2))).WillOnce(Return(REPLY_OK));
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+}
+
+TEST_F(ModbusServerTest, MalformedWriteTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, COIL, TModbusAddressRange(0, 10));
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10));
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(_, 0, _)).Times(2);
+    Server->AllocateCache();
+
+    // invalid single coil value, byte count too small for coils and registers, zero registers
+    uint8_t q1[] = {0x05, 0x00, 0x00, 0x12, 0x34};
+    uint8_t q2[] = {0x0F, 0x00, 0x00, 0x00, 0x09, 0x01, 0xFF};
+    uint8_t q3[] = {0x10, 0x00, 0x00, 0x00, 0x02, 0x02, 0x12, 0x34};
+    uint8_t q4[] = {0x10, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    Backend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+    Backend->PushQuery(TModbusQuery(q4, sizeof(q4), 0));
+
+    EXPECT_CALL(*obs1, OnSetValue(_, _, _, _, _)).Times(0);
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedQueries.size(), 4);
+    while (!Backend->RepliedQueries.empty()) {
+        EXPECT_EQ(Backend->RepliedQueries.front().size, -REPLY_ILLEGAL_VALUE);
+        Backend->RepliedQueries.pop();
+    }
+}
+
+TEST_F(ModbusServerTest, ReplyEncodingTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, COIL, TModbusAddressRange(0, 10), 0, true);
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 0, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(_, 0, _)).Times(2);
+    Server->AllocateCache();
+
+    uint16_t* regs = static_cast<uint16_t*>(Backend->GetCache(HOLDING_REGISTER));
+    regs[2] = 0x1234;
+    regs[3] = 0x5678;
+
+    // write coils 1 and 3, then read registers and coils back
+    uint8_t q1[] = {0x0F, 0x00, 0x00, 0x00, 0x04, 0x01, 0x0A};
+    uint8_t q2[] = {0x03, 0x00, 0x02, 0x00, 0x02};
+    uint8_t q3[] = {0x01, 0x00, 0x00, 0x00, 0x04};
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    Backend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+
+    EXPECT_CALL(*obs1, OnSetValue(COIL, 0, 0, 4, _)).WillOnce(Return(REPLY_OK));
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 3);
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x0F, 0x00, 0x00, 0x00, 0x04));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x03, 0x04, 0x12, 0x34, 0x56, 0x78));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x01, 0x01, 0x0A));
+}
+
+TEST_F(ModbusServerTest, WriteReadRegistersTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 0, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    uint16_t* regs = static_cast<uint16_t*>(Backend->GetCache(HOLDING_REGISTER));
+    regs[1] = 0x1111;
+
+    // write registers 2 and 3, read registers 1..3 in the same request
+    uint8_t q1[] = {0x17, 0x00, 0x01, 0x00, 0x03, 0x00, 0x02, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78};
+    // write out of observed range
+    uint8_t q2[] = {0x17, 0x00, 0x01, 0x00, 0x01, 0x00, 0x20, 0x00, 0x01, 0x02, 0x00, 0x01};
+    // byte count doesn't match write count
+    uint8_t q3[] = {0x17, 0x00, 0x01, 0x00, 0x01, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00, 0x01};
+    // read is out of range, so write isn't done
+    uint8_t q4[] = {0x17, 0x00, 0x08, 0x00, 0x04, 0x00, 0x02, 0x00, 0x01, 0x02, 0xAB, 0xCD};
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    Backend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+    Backend->PushQuery(TModbusQuery(q4, sizeof(q4), 0));
+
+    EXPECT_CALL(*obs1, OnSetValue(HOLDING_REGISTER, 0, 2, 2, Pointee16_2(0x1234, 0x5678))).WillOnce(Return(REPLY_OK));
+    EXPECT_CALL(*obs1, OnSetValue(HOLDING_REGISTER, 0, 2, 1, _)).Times(0);
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 4);
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x17, 0x06, 0x11, 0x11, 0x12, 0x34, 0x56, 0x78));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x97, REPLY_ILLEGAL_ADDRESS));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x97, REPLY_ILLEGAL_VALUE));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x97, REPLY_ILLEGAL_ADDRESS));
+
+    EXPECT_EQ(regs[2], 0x1234);
+}
+
+TEST_F(ModbusServerTest, MaskWriteRegisterTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 0, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    uint16_t* regs = static_cast<uint16_t*>(Backend->GetCache(HOLDING_REGISTER));
+    regs[4] = 0x00F0;
+    regs[5] = 0x00F0;
+
+    // set bit 0 and clear bit 4 of register 4
+    uint8_t q1[] = {0x16, 0x00, 0x04, 0xFF, 0xEE, 0x00, 0x01};
+    // refused by observer, cache must stay untouched
+    uint8_t q2[] = {0x16, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00};
+    // out of observed range
+    uint8_t q3[] = {0x16, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00};
+    // truncated
+    uint8_t q4[] = {0x16, 0x00, 0x04, 0x00, 0x00};
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 0));
+    Backend->PushQuery(TModbusQuery(q2, sizeof(q2), 0));
+    Backend->PushQuery(TModbusQuery(q3, sizeof(q3), 0));
+    Backend->PushQuery(TModbusQuery(q4, sizeof(q4), 0));
+
+    EXPECT_CALL(*obs1, OnSetValue(HOLDING_REGISTER, 0, 4, 1, Pointee16(0x00E1))).WillOnce(Return(REPLY_OK));
+    EXPECT_CALL(*obs1, OnSetValue(HOLDING_REGISTER, 0, 5, 1, Pointee16(0x0000)))
+        .WillOnce(Return(REPLY_ILLEGAL_VALUE));
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    EXPECT_EQ(regs[4], 0x00E1);
+    EXPECT_EQ(regs[5], 0x00F0);
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 4);
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x16, 0x00, 0x04, 0xFF, 0xEE, 0x00, 0x01));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x96, REPLY_ILLEGAL_VALUE));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x96, REPLY_ILLEGAL_ADDRESS));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x96, REPLY_ILLEGAL_VALUE));
+}
+
+TEST_F(ModbusServerTest, DiagnosticsTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 0, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 0, _)).Times(1);
+    Server->AllocateCache();
+
+    // illegal address, return query data, message and exception counts, clear counters, count again
+    uint8_t q1[] = {0x03, 0x00, 0x20, 0x00, 0x01};
+    uint8_t q2[] = {0x08, 0x00, 0x00, 0xA5, 0x37};
+    uint8_t q3[] = {0x08, 0x00, 0x0B, 0x00, 0x00};
+    uint8_t q4[] = {0x08, 0x00, 0x0D, 0x00, 0x00};
+    uint8_t q5[] = {0x08, 0x00, 0x0E, 0x00, 0x00};
+    uint8_t q6[] = {0x08, 0x00, 0x0A, 0x00, 0x00};
+    uint8_t q7[] = {0x08, 0x00, 0x0E, 0x00, 0x00};
+    // unsupported sub-function, non-zero data for counter
+    uint8_t q8[] = {0x08, 0x00, 0x01, 0x00, 0x00};
+    uint8_t q9[] = {0x08, 0x00, 0x0B, 0x00, 0x01};
+    for (auto q: {q1, q2, q3, q4, q5, q6, q7, q8, q9})
+        Backend->PushQuery(TModbusQuery(q, 5, 0));
+
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 9);
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAreArray(q2));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x08, 0x00, 0x0B, 0x00, 0x03));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x08, 0x00, 0x0D, 0x00, 0x01));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x08, 0x00, 0x0E, 0x00, 0x05));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAreArray(q6));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x08, 0x00, 0x0E, 0x00, 0x01));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x88, REPLY_ILLEGAL_FUNCTION));
+    Backend->RepliedPdus.pop();
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x88, REPLY_ILLEGAL_VALUE));
+}
+
+TEST_F(ModbusServerTest, DiagnosticsRtuEchoTest)
+{
+    std::shared_ptr<MockModbusServerObserver> obs1 = make_shared<MockModbusServerObserver>();
+
+    Server->Observe(obs1, HOLDING_REGISTER, TModbusAddressRange(0, 10), 1, true);
+
+    EXPECT_CALL(*obs1, OnCacheAllocate(HOLDING_REGISTER, 1, _)).Times(1);
+    Server->AllocateCache();
+
+    // RTU frame: slave address, PDU and CRC counted in query size
+    uint8_t q[] = {0x01, 0x08, 0x00, 0x00, 0xA5, 0x37, 0xDA, 0x8D};
+    Backend->PushQuery(TModbusQuery(q, sizeof(q), 1));
+    Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 1);
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x08, 0x00, 0x00, 0xA5, 0x37));
+}
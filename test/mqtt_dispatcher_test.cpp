@@ -0,0 +1,132 @@
+#include "mock_mqtt_client.h"
+#include "mqtt_dispatcher.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace WBMQTT;
+using namespace ::testing;
+
+class TMqttTopicDispatcherTest: public ::testing::Test
+{
+protected:
+    void SetUp()
+    {
+        Client = make_shared<StrictMock<MockMQTTClient>>();
+        Dispatcher = make_shared<TMqttTopicDispatcher>(Client);
+    }
+
+    shared_ptr<StrictMock<MockMQTTClient>> Client;
+    shared_ptr<TMqttTopicDispatcher> Dispatcher;
+};
+
+TEST_F(TMqttTopicDispatcherTest, DispatchTest)
+{
+    TMqttMessageHandler device1, device2;
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/devices/device1/controls/+")))
+        .WillOnce(SaveArg<0>(&device1));
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/devices/device2/controls/+")))
+        .WillOnce(SaveArg<0>(&device2));
+
+    vector<string> received;
+    auto handler = [&](const TMqttMessage& msg) { received.push_back(msg.Topic + "=" + msg.Payload); };
+
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/a");
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/b");
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/b");
+    Dispatcher->Subscribe(handler, "/devices/device2/controls/a");
+    EXPECT_EQ(Dispatcher->GetSubscriptionCount(), 2);
+
+    device1(TMqttMessage("/devices/device1/controls/b", "1", 0, false));
+    device1(TMqttMessage("/devices/device1/controls/unmapped", "2", 0, false));
+    device2(TMqttMessage("/devices/device2/controls/a", "3", 0, false));
+
+    EXPECT_THAT(received,
+                ElementsAre("/devices/device1/controls/b=1", "/devices/device1/controls/b=1",
+                            "/devices/device2/controls/a=3"));
+
+    // wildcard is kept while device has other topics
+    Dispatcher->Unsubscribe("/devices/device1/controls/b");
+    EXPECT_CALL(*Client, Unsubscribe(Matcher<const string&>("/devices/device1/controls/+")));
+    Dispatcher->Unsubscribe("/devices/device1/controls/a");
+    EXPECT_EQ(Dispatcher->GetSubscriptionCount(), 1);
+}
+
+TEST_F(TMqttTopicDispatcherTest, NonControlTopicTest)
+{
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/devices/device1/meta/name")));
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/devices/device1/controls/a/on")));
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/custom")));
+
+    auto handler = [](const TMqttMessage&) {};
+    Dispatcher->Subscribe(handler, "/devices/device1/meta/name");
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/a/on");
+    Dispatcher->Subscribe(handler, "/custom");
+}
+
+TEST_F(TMqttTopicDispatcherTest, SubscribeAfterStartTest)
+{
+    TMqttMessageHandler device1;
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/devices/device1/controls/+")))
+        .WillOnce(SaveArg<0>(&device1));
+    EXPECT_CALL(*Client, Start());
+
+    vector<string> received;
+    auto handler = [&](const TMqttMessage& msg) { received.push_back(msg.Topic + "=" + msg.Payload); };
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/a");
+    Dispatcher->Start();
+
+    device1(TMqttMessage("/devices/device1/controls/a", "1", 0, true));
+    device1(TMqttMessage("/devices/device1/controls/b", "2", 0, true));
+    // live update comes without retain flag
+    device1(TMqttMessage("/devices/device1/controls/b", "3", 0, false));
+    device1(TMqttMessage("/devices/device1/controls/d", "5", 0, false));
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 1);
+
+    // new topic gets the latest value without resubscription of device
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/b");
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/c");
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/d");
+
+    EXPECT_THAT(received,
+                ElementsAre("/devices/device1/controls/a=1",
+                            "/devices/device1/controls/b=3",
+                            "/devices/device1/controls/d=5"));
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 1);
+
+    // replayed value is not counted as resubscription of broker
+    device1(TMqttMessage("/devices/device1/controls/c", "4", 0, true));
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 1);
+    EXPECT_GE(Dispatcher->GetReadyTime().count(), 0);
+}
+
+TEST_F(TMqttTopicDispatcherTest, ReadyTimeTest)
+{
+    TMqttMessageHandler device1;
+    EXPECT_CALL(*Client, Subscribe(_, Matcher<const string&>("/devices/device1/controls/+")))
+        .WillOnce(SaveArg<0>(&device1));
+    EXPECT_CALL(*Client, Start());
+
+    auto handler = [](const TMqttMessage&) {};
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/a");
+    Dispatcher->Subscribe(handler, "/devices/device1/controls/b");
+    Dispatcher->Start();
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 1);
+
+    device1(TMqttMessage("/devices/device1/controls/a", "1", 0, true));
+    device1(TMqttMessage("/devices/device1/controls/a", "2", 0, false));
+    device1(TMqttMessage("/devices/device1/controls/b", "1", 0, true));
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 1);
+
+    // retained values again - client has reconnected and resubscribed
+    device1(TMqttMessage("/devices/device1/controls/b", "1", 0, true));
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 2);
+    device1(TMqttMessage("/devices/device1/controls/a", "2", 0, true));
+    EXPECT_EQ(Dispatcher->GetSyncCount(), 2);
+    EXPECT_GE(Dispatcher->GetReadyTime().count(), 0);
+}
@@ -7,6 +7,7 @@
 
 using namespace std;
 using ::testing::_;
+using ::testing::ElementsAre;
 using ::testing::Return;
 
 class MultiUnitIDTest: public ::testing::Test
@@ -45,9 +46,9 @@ public:
 TEST_F(MultiUnitIDTest, AllocateTest)
 {
     TModbusCacheAddressRange or1(0, 5, Backend->GetCache(COIL, 1));
-    TModbusCacheAddressRange or2(5, 3, static_cast<char*>(Backend->GetCache(COIL, 1)) + 5);
-    TModbusCacheAddressRange or3(2, 5, static_cast<char*>(Backend->GetCache(COIL, 2)) + 2);
-    TModbusCacheAddressRange or4(4, 5, static_cast<char*>(Backend->GetCache(COIL, 5)) + 4);
+    TModbusCacheAddressRange or2(5, 3, Backend->GetCache(COIL, 1, 5));
+    TModbusCacheAddressRange or3(2, 5, Backend->GetCache(COIL, 2, 2));
+    TModbusCacheAddressRange or4(4, 5, Backend->GetCache(COIL, 5, 4));
 
     EXPECT_CALL(*obs1, OnCacheAllocate(COIL, 1, or1)).Times(1);
     EXPECT_CALL(*obs2, OnCacheAllocate(COIL, 1, or2)).Times(1);
@@ -89,8 +90,36 @@ TEST_F(MultiUnitIDTest, ReadRequestTest)
     Backend->PushQuery(query1);
     Backend->PushQuery(query2);
 
-    EXPECT_CALL(*obs1, OnGetValue(COIL, 1, 0, 1, Backend->GetCache(COIL, 1))).WillOnce(Return(REPLY_OK));
+    EXPECT_CALL(*obs1, OnGetValue(COIL, 1, 0, 1, _)).WillOnce(Return(REPLY_OK));
 
     while (!Backend->IncomingQueries.empty())
         Server->Loop();
 }
+
+TEST_F(MultiUnitIDTest, UnknownUnitReplyTest)
+{
+    EXPECT_CALL(*obs1, OnCacheAllocate(COIL, 1, _)).Times(1);
+    EXPECT_CALL(*obs2, OnCacheAllocate(COIL, 1, _)).Times(1);
+    EXPECT_CALL(*obs3, OnCacheAllocate(COIL, 2, _)).Times(1);
+    EXPECT_CALL(*obs4, OnCacheAllocate(COIL, 5, _)).Times(1);
+
+    Server->AllocateCache();
+
+    // read coils of unit 8 which is not observed
+    uint8_t q1[] = {8, 0x01, 0x00, 0x00, 0x00, 0x01};
+
+    // ignored by default
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 1));
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    EXPECT_TRUE(Backend->RepliedPdus.empty());
+
+    Server->SetUnknownUnitReply(REPLY_GATEWAY_TARGET_FAILED);
+    Backend->PushQuery(TModbusQuery(q1, sizeof(q1), 1));
+    while (!Backend->IncomingQueries.empty())
+        Server->Loop();
+
+    ASSERT_EQ(Backend->RepliedPdus.size(), 1);
+    EXPECT_THAT(Backend->RepliedPdus.front(), ElementsAre(0x81, 0x0B));
+}
@@ -0,0 +1,194 @@
+#include "fake_modbus_backend.h"
+#include "mock_mqtt_client.h"
+#include "modbus_wrapper.h"
+#include "observer.h"
+#include "publish_queue.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace std;
+using namespace WBMQTT;
+using namespace ::testing;
+
+/*! Keeps publisher thread in Publish() until released */
+class TPublishGate
+{
+public:
+    void Wait()
+    {
+        unique_lock<mutex> lock(Mutex);
+        Entered = true;
+        Changed.notify_all();
+        Changed.wait(lock, [this] { return Open; });
+    }
+
+    void WaitEntered()
+    {
+        unique_lock<mutex> lock(Mutex);
+        Changed.wait(lock, [this] { return Entered; });
+    }
+
+    void Release()
+    {
+        lock_guard<mutex> lock(Mutex);
+        Open = true;
+        Changed.notify_all();
+    }
+
+private:
+    mutex Mutex;
+    condition_variable Changed;
+    bool Entered = false;
+    bool Open = false;
+};
+
+TEST(TPublishQueueTest, WriteReplyTest)
+{
+    auto mqtt = make_shared<NiceMock<MockMQTTClient>>();
+    auto backend = make_shared<TFakeModbusBackend>();
+    auto server = make_shared<TModbusServer>(backend);
+    auto queue = make_shared<TPublishQueue>(mqtt, 16, TPublishQueue::REJECT);
+
+    PMQTTConverter conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    auto obs1 = make_shared<TGatewayObserver>("/devices/device1/controls/a", conv, mqtt);
+    auto obs2 = make_shared<TGatewayObserver>("/devices/device1/controls/b", conv, mqtt);
+    obs1->SetPublishQueue(queue);
+    obs2->SetPublishQueue(queue);
+    obs2->SetQos(0);
+    server->Observe(obs1, TStoreType::HOLDING_REGISTER, TModbusAddressRange(0, 1));
+    server->Observe(obs2, TStoreType::HOLDING_REGISTER, TModbusAddressRange(1, 1));
+    server->AllocateCache();
+
+    TPublishGate gate;
+    promise<void> published;
+    {
+        InSequence seq;
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/device1/controls/a/on"),
+                                  Field(&TMqttMessage::Payload, "4660"),
+                                  Field(&TMqttMessage::Qos, 1))))
+            .WillOnce(InvokeWithoutArgs([&] { gate.Wait(); }));
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/device1/controls/b/on"),
+                                  Field(&TMqttMessage::Payload, "22136"),
+                                  Field(&TMqttMessage::Qos, 0))))
+            .WillOnce(InvokeWithoutArgs([&] { published.set_value(); }));
+    }
+
+    uint8_t q[] = {0x10, 0x00, 0x00, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78};
+    backend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    server->Loop();
+
+    // client is answered while broker still holds the first publication
+    ASSERT_EQ(backend->RepliedPdus.size(), 1);
+    EXPECT_THAT(backend->RepliedPdus.front(), ElementsAre(0x10, 0x00, 0x00, 0x00, 0x02));
+
+    gate.Release();
+    published.get_future().wait();
+}
+
+TEST(TPublishQueueTest, RejectTest)
+{
+    auto mqtt = make_shared<NiceMock<MockMQTTClient>>();
+    TPublishGate gate;
+    EXPECT_CALL(*mqtt, Publish(_)).WillOnce(InvokeWithoutArgs([&] { gate.Wait(); })).WillRepeatedly(Return());
+
+    TPublishQueue queue(mqtt, 1, TPublishQueue::REJECT);
+
+    // first message is taken by publisher thread, second one fills queue
+    EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "1", 1, false)));
+    gate.WaitEntered();
+    EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "2", 1, false)));
+    EXPECT_FALSE(queue.Push(TMqttMessage("/a/on", "3", 1, false)));
+
+    auto stats = queue.GetStats();
+    EXPECT_EQ(stats.Rejected, 1);
+    EXPECT_EQ(stats.Depth, 1);
+
+    gate.Release();
+}
+
+TEST(TPublishQueueTest, BlockTest)
+{
+    auto mqtt = make_shared<NiceMock<MockMQTTClient>>();
+    TPublishGate gate;
+    EXPECT_CALL(*mqtt, Publish(_)).WillOnce(InvokeWithoutArgs([&] { gate.Wait(); })).WillRepeatedly(Return());
+
+    {
+        TPublishQueue queue(mqtt, 1, TPublishQueue::BLOCK);
+
+        EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "1", 1, false)));
+        gate.WaitEntered();
+        EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "2", 1, false)));
+
+        // writer waits until publisher thread takes queued message
+        auto blocked = async(launch::async, [&] { return queue.Push(TMqttMessage("/a/on", "3", 1, false)); });
+        EXPECT_EQ(blocked.wait_for(chrono::milliseconds(50)), future_status::timeout);
+
+        gate.Release();
+        EXPECT_TRUE(blocked.get());
+    }
+
+    // queued messages are published before queue is destroyed
+    Mock::VerifyAndClearExpectations(mqtt.get());
+}
+
+TEST(TPublishQueueTest, RateLimitTest)
+{
+    auto mqtt = make_shared<StrictMock<MockMQTTClient>>();
+    promise<void> published;
+    chrono::steady_clock::time_point last;
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*mqtt, Publish(Field(&TMqttMessage::Payload, "1")));
+        EXPECT_CALL(*mqtt, Publish(Field(&TMqttMessage::Payload, "4"))).WillOnce(InvokeWithoutArgs([&] {
+            last = chrono::steady_clock::now();
+            published.set_value();
+        }));
+        EXPECT_CALL(*mqtt, Publish(Field(&TMqttMessage::Payload, "5")));
+    }
+
+    TPublishQueue queue(mqtt, 16, TPublishQueue::REJECT);
+    const chrono::milliseconds interval(50);
+    const auto start = chrono::steady_clock::now();
+
+    // the first value goes at once, the last of following ones waits for interval
+    for (int i = 1; i <= 4; ++i)
+        EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", to_string(i), 1, false), interval));
+
+    published.get_future().wait();
+    EXPECT_GE(last - start, interval);
+    EXPECT_EQ(queue.GetStats().Coalesced, 2);
+
+    // waiting value is published on shutdown without delay
+    EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "5", 1, false), chrono::seconds(60)));
+}
+
+TEST(TPublishQueueTest, StopTest)
+{
+    auto mqtt = make_shared<StrictMock<MockMQTTClient>>();
+    {
+        InSequence seq;
+        EXPECT_CALL(*mqtt, Publish(Field(&TMqttMessage::Payload, "1")));
+        EXPECT_CALL(*mqtt, Publish(Field(&TMqttMessage::Payload, "2")));
+    }
+
+    TPublishQueue queue(mqtt, 16, TPublishQueue::REJECT);
+    EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "1", 1, false), chrono::seconds(60)));
+    EXPECT_TRUE(queue.Push(TMqttMessage("/a/on", "2", 1, false), chrono::seconds(60)));
+
+    // all messages are published when Stop() returns, so MQTT client may be stopped then
+    queue.Stop();
+    Mock::VerifyAndClearExpectations(mqtt.get());
+
+    EXPECT_FALSE(queue.Push(TMqttMessage("/a/on", "3", 1, false)));
+    queue.Stop();
+}
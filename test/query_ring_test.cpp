@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include "modbus_query_ring.h"
+
+#include <cstring>
+
+class TModbusQueryRingTest: public ::testing::Test
+{
+protected:
+    void Receive(TModbusQueryRing& ring, uint8_t value)
+    {
+        uint8_t* buffer = ring.Acquire();
+        ASSERT_NE(buffer, nullptr);
+        std::memset(buffer, value, 8);
+        ring.Commit(8, 1, 42);
+    }
+};
+
+TEST_F(TModbusQueryRingTest, InPlaceTest)
+{
+    TModbusQueryRing ring(2, 16);
+
+    EXPECT_FALSE(ring.Available());
+    EXPECT_EQ(ring.Pop().size, 0);
+
+    uint8_t* buffer = ring.Acquire();
+    Receive(ring, 0x11);
+
+    ASSERT_TRUE(ring.Available());
+    TModbusQuery q = ring.Pop();
+
+    // query is a view of slot buffer, no copies are made
+    EXPECT_EQ(q.data, buffer);
+    EXPECT_EQ(q.size, 8);
+    EXPECT_EQ(q.header_length, 1);
+    EXPECT_EQ(q.socket_fd, 42);
+    EXPECT_EQ(q.data[7], 0x11);
+    EXPECT_FALSE(ring.Available());
+
+    ring.Release(q);
+    EXPECT_EQ(ring.HighWater(), 1);
+}
+
+TEST_F(TModbusQueryRingTest, OverflowTest)
+{
+    TModbusQueryRing ring(3, 16);
+
+    Receive(ring, 1);
+    Receive(ring, 2);
+    Receive(ring, 3);
+
+    EXPECT_EQ(ring.Acquire(), nullptr);
+    EXPECT_EQ(ring.HighWater(), 3);
+
+    TModbusQuery q1 = ring.Pop();
+    TModbusQuery q2 = ring.Pop();
+
+    // out of order release keeps oldest slot occupied
+    ring.Release(q2);
+    EXPECT_EQ(ring.Acquire(), nullptr);
+
+    ring.Release(q1);
+    Receive(ring, 4);
+    Receive(ring, 5);
+    EXPECT_EQ(ring.Acquire(), nullptr);
+
+    EXPECT_EQ(ring.Pop().data[0], 3);
+    EXPECT_EQ(ring.Pop().data[0], 4);
+    EXPECT_EQ(ring.Pop().data[0], 5);
+    EXPECT_FALSE(ring.Available());
+    EXPECT_EQ(ring.HighWater(), 3);
+}
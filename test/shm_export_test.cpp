@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+
+#include "mbgate_shm.h"
+#include "shm_export.h"
+
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+class TModbusShmExportTest: public ::testing::Test
+{
+protected:
+    std::string Name = "/wb-mqtt-mbgate-test-" + std::to_string(getpid());
+};
+
+TEST_F(TModbusShmExportTest, ExportTest)
+{
+    uint16_t regs[] = {0x1234, 0x5678};
+    // coils are packed by address, so coil 6 is bit 6
+    uint8_t coils[] = {0x40};
+
+    TModbusShmExport shm_export(Name);
+    shm_export.Create({{2, HOLDING_REGISTER, 100, 2, regs}, {1, COIL, 5, 2, coils}});
+
+    MbgateShm::TReader reader;
+    ASSERT_TRUE(reader.Open(Name));
+    EXPECT_FALSE(reader.IsStale());
+    EXPECT_EQ(reader.end() - reader.begin(), 4);
+
+    // entries are sorted by unit ID, store and address
+    auto coil = reader.Find(1, MbgateShm::COIL, 6);
+    ASSERT_EQ(coil, reader.begin() + 1);
+    EXPECT_EQ(MbgateShm::Load(*coil), 1);
+
+    auto reg = reader.Find(2, MbgateShm::HOLDING_REGISTER, 101);
+    ASSERT_NE(reg, nullptr);
+
+    uint32_t sequence;
+    EXPECT_EQ(MbgateShm::Load(*reg, &sequence), 0x5678);
+    EXPECT_EQ(sequence, 0);
+
+    EXPECT_EQ(reader.Find(2, MbgateShm::HOLDING_REGISTER, 102), nullptr);
+    EXPECT_EQ(reader.Find(2, MbgateShm::INPUT_REGISTER, 100), nullptr);
+
+    // sequence changes on value change only
+    regs[1] = 0x4321;
+    shm_export.Update(HOLDING_REGISTER, 2, 100, regs, 2);
+    EXPECT_EQ(MbgateShm::Load(*reg, &sequence), 0x4321);
+    EXPECT_EQ(sequence, 2);
+    EXPECT_EQ(reader.Find(2, MbgateShm::HOLDING_REGISTER, 100)->Sequence.load(), 0);
+
+    // registers of one value are read together
+    uint16_t values[2];
+    reader.Load(reader.Find(2, MbgateShm::HOLDING_REGISTER, 100), 2, values);
+    EXPECT_EQ(values[0], 0x1234);
+    EXPECT_EQ(values[1], 0x4321);
+
+    // new layout replaces object
+    shm_export.Create({{2, HOLDING_REGISTER, 100, 1, regs}});
+    EXPECT_TRUE(reader.IsStale());
+    ASSERT_TRUE(reader.Open(Name));
+    EXPECT_FALSE(reader.IsStale());
+    EXPECT_EQ(reader.end() - reader.begin(), 1);
+}
+
+TEST_F(TModbusShmExportTest, RestartTest)
+{
+    uint16_t regs[] = {0x1234, 0x5678};
+
+    // object of previous gateway instance is left by crash
+    auto previous = std::make_unique<TModbusShmExport>(Name);
+    previous->Create({{1, HOLDING_REGISTER, 0, 2, regs}});
+
+    MbgateShm::TReader reader;
+    ASSERT_TRUE(reader.Open(Name));
+
+    // new object doesn't truncate mapping of reader
+    TModbusShmExport shm_export(Name);
+    shm_export.Create({{1, HOLDING_REGISTER, 0, 1, regs}});
+    EXPECT_EQ(MbgateShm::Load(*reader.Find(1, MbgateShm::HOLDING_REGISTER, 1)), 0x5678);
+
+    ASSERT_TRUE(reader.Open(Name));
+    EXPECT_EQ(reader.end() - reader.begin(), 1);
+}
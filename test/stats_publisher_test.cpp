@@ -0,0 +1,49 @@
+#include "mock_mqtt_client.h"
+#include "stats_publisher.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+
+using namespace std;
+using namespace WBMQTT;
+using namespace ::testing;
+
+TEST(TStatsPublisherTest, PublishTest)
+{
+    auto mqtt = make_shared<StrictMock<MockMQTTClient>>();
+    TStatsPublisher stats(mqtt, "mbgate_stats", chrono::seconds(10));
+
+    uint64_t value = 5;
+    stats.AddCounter("queued", [&] { return value; });
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/mbgate_stats/meta/name"),
+                                  Field(&TMqttMessage::Payload, "mbgate_stats"))));
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/mbgate_stats/controls/queued/meta/type"),
+                                  Field(&TMqttMessage::Payload, "value"))));
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/mbgate_stats/controls/queued/meta/readonly"),
+                                  Field(&TMqttMessage::Payload, "1"))));
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/mbgate_stats/controls/queued"),
+                                  Field(&TMqttMessage::Payload, "5"),
+                                  Field(&TMqttMessage::Retained, true))));
+        EXPECT_CALL(*mqtt,
+                    Publish(AllOf(Field(&TMqttMessage::Topic, "/devices/mbgate_stats/controls/queued"),
+                                  Field(&TMqttMessage::Payload, "6"))));
+    }
+
+    stats.Publish();
+
+    // unchanged value is not published again
+    stats.Publish();
+    stats.PublishIfDue();
+
+    value = 6;
+    stats.Publish();
+}
@@ -0,0 +1,155 @@
+#include "fake_modbus_backend.h"
+#include "mock_mqtt_client.h"
+#include "modbus_wrapper.h"
+#include "observer.h"
+#include "update_queue.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+using namespace std;
+using namespace WBMQTT;
+using namespace ::testing;
+
+class TUpdateQueueTest: public ::testing::Test
+{
+protected:
+    void SetUp()
+    {
+        Mqtt = make_shared<NiceMock<MockMQTTClient>>();
+        ModbusBackend = make_shared<TFakeModbusBackend>();
+        ModbusServer = make_shared<TModbusServer>(ModbusBackend);
+        Conv = make_shared<TMQTTIntConverter>(TMQTTIntConverter::UNSIGNED, 1.0, 2);
+    }
+
+    PGatewayObserver AddObserver(const string& topic, int address, TMqttMessageHandler& handler, PUpdateQueue queue)
+    {
+        EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>(topic))).WillOnce(SaveArg<0>(&handler));
+
+        auto obs = make_shared<TGatewayObserver>(topic, Conv, Mqtt);
+        obs->SetUpdateQueue(queue);
+        ModbusServer->Observe(obs, TStoreType::INPUT_REGISTER, TModbusAddressRange(address, 1));
+        return obs;
+    }
+
+    uint16_t Cached(int address)
+    {
+        return *static_cast<uint16_t*>(ModbusBackend->GetCache(INPUT_REGISTER, 0, address));
+    }
+
+    shared_ptr<NiceMock<MockMQTTClient>> Mqtt;
+    shared_ptr<TFakeModbusBackend> ModbusBackend;
+    shared_ptr<TModbusServer> ModbusServer;
+    PMQTTConverter Conv;
+};
+
+TEST_F(TUpdateQueueTest, CoalesceTest)
+{
+    auto queue = make_shared<TUpdateQueue>(4);
+    ModbusServer->SetUpdateQueue(queue);
+
+    TMqttMessageHandler a, b;
+    auto obs_a = AddObserver("/devices/device1/controls/a", 0, a, queue);
+    auto obs_b = AddObserver("/devices/device1/controls/b", 1, b, queue);
+    ModbusServer->AllocateCache();
+
+    for (int i = 1; i <= 100; ++i)
+        a(TMqttMessage("/devices/device1/controls/a", to_string(i), 0, false));
+    b(TMqttMessage("/devices/device1/controls/b", "7", 0, false));
+
+    // nothing is converted by MQTT thread
+    EXPECT_EQ(Cached(0), 0);
+    EXPECT_EQ(queue->GetStats().Depth, 2);
+
+    // server drains queue before query
+    uint8_t q[] = {0x04, 0x00, 0x00, 0x00, 0x02};
+    ModbusBackend->PushQuery(TModbusQuery(q, sizeof(q), 0));
+    ModbusServer->Loop();
+
+    ASSERT_EQ(ModbusBackend->RepliedPdus.size(), 1);
+    EXPECT_THAT(ModbusBackend->RepliedPdus.front(), ElementsAre(0x04, 0x04, 0x00, 0x64, 0x00, 0x07));
+
+    auto stats = queue->GetStats();
+    EXPECT_EQ(stats.Queued, 2);
+    EXPECT_EQ(stats.Coalesced, 99);
+    EXPECT_EQ(stats.Applied, 2);
+    EXPECT_EQ(stats.Depth, 0);
+    EXPECT_EQ(stats.MaxBatch, 2);
+    EXPECT_EQ(stats.Overflows, 0);
+
+    // applied observer is queued again
+    a(TMqttMessage("/devices/device1/controls/a", "5", 0, false));
+    EXPECT_EQ(queue->Drain(), 1);
+    EXPECT_EQ(Cached(0), 5);
+}
+
+TEST_F(TUpdateQueueTest, OverflowTest)
+{
+    auto queue = make_shared<TUpdateQueue>(2);
+
+    TMqttMessageHandler a, b, c;
+    auto obs_a = AddObserver("/devices/device1/controls/a", 0, a, queue);
+    auto obs_b = AddObserver("/devices/device1/controls/b", 1, b, queue);
+    auto obs_c = AddObserver("/devices/device1/controls/c", 2, c, queue);
+    ModbusServer->AllocateCache();
+
+    a(TMqttMessage("/devices/device1/controls/a", "1", 0, false));
+    b(TMqttMessage("/devices/device1/controls/b", "2", 0, false));
+    c(TMqttMessage("/devices/device1/controls/c", "3", 0, false));
+
+    // value which doesn't fit is converted immediately
+    EXPECT_EQ(Cached(0), 0);
+    EXPECT_EQ(Cached(1), 0);
+    EXPECT_EQ(Cached(2), 3);
+    EXPECT_EQ(queue->GetStats().Overflows, 1);
+
+    EXPECT_EQ(queue->Drain(), 2);
+    EXPECT_EQ(Cached(0), 1);
+    EXPECT_EQ(Cached(1), 2);
+}
+
+TEST_F(TUpdateQueueTest, FifoBypassTest)
+{
+    auto queue = make_shared<TUpdateQueue>(4);
+
+    TMqttMessageHandler handler;
+    EXPECT_CALL(*Mqtt, Subscribe(_, Matcher<const string&>("/devices/device1/controls/fifo")))
+        .WillOnce(SaveArg<0>(&handler));
+
+    // FIFO records every value, so it can't be coalesced
+    auto obs = make_shared<TGatewayObserver>("/devices/device1/controls/fifo", Conv, Mqtt, 4);
+    obs->SetUpdateQueue(queue);
+    ModbusServer->Observe(obs, TStoreType::HOLDING_REGISTER, TModbusAddressRange(0, 1));
+    ModbusServer->AllocateCache();
+
+    handler(TMqttMessage("/devices/device1/controls/fifo", "3", 0, false));
+
+    EXPECT_EQ(*static_cast<uint16_t*>(ModbusBackend->GetCache(HOLDING_REGISTER, 0, 0)), 3);
+    EXPECT_EQ(queue->GetStats().Queued, 0);
+}
+
+TEST_F(TUpdateQueueTest, WakeupTest)
+{
+    auto queue = make_shared<TUpdateQueue>(4);
+    ModbusServer->SetUpdateQueue(queue);
+
+    TMqttMessageHandler a, b;
+    auto obs_a = AddObserver("/devices/device1/controls/a", 0, a, queue);
+    auto obs_b = AddObserver("/devices/device1/controls/b", 1, b, queue);
+    ModbusServer->AllocateCache();
+
+    // only value coming to empty queue wakes idle server up
+    a(TMqttMessage("/devices/device1/controls/a", "1", 0, false));
+    b(TMqttMessage("/devices/device1/controls/b", "2", 0, false));
+    EXPECT_EQ(ModbusBackend->Wakeups, 1);
+
+    ModbusServer->Loop();
+    EXPECT_EQ(Cached(0), 1);
+    EXPECT_EQ(Cached(1), 2);
+
+    a(TMqttMessage("/devices/device1/controls/a", "3", 0, false));
+    EXPECT_EQ(ModbusBackend->Wakeups, 2);
+}